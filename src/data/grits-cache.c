@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-cache
+ * @short_description: Disk cache management
+ *
+ * The grits cache keeps track of the files downloaded by #GritsHttp and
+ * limits the amount of disk space they use. Quotas can be set for the cache as
+ * a whole and for each prefix in it. When a quota is exceeded the least
+ * recently used files are removed from a background thread.
+ *
+ * The cache also counts hits, misses and the number of bytes downloaded and
+ * served, which can be read with grits_cache_get_stats().
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "grits-cache.h"
+
+/* Evict files until usage is below this fraction of the quota */
+#define EVICT_LOW 0.9
+
+/* For tracking each file in the cache */
+struct _GritsCacheFile {
+	guint64 size;
+	gint64  atime;
+};
+
+/* For tracking each prefix in the cache */
+struct _GritsCachePrefix {
+	gchar           *prefix;
+	gchar           *dir;
+	GritsPack       *pack;
+	gint             pack_users;
+	GHashTable      *files;
+	guint64          quota;
+	gboolean         scanned;
+	GritsCacheStats  stats;
+};
+
+static GMutex       _lock;
+static GHashTable  *_prefixes;
+static GThreadPool *_pool;
+static guint64      _quota;
+static gboolean     _evicting;
+static GritsCacheStats _stats;
+
+/* Background job to run eviction */
+static gchar _evict_job;
+
+/* Called with the lock held */
+static struct _GritsCachePrefix *_grits_cache_prefix(const gchar *prefix)
+{
+	if (!_prefixes)
+		_prefixes = g_hash_table_new(g_str_hash, g_str_equal);
+	struct _GritsCachePrefix *cache = g_hash_table_lookup(_prefixes, prefix);
+	if (!cache) {
+		cache = g_new0(struct _GritsCachePrefix, 1);
+		cache->prefix = g_strdup(prefix);
+		cache->dir    = g_build_filename(g_get_user_cache_dir(),
+				PACKAGE, prefix, NULL);
+		cache->files  = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, g_free);
+		g_hash_table_insert(_prefixes, cache->prefix, cache);
+	}
+	return cache;
+}
+
+/* Bytes used by a prefix, unused space in the pack is left for the pack to
+ * compact on its own. Called with the lock held */
+static guint64 _grits_cache_used(struct _GritsCachePrefix *cache)
+{
+	return cache->stats.used + (cache->pack ?
+			grits_pack_get_used(cache->pack) : 0);
+}
+
+/* Bytes used by the whole cache. Called with the lock held */
+static guint64 _grits_cache_total(void)
+{
+	guint64 total = 0;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, _prefixes);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		total += _grits_cache_used(value);
+	return total;
+}
+
+/* Add or update a file. Called with the lock held */
+static void _grits_cache_set(struct _GritsCachePrefix *cache,
+		const gchar *local, guint64 size, gint64 atime)
+{
+	struct _GritsCacheFile *file = g_hash_table_lookup(cache->files, local);
+	if (!file) {
+		file = g_new0(struct _GritsCacheFile, 1);
+		g_hash_table_insert(cache->files, g_strdup(local), file);
+	}
+	cache->stats.used -= file->size;
+	_stats.used       -= file->size;
+	file->size  = size;
+	file->atime = MAX(file->atime, atime);
+	cache->stats.used += file->size;
+	_stats.used       += file->size;
+}
+
+/* Remove a file. Called with the lock held */
+static void _grits_cache_unset(struct _GritsCachePrefix *cache,
+		const gchar *local)
+{
+	struct _GritsCacheFile *file = g_hash_table_lookup(cache->files, local);
+	if (file) {
+		cache->stats.used -= file->size;
+		_stats.used       -= file->size;
+		g_hash_table_remove(cache->files, local);
+	}
+}
+
+/* Find the files already in the cache */
+static void _grits_cache_scan(struct _GritsCachePrefix *cache,
+		const gchar *dir, const gchar *rel)
+{
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+	const gchar *name;
+	while (gdir && (name = g_dir_read_name(gdir))) {
+		/* Skip partial downloads, metadata and packs */
+		if (g_str_has_suffix(name, ".part") ||
+		    g_str_has_suffix(name, ".meta") ||
+		    g_str_has_prefix(name, "pack."))
+			continue;
+		gchar *path  = g_build_filename(dir, name, NULL);
+		gchar *local = rel ? g_build_filename(rel, name, NULL) : g_strdup(name);
+		GStatBuf st;
+		if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+			_grits_cache_scan(cache, path, local);
+		} else if (!g_stat(path, &st)) {
+			g_mutex_lock(&_lock);
+			if (!g_hash_table_lookup(cache->files, local))
+				_grits_cache_set(cache, local, st.st_size, st.st_mtime);
+			g_mutex_unlock(&_lock);
+		}
+		g_free(path);
+		g_free(local);
+	}
+	if (gdir)
+		g_dir_close(gdir);
+}
+
+/* Sort files from least to most recently used */
+static gint _grits_cache_cmp_atime(gconstpointer _a, gconstpointer _b)
+{
+	const struct _GritsCacheFile *a = ((gpointer*)_a)[1];
+	const struct _GritsCacheFile *b = ((gpointer*)_b)[1];
+	return a->atime < b->atime ? -1 :
+	       a->atime > b->atime ?  1 : 0;
+}
+
+/* Remove the least recently used files from a prefix until @bytes have been
+ * freed, then remove them from the disk. */
+static void _grits_cache_evict(struct _GritsCachePrefix *cache, guint64 bytes)
+{
+	g_debug("GritsCache: evict - %s %"G_GUINT64_FORMAT" bytes",
+			cache->prefix, bytes);
+
+	/* Evict from the pack in proportion to its share of the usage,
+	 * the pack is referenced in case it is unregistered meanwhile */
+	g_mutex_lock(&_lock);
+	GritsPack *pack = cache->pack ? grits_pack_ref(cache->pack) : NULL;
+	guint64 packed = pack ? grits_pack_get_used(pack) : 0;
+	guint64 total  = packed + cache->stats.used;
+	guint64 unpack = total ? (gdouble)bytes * cache->stats.used / total : 0;
+	g_mutex_unlock(&_lock);
+	if (packed > 0 && bytes > unpack) {
+		guint count = grits_pack_evict(pack, bytes - unpack);
+		g_mutex_lock(&_lock);
+		cache->stats.evictions += count;
+		_stats.evictions       += count;
+		g_mutex_unlock(&_lock);
+	}
+	if (pack)
+		grits_pack_close(pack);
+
+	/* Pick files to remove */
+	g_mutex_lock(&_lock);
+	GArray *files = g_array_new(FALSE, FALSE, sizeof(gpointer)*2);
+	GHashTableIter iter;
+	gpointer pair[2];
+	g_hash_table_iter_init(&iter, cache->files);
+	while (g_hash_table_iter_next(&iter, &pair[0], &pair[1]))
+		g_array_append_val(files, pair);
+	g_array_sort(files, _grits_cache_cmp_atime);
+	GSList *victims = NULL;
+	guint64 freed = 0;
+	for (guint i = 0; i < files->len && freed < unpack; i++) {
+		gpointer *file = &g_array_index(files, gpointer, i*2);
+		freed  += ((struct _GritsCacheFile*)file[1])->size;
+		victims = g_slist_prepend(victims, g_strdup(file[0]));
+	}
+	g_array_free(files, TRUE);
+	for (GSList *cur = victims; cur; cur = cur->next)
+		_grits_cache_unset(cache, cur->data);
+	guint count = g_slist_length(victims);
+	cache->stats.evictions += count;
+	_stats.evictions       += count;
+	g_mutex_unlock(&_lock);
+
+	/* Remove them along with their metadata */
+	for (GSList *cur = victims; cur; cur = cur->next) {
+		gchar *path = g_build_filename(cache->dir, cur->data, NULL);
+		gchar *meta = g_strconcat(path, ".meta", NULL);
+		g_remove(path);
+		g_remove(meta);
+		g_free(path);
+		g_free(meta);
+	}
+	g_slist_free_full(victims, g_free);
+}
+
+/* Bring all prefixes within their quotas, then the cache within the global
+ * quota by evicting from each prefix in proportion to its usage */
+static void _grits_cache_evict_all(void)
+{
+	g_mutex_lock(&_lock);
+	_evicting = FALSE;
+	GList *caches = g_hash_table_get_values(_prefixes);
+	g_mutex_unlock(&_lock);
+
+	guint64 total = 0;
+	for (GList *cur = caches; cur; cur = cur->next) {
+		struct _GritsCachePrefix *cache = cur->data;
+		g_mutex_lock(&_lock);
+		guint64 used = _grits_cache_used(cache);
+		g_mutex_unlock(&_lock);
+		if (cache->quota && used > cache->quota) {
+			_grits_cache_evict(cache, used - cache->quota*EVICT_LOW);
+			g_mutex_lock(&_lock);
+			used = _grits_cache_used(cache);
+			g_mutex_unlock(&_lock);
+		}
+		total += used;
+	}
+
+	if (_quota && total > _quota) {
+		guint64 bytes = total - _quota*EVICT_LOW;
+		for (GList *cur = caches; cur; cur = cur->next) {
+			struct _GritsCachePrefix *cache = cur->data;
+			g_mutex_lock(&_lock);
+			guint64 used = _grits_cache_used(cache);
+			g_mutex_unlock(&_lock);
+			if (used > 0)
+				_grits_cache_evict(cache, (gdouble)bytes * used / total + 1);
+		}
+	}
+	g_list_free(caches);
+}
+
+/* Background jobs, a prefix to scan or the eviction job */
+static void _grits_cache_thread(gpointer job, gpointer _)
+{
+	if (job != &_evict_job) {
+		struct _GritsCachePrefix *cache = job;
+		_grits_cache_scan(cache, cache->dir, NULL);
+	}
+	_grits_cache_evict_all();
+}
+
+/* Queue a background job. Called with the lock held */
+static void _grits_cache_queue(gpointer job)
+{
+	if (!_pool)
+		_pool = g_thread_pool_new(_grits_cache_thread, NULL, 1, FALSE, NULL);
+	if (job == &_evict_job)
+		_evicting = TRUE;
+	g_thread_pool_push(_pool, job, NULL);
+}
+
+/* Check quotas after adding data. Called with the lock held */
+static void _grits_cache_check(struct _GritsCachePrefix *cache)
+{
+	if (_evicting)
+		return;
+	if ((cache->quota && _grits_cache_used(cache) > cache->quota) ||
+	    (_quota && _grits_cache_total() > _quota))
+		_grits_cache_queue(&_evict_job);
+}
+
+/**
+ * grits_cache_register:
+ * @prefix: the prefix in the cache
+ * @pack:   the pack used by the prefix, or NULL
+ *
+ * Start tracking the files stored under a prefix in the cache. The files
+ * already in the cache are found from a background thread.
+ *
+ * The cache does not keep its own reference to @pack, it is used until
+ * grits_cache_unregister() has been called for every registration.
+ */
+void grits_cache_register(const gchar *prefix, GritsPack *pack)
+{
+	g_mutex_lock(&_lock);
+	struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+	if (pack && !cache->pack)
+		cache->pack = pack;
+	if (pack && cache->pack == pack)
+		cache->pack_users++;
+	if (!cache->scanned) {
+		g_debug("GritsCache: register - %s", prefix);
+		cache->scanned = TRUE;
+		_grits_cache_queue(cache);
+	}
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_unregister:
+ * @prefix: the prefix in the cache
+ * @pack:   the pack passed to grits_cache_register(), or NULL
+ *
+ * Stop using the pack registered for a prefix, this must be called before the
+ * pack is closed. The files in the prefix are still tracked.
+ */
+void grits_cache_unregister(const gchar *prefix, GritsPack *pack)
+{
+	g_mutex_lock(&_lock);
+	struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+	if (pack && cache->pack == pack && --cache->pack_users == 0)
+		cache->pack = NULL;
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_set_quota:
+ * @prefix: the prefix in the cache, or NULL for the whole cache
+ * @quota:  the maximum number of bytes to store, or 0 for no limit
+ *
+ * Limit the size of the cache.
+ */
+void grits_cache_set_quota(const gchar *prefix, guint64 quota)
+{
+	g_debug("GritsCache: set_quota - %s %"G_GUINT64_FORMAT,
+			prefix ?: "(all)", quota);
+	g_mutex_lock(&_lock);
+	if (prefix)
+		_grits_cache_prefix(prefix)->quota = quota;
+	else
+		_quota = quota;
+	_grits_cache_queue(&_evict_job);
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_get_stats:
+ * @prefix: the prefix in the cache, or NULL for the whole cache
+ * @stats:  location to store the statistics
+ *
+ * Get the cache counters since the program was started.
+ */
+void grits_cache_get_stats(const gchar *prefix, GritsCacheStats *stats)
+{
+	g_mutex_lock(&_lock);
+	if (prefix) {
+		struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+		*stats = cache->stats;
+		stats->used = _grits_cache_used(cache);
+	} else {
+		*stats = _stats;
+		stats->used = _grits_cache_total();
+	}
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_hit:
+ * @prefix: the prefix in the cache
+ * @local:  the local name of the file, or NULL if it is stored in a pack
+ * @size:   the size of the file
+ *
+ * Record that a file was served from the cache.
+ */
+void grits_cache_hit(const gchar *prefix, const gchar *local, guint64 size)
+{
+	g_mutex_lock(&_lock);
+	struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+	if (local)
+		_grits_cache_set(cache, local, size, g_get_real_time()/G_USEC_PER_SEC);
+	cache->stats.hits++;
+	cache->stats.served += size;
+	_stats.hits++;
+	_stats.served += size;
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_miss:
+ * @prefix: the prefix in the cache
+ *
+ * Record that a file had to be downloaded.
+ */
+void grits_cache_miss(const gchar *prefix)
+{
+	g_mutex_lock(&_lock);
+	_grits_cache_prefix(prefix)->stats.misses++;
+	_stats.misses++;
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_store:
+ * @prefix:     the prefix in the cache
+ * @local:      the local name of the file, or NULL if it is stored in a pack
+ * @size:       the size of the file
+ * @downloaded: the number of bytes downloaded
+ *
+ * Record that a file was added to the cache, files may be evicted if this
+ * puts the cache over its quota.
+ */
+void grits_cache_store(const gchar *prefix, const gchar *local,
+		guint64 size, guint64 downloaded)
+{
+	g_mutex_lock(&_lock);
+	struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+	if (local)
+		_grits_cache_set(cache, local, size, g_get_real_time()/G_USEC_PER_SEC);
+	cache->stats.downloaded += downloaded;
+	_stats.downloaded       += downloaded;
+	_grits_cache_check(cache);
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * grits_cache_remove:
+ * @prefix: the prefix in the cache
+ * @local:  the local name of the file
+ *
+ * Record that a file was removed from the cache, or moved into a pack.
+ */
+void grits_cache_remove(const gchar *prefix, const gchar *local)
+{
+	g_mutex_lock(&_lock);
+	struct _GritsCachePrefix *cache = _grits_cache_prefix(prefix);
+	_grits_cache_unset(cache, local);
+	_grits_cache_check(cache);
+	g_mutex_unlock(&_lock);
+}
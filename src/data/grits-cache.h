@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_CACHE_H__
+#define __GRITS_CACHE_H__
+
+#include <glib.h>
+
+#include "grits-pack.h"
+
+/**
+ * GritsCacheStats:
+ * @hits:       number of requests served from the cache
+ * @misses:     number of requests which had to be downloaded
+ * @downloaded: number of bytes downloaded
+ * @served:     number of bytes served from the cache
+ * @evictions:  number of files removed to stay within the quota
+ * @used:       number of bytes currently stored in the cache
+ *
+ * Cache counters for a single prefix or for the whole cache
+ */
+typedef struct _GritsCacheStats {
+	guint64 hits;
+	guint64 misses;
+	guint64 downloaded;
+	guint64 served;
+	guint64 evictions;
+	guint64 used;
+} GritsCacheStats;
+
+void grits_cache_register(const gchar *prefix, GritsPack *pack);
+
+void grits_cache_unregister(const gchar *prefix, GritsPack *pack);
+
+void grits_cache_set_quota(const gchar *prefix, guint64 quota);
+
+void grits_cache_get_stats(const gchar *prefix, GritsCacheStats *stats);
+
+void grits_cache_hit(const gchar *prefix, const gchar *local, guint64 size);
+
+void grits_cache_miss(const gchar *prefix);
+
+void grits_cache_store(const gchar *prefix, const gchar *local,
+		guint64 size, guint64 downloaded);
+
+void grits_cache_remove(const gchar *prefix, const gchar *local);
+
+#endif
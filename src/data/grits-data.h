@@ -26,6 +26,8 @@
  * @GRITS_ONCE:    Download the file only if it does not exist
  * @GRITS_UPDATE:  Update the file to be like the server
  * @GRITS_REFRESH: Delete the existing file and fetch a new copy
+ * @GRITS_REVALIDATE: Use the existing file while it is fresh, otherwise ask
+ *                    the server whether it has changed before fetching it
  *
  * Various methods for caching data
  */
@@ -34,6 +36,7 @@ typedef enum {
 	GRITS_ONCE,
 	GRITS_UPDATE,
 	GRITS_REFRESH,
+	GRITS_REVALIDATE,
 } GritsCacheType;
 
 /**
@@ -0,0 +1,692 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-dem
+ * @short_description: Digital elevation models
+ *
+ * #GritsDem stores a grid of elevation samples for a latitude/longitude box and
+ * interpolates the elevation of points within it.
+ *
+ * Sample (0,0) is at the north-west corner of the box and the samples for the
+ * southern and eastern edges belong to the neighboring grids. Each grid keeps
+ * a copy of those samples as an extra column and row, so interpolating points
+ * near the edges needs no special cases and matches the neighboring grids.
+ *
+ * A min/max pyramid is kept for each grid so that the elevation range of an
+ * area can be found without reading every sample. Each block in the pyramid
+ * includes the first row and column of the blocks after it, so the range also
+ * bounds the interpolated surface between the samples.
+ *
+ * Grids can also be stored in a compact format with grits_dem_encode(). The
+ * samples are replaced by the difference from the previous sample, which is
+ * small for most terrain, and the low and high bytes of the differences are
+ * split up and compressed with deflate. The first level of the min/max pyramid
+ * is included so that it does not need to be recalculated when loading.
+ *
+ * #GritsDemFile reads elevation data from local files so that it can be merged
+ * into grids which were downloaded. Files are in the ESRI BIL format with a
+ * single band of signed 16-bit samples in latitude/longitude coordinates, and
+ * the size and location of the grid are read from the .hdr file next to them.
+ */
+
+#include <config.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "grits-dem.h"
+
+/* Bilinear interpolation, positions are clamped to the grid so that the
+ * furthest sample which can be read is in the padding */
+static inline gdouble _grits_dem_sample(const GritsDem *dem,
+		gdouble lat, gdouble lon)
+{
+	gdouble x  = CLAMP((lon - dem->edge.w) * dem->xscale, 0, dem->width);
+	gdouble y  = CLAMP((dem->edge.n - lat) * dem->yscale, 0, dem->height);
+	gint    c  = MIN((gint)x, dem->width-1);
+	gint    r  = MIN((gint)y, dem->height-1);
+	gdouble fx = x - c;
+	gdouble fy = y - r;
+
+	const gint16 *nw = &dem->data[r*dem->stride + c];
+	const gint16 *sw = nw + dem->stride;
+	gdouble n = nw[0] + (nw[1] - nw[0]) * fx;
+	gdouble s = sw[0] + (sw[1] - sw[0]) * fx;
+	return n + (s - n) * fy;
+}
+
+/* Sample the neighboring grid which contains the point offset by dlat/dlon,
+ * which is just past the edge of @dem */
+static gint16 _grits_dem_pad(GritsDem *dem, gdouble lat, gdouble lon,
+		gdouble dlat, gdouble dlon, gint16 fallback,
+		GritsDemFindFunc find, gpointer user_data)
+{
+	GritsDem *next = find(lat + dlat, lon + dlon, user_data);
+	if (!next || next == dem)
+		return fallback;
+	return floor(_grits_dem_sample(next, lat, lon) + 0.5);
+}
+
+/* Number of blocks in each row and column of a pyramid level */
+static void _grits_dem_blocks(GritsDem *dem, gint level, gint *cols, gint *rows)
+{
+	gint size = GRITS_DEM_BLOCK << level;
+	*cols = (dem->width  + size-1) / size;
+	*rows = (dem->height + size-1) / size;
+}
+
+/* Fill in the min/max pyramid from the samples, the first level is read from
+ * the grid and each level after that combines 2x2 blocks from the previous.
+ * Unless @all is set only the blocks along the south and east edges, which
+ * include the padding, are read from the grid. */
+static void _grits_dem_update_ranges(GritsDem *dem, gboolean all)
+{
+	gint cols, rows;
+	_grits_dem_blocks(dem, 0, &cols, &rows);
+	for (gint br = 0; br < rows; br++)
+	for (gint bc = 0; bc < cols; bc++) {
+		if (!all && br < rows-1 && bc < cols-1)
+			continue;
+		gint r0 = br*GRITS_DEM_BLOCK, r1 = MIN(r0+GRITS_DEM_BLOCK, dem->height);
+		gint c0 = bc*GRITS_DEM_BLOCK, c1 = MIN(c0+GRITS_DEM_BLOCK, dem->width);
+		GritsDemRange range = {G_MAXINT16, G_MININT16};
+		for (gint r = r0; r <= r1; r++)
+		for (gint c = c0; c <= c1; c++) {
+			gint16 value = dem->data[r*dem->stride + c];
+			range.min = MIN(range.min, value);
+			range.max = MAX(range.max, value);
+		}
+		dem->ranges[0][br*cols + bc] = range;
+	}
+
+	for (gint level = 1; level < dem->levels; level++) {
+		gint pcols = cols, prows = rows;
+		GritsDemRange *prev = dem->ranges[level-1];
+		_grits_dem_blocks(dem, level, &cols, &rows);
+		for (gint br = 0; br < rows; br++)
+		for (gint bc = 0; bc < cols; bc++) {
+			GritsDemRange range = {G_MAXINT16, G_MININT16};
+			for (gint r = br*2; r < MIN(br*2+2, prows); r++)
+			for (gint c = bc*2; c < MIN(bc*2+2, pcols); c++) {
+				range.min = MIN(range.min, prev[r*pcols + c].min);
+				range.max = MAX(range.max, prev[r*pcols + c].max);
+			}
+			dem->ranges[level][br*cols + bc] = range;
+		}
+	}
+}
+
+/* Header of the compact format, all values are little endian and the
+ * compressed data follows it */
+typedef struct {
+	gchar   magic[4];
+	guint16 version;
+	guint16 width;
+	guint16 height;
+	guint16 blocks;
+} GritsDemHeader;
+
+#define GRITS_DEM_MAGIC   "GDEM"
+#define GRITS_DEM_VERSION 1
+
+/* Run all of @in through a compressor or decompressor, @hint is the expected
+ * size of the output */
+static guint8 *_grits_dem_convert(GConverter *conv, const guint8 *in, gsize len,
+		gsize hint, gsize *out_len)
+{
+	GError *error = NULL;
+	gsize   size  = MAX(hint, 1024), used = 0;
+	guint8 *out   = g_malloc(size);
+	while (TRUE) {
+		gsize read = 0, written = 0;
+		GConverterResult res = g_converter_convert(conv, in, len,
+				out+used, size-used, G_CONVERTER_INPUT_AT_END,
+				&read, &written, &error);
+		if (res == G_CONVERTER_ERROR) {
+			if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+				g_debug("GritsDem: convert - %s", error->message);
+				g_error_free(error);
+				g_free(out);
+				return NULL;
+			}
+			g_clear_error(&error);
+			out = g_realloc(out, size *= 2);
+			continue;
+		}
+		in   += read;
+		len  -= read;
+		used += written;
+		if (res == G_CONVERTER_FINISHED)
+			break;
+		if (read == 0 && written == 0) {
+			g_debug("GritsDem: convert - truncated data");
+			g_free(out);
+			return NULL;
+		}
+		if (used == size)
+			out = g_realloc(out, size *= 2);
+	}
+	*out_len = used;
+	return out;
+}
+
+/* Allocate a grid and its min/max pyramid, without filling them in */
+static GritsDem *_grits_dem_alloc(GritsBounds *edge, gint width, gint height)
+{
+	GritsDem *dem = g_new0(GritsDem, 1);
+	dem->edge   = *edge;
+	dem->width  = width;
+	dem->height = height;
+	dem->stride = width + 1;
+	dem->xscale = width  / (edge->e - edge->w);
+	dem->yscale = height / (edge->n - edge->s);
+	dem->data   = g_new(gint16, dem->stride * (height + 1));
+
+	/* Min/max pyramid, down to a single block */
+	gint cols, rows;
+	do _grits_dem_blocks(dem, dem->levels++, &cols, &rows);
+	while (cols > 1 || rows > 1);
+	dem->ranges = g_new(GritsDemRange*, dem->levels);
+	for (gint level = 0; level < dem->levels; level++) {
+		_grits_dem_blocks(dem, level, &cols, &rows);
+		dem->ranges[level] = g_new(GritsDemRange, cols * rows);
+	}
+	return dem;
+}
+
+/* Repeat the edge samples in the padding */
+static void _grits_dem_repeat_edges(GritsDem *dem)
+{
+	for (gint r = 0; r < dem->height; r++)
+		dem->data[r*dem->stride + dem->width] =
+			dem->data[r*dem->stride + dem->width-1];
+	memcpy(&dem->data[dem->height*dem->stride],
+	       &dem->data[(dem->height-1)*dem->stride],
+	       dem->stride * sizeof(gint16));
+}
+
+/**
+ * grits_dem_new:
+ * @edge:    the area covered by the samples
+ * @width:   number of samples in each row
+ * @height:  number of rows
+ * @samples: the samples, row by row starting from the north-west corner, or
+ *           NULL to start with every sample at sea level
+ *
+ * Create an elevation grid from a copy of @samples. Until the neighbors are
+ * set the edge samples are repeated in the padding.
+ *
+ * Returns: the new #GritsDem
+ */
+GritsDem *grits_dem_new(GritsBounds *edge, gint width, gint height,
+		const gint16 *samples)
+{
+	GritsDem *dem = _grits_dem_alloc(edge, width, height);
+	for (gint r = 0; r < height; r++) {
+		if (samples)
+			memcpy(&dem->data[r*dem->stride], &samples[r*width],
+					width * sizeof(gint16));
+		else
+			memset(&dem->data[r*dem->stride], 0,
+					width * sizeof(gint16));
+	}
+	_grits_dem_repeat_edges(dem);
+	_grits_dem_update_ranges(dem, TRUE);
+	return dem;
+}
+
+/**
+ * grits_dem_set_padding:
+ * @dem:       the #GritsDem to update
+ * @find:      function used to find the grid containing a point
+ * @user_data: user data to pass to @find
+ *
+ * Fill in the padding of @dem from the neighboring grids. The neighbors do
+ * not need to have the same resolution, they are interpolated at the
+ * location of each padding sample. Padding without a neighbor repeats the
+ * edge samples of @dem.
+ */
+void grits_dem_set_padding(GritsDem *dem, GritsDemFindFunc find, gpointer user_data)
+{
+	gint    w  = dem->width, h = dem->height, stride = dem->stride;
+	gdouble dx = 0.5 / dem->xscale;
+	gdouble dy = 0.5 / dem->yscale;
+	for (gint r = 0; r < h; r++)
+		dem->data[r*stride + w] = _grits_dem_pad(dem,
+				dem->edge.n - r/dem->yscale, dem->edge.e, 0, dx,
+				dem->data[r*stride + w-1], find, user_data);
+	for (gint c = 0; c < w; c++)
+		dem->data[h*stride + c] = _grits_dem_pad(dem,
+				dem->edge.s, dem->edge.w + c/dem->xscale, -dy, 0,
+				dem->data[(h-1)*stride + c], find, user_data);
+	dem->data[h*stride + w] = _grits_dem_pad(dem,
+			dem->edge.s, dem->edge.e, -dy, dx,
+			dem->data[(h-1)*stride + w-1], find, user_data);
+	_grits_dem_update_ranges(dem, FALSE);
+}
+
+/**
+ * grits_dem_sample:
+ * @dem: the #GritsDem to sample
+ * @lat: the latitude of the point
+ * @lon: the longitude of the point
+ *
+ * Interpolate the elevation at a point. Points outside of the grid are moved
+ * to the nearest edge.
+ *
+ * Returns: the elevation in meters
+ */
+gdouble grits_dem_sample(GritsDem *dem, gdouble lat, gdouble lon)
+{
+	return _grits_dem_sample(dem, lat, lon);
+}
+
+/**
+ * grits_dem_sample_many:
+ * @dem:   the #GritsDem to sample
+ * @lat:   the latitudes of the points
+ * @lon:   the longitudes of the points
+ * @elev:  location to store the elevation of each point
+ * @count: the number of points
+ *
+ * Interpolate the elevation at many points. This is the same as calling
+ * grits_dem_sample() for each point, but the loop has no branches or calls so
+ * the compiler can vectorize it.
+ */
+void grits_dem_sample_many(GritsDem *dem, const gdouble *restrict lat,
+		const gdouble *restrict lon, gdouble *restrict elev, gsize count)
+{
+	const GritsDem dem_copy = *dem;
+	for (gsize i = 0; i < count; i++)
+		elev[i] = _grits_dem_sample(&dem_copy, lat[i], lon[i]);
+}
+
+/**
+ * grits_dem_get_range:
+ * @dem:    the #GritsDem to check
+ * @bounds: the area to check
+ * @min:    location to store the lowest elevation
+ * @max:    location to store the highest elevation
+ *
+ * Find the range of elevations within an area using the min/max pyramid. The
+ * range is conservative, it covers the whole blocks which overlap @bounds so
+ * it may be slightly larger than the range of the area itself.
+ *
+ * Returns: %FALSE if @bounds does not overlap @dem
+ */
+gboolean grits_dem_get_range(GritsDem *dem, GritsBounds *bounds,
+		gdouble *min, gdouble *max)
+{
+	if (bounds->n < dem->edge.s || bounds->s > dem->edge.n ||
+	    bounds->e < dem->edge.w || bounds->w > dem->edge.e)
+		return FALSE;
+
+	/* Samples covering the area */
+	gint c0 = CLAMP(floor((bounds->w - dem->edge.w) * dem->xscale), 0, dem->width-1);
+	gint c1 = CLAMP(floor((bounds->e - dem->edge.w) * dem->xscale), 0, dem->width-1);
+	gint r0 = CLAMP(floor((dem->edge.n - bounds->n) * dem->yscale), 0, dem->height-1);
+	gint r1 = CLAMP(floor((dem->edge.n - bounds->s) * dem->yscale), 0, dem->height-1);
+
+	/* Use the smallest blocks which cover the area in a few lookups */
+	gint level = 0, size = GRITS_DEM_BLOCK;
+	while (level+1 < dem->levels &&
+	       (c1/size - c0/size + 1) * (r1/size - r0/size + 1) > 16)
+		level++, size <<= 1;
+
+	gint cols, rows;
+	_grits_dem_blocks(dem, level, &cols, &rows);
+	GritsDemRange range = {G_MAXINT16, G_MININT16};
+	for (gint br = r0/size; br <= r1/size; br++)
+	for (gint bc = c0/size; bc <= c1/size; bc++) {
+		range.min = MIN(range.min, dem->ranges[level][br*cols + bc].min);
+		range.max = MAX(range.max, dem->ranges[level][br*cols + bc].max);
+	}
+	*min = range.min;
+	*max = range.max;
+	return TRUE;
+}
+
+static inline gint16 _grits_dem_file_get(GritsDemFile *file, gint r, gint c)
+{
+	gint16 value = file->data[r*file->width + c];
+	return file->big ? GINT16_FROM_BE(value) : GINT16_FROM_LE(value);
+}
+
+/**
+ * grits_dem_fill:
+ * @dem:  the #GritsDem to update
+ * @file: the file to read samples from
+ *
+ * Replace the samples of @dem which are covered by @file. The samples in the
+ * file are interpolated at the location of each sample in @dem, samples near
+ * missing data in the file are left alone. This should be called before the
+ * padding of @dem is set.
+ *
+ * Returns: the number of samples which were replaced
+ */
+gint grits_dem_fill(GritsDem *dem, GritsDemFile *file)
+{
+	gint count = 0;
+	for (gint r = 0; r < dem->height; r++) {
+		gdouble y = (file->edge.n - (dem->edge.n - r/dem->yscale)) * file->yscale;
+		if (y < 0 || y > file->height-1)
+			continue;
+		gint    fr = MIN((gint)y, file->height-2);
+		gdouble fy = y - fr;
+		for (gint c = 0; c < dem->width; c++) {
+			gdouble x = (dem->edge.w + c/dem->xscale - file->edge.w) * file->xscale;
+			if (x < 0 || x > file->width-1)
+				continue;
+			gint    fc = MIN((gint)x, file->width-2);
+			gdouble fx = x - fc;
+			gint16 nw = _grits_dem_file_get(file, fr,   fc  );
+			gint16 ne = _grits_dem_file_get(file, fr,   fc+1);
+			gint16 sw = _grits_dem_file_get(file, fr+1, fc  );
+			gint16 se = _grits_dem_file_get(file, fr+1, fc+1);
+			if (nw == file->nodata || ne == file->nodata ||
+			    sw == file->nodata || se == file->nodata)
+				continue;
+			gdouble n = nw + (ne - nw) * fx;
+			gdouble s = sw + (se - sw) * fx;
+			dem->data[r*dem->stride + c] = floor(n + (s - n) * fy + 0.5);
+			count++;
+		}
+	}
+	if (count) {
+		_grits_dem_repeat_edges(dem);
+		_grits_dem_update_ranges(dem, TRUE);
+	}
+	return count;
+}
+
+/**
+ * grits_dem_file_covers:
+ * @file: the file to check
+ * @edge: the area to check
+ *
+ * Check whether @file has samples for all of @edge without any missing data,
+ * in which case grits_dem_fill() replaces every sample of a grid covering
+ * @edge. Only the samples of the file under @edge are read.
+ *
+ * Returns: %TRUE if @file covers all of @edge
+ */
+gboolean grits_dem_file_covers(GritsDemFile *file, GritsBounds *edge)
+{
+	if (file->edge.n < edge->n || file->edge.s > edge->s ||
+	    file->edge.e < edge->e || file->edge.w > edge->w)
+		return FALSE;
+	gint r0 = MAX(0,              floor((file->edge.n - edge->n) * file->yscale));
+	gint r1 = MIN(file->height-1, ceil ((file->edge.n - edge->s) * file->yscale));
+	gint c0 = MAX(0,              floor((edge->w - file->edge.w) * file->xscale));
+	gint c1 = MIN(file->width-1,  ceil ((edge->e - file->edge.w) * file->xscale));
+	for (gint r = r0; r <= r1; r++)
+		for (gint c = c0; c <= c1; c++)
+			if (_grits_dem_file_get(file, r, c) == file->nodata)
+				return FALSE;
+	return TRUE;
+}
+
+/**
+ * grits_dem_encode:
+ * @dem: the #GritsDem to encode
+ *
+ * Store the samples of @dem in the compact format, which can be loaded with
+ * grits_dem_decode(). The padding is not included.
+ *
+ * Returns: the encoded grid, or NULL on error
+ */
+GBytes *grits_dem_encode(GritsDem *dem)
+{
+	gint   w = dem->width, h = dem->height;
+	gint   cols, rows;
+	_grits_dem_blocks(dem, 0, &cols, &rows);
+	gsize  nranges = cols * rows * sizeof(GritsDemRange);
+	gsize  nplane  = w * h;
+	guint8 *raw    = g_malloc(nranges + nplane*2);
+
+	/* Ranges */
+	GritsDemRange *ranges = (GritsDemRange*)raw;
+	for (gint i = 0; i < cols*rows; i++) {
+		ranges[i].min = GINT16_TO_LE(dem->ranges[0][i].min);
+		ranges[i].max = GINT16_TO_LE(dem->ranges[0][i].max);
+	}
+
+	/* Differences from the previous sample, the first sample in each row
+	 * is relative to the first sample of the row above */
+	guint8 *lo = raw + nranges, *hi = lo + nplane;
+	for (gint r = 0; r < h; r++) {
+		const gint16 *row  = &dem->data[r*dem->stride];
+		guint16       prev = r > 0 ? row[-dem->stride] : 0;
+		for (gint c = 0; c < w; c++) {
+			guint16 delta = (guint16)row[c] - prev;
+			lo[r*w + c] = delta;
+			hi[r*w + c] = delta >> 8;
+			prev = row[c];
+		}
+	}
+
+	GConverter *conv = G_CONVERTER(g_zlib_compressor_new(
+				G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+	gsize   zlen;
+	guint8 *zdata = _grits_dem_convert(conv, raw, nranges + nplane*2,
+			nplane/2, &zlen);
+	g_object_unref(conv);
+	g_free(raw);
+	if (!zdata)
+		return NULL;
+
+	GritsDemHeader header = {
+		.version = GUINT16_TO_LE(GRITS_DEM_VERSION),
+		.width   = GUINT16_TO_LE(w),
+		.height  = GUINT16_TO_LE(h),
+		.blocks  = GUINT16_TO_LE(cols * rows),
+	};
+	memcpy(header.magic, GRITS_DEM_MAGIC, 4);
+	guint8 *out = g_malloc(sizeof(header) + zlen);
+	memcpy(out, &header, sizeof(header));
+	memcpy(out + sizeof(header), zdata, zlen);
+	g_free(zdata);
+	g_debug("GritsDem: encode - %ld bytes -> %ld bytes",
+			(glong)(nplane * sizeof(gint16)),
+			(glong)(sizeof(header) + zlen));
+	return g_bytes_new_take(out, sizeof(header) + zlen);
+}
+
+/**
+ * grits_dem_decode:
+ * @edge:   the area covered by the samples
+ * @data:   the encoded grid
+ * @length: the length of @data
+ *
+ * Load a grid stored by grits_dem_encode(). Like grits_dem_new(), the edge
+ * samples are repeated in the padding until the neighbors are set.
+ *
+ * Returns: the new #GritsDem, or NULL if @data is not a valid encoded grid
+ */
+GritsDem *grits_dem_decode(GritsBounds *edge, gconstpointer data, gsize length)
+{
+	GritsDemHeader header;
+	if (length < sizeof(header))
+		return NULL;
+	memcpy(&header, data, sizeof(header));
+	gint w = GUINT16_FROM_LE(header.width);
+	gint h = GUINT16_FROM_LE(header.height);
+	if (memcmp(header.magic, GRITS_DEM_MAGIC, 4) ||
+	    GUINT16_FROM_LE(header.version) != GRITS_DEM_VERSION ||
+	    w == 0 || h == 0)
+		return NULL;
+
+	GritsDem *dem = _grits_dem_alloc(edge, w, h);
+	gint cols, rows;
+	_grits_dem_blocks(dem, 0, &cols, &rows);
+	gsize nranges = cols * rows * sizeof(GritsDemRange);
+	gsize nplane  = w * h;
+	if (GUINT16_FROM_LE(header.blocks) != cols * rows) {
+		grits_dem_free(dem);
+		return NULL;
+	}
+
+	GConverter *conv = G_CONVERTER(g_zlib_decompressor_new(
+				G_ZLIB_COMPRESSOR_FORMAT_RAW));
+	gsize   rawlen;
+	guint8 *raw = _grits_dem_convert(conv,
+			(const guint8*)data + sizeof(header), length - sizeof(header),
+			nranges + nplane*2, &rawlen);
+	g_object_unref(conv);
+	if (!raw || rawlen != nranges + nplane*2) {
+		g_free(raw);
+		grits_dem_free(dem);
+		return NULL;
+	}
+
+	/* Ranges */
+	const GritsDemRange *ranges = (GritsDemRange*)raw;
+	for (gint i = 0; i < cols*rows; i++) {
+		dem->ranges[0][i].min = GINT16_FROM_LE(ranges[i].min);
+		dem->ranges[0][i].max = GINT16_FROM_LE(ranges[i].max);
+	}
+
+	/* Samples */
+	const guint8 *lo = raw + nranges, *hi = lo + nplane;
+	for (gint r = 0; r < h; r++) {
+		gint16  *row  = &dem->data[r*dem->stride];
+		guint16  prev = r > 0 ? row[-dem->stride] : 0;
+		for (gint c = 0; c < w; c++) {
+			prev  += lo[r*w + c] | hi[r*w + c] << 8;
+			row[c] = prev;
+		}
+	}
+	g_free(raw);
+
+	_grits_dem_repeat_edges(dem);
+	_grits_dem_update_ranges(dem, FALSE);
+	return dem;
+}
+
+/**
+ * grits_dem_free:
+ * @dem: the #GritsDem to free
+ *
+ * Free the samples stored in @dem.
+ */
+void grits_dem_free(GritsDem *dem)
+{
+	for (gint level = 0; level < dem->levels; level++)
+		g_free(dem->ranges[level]);
+	g_free(dem->ranges);
+	g_free(dem->data);
+	g_free(dem);
+}
+
+/**
+ * grits_dem_file_open:
+ * @path: the path to the BIL file
+ *
+ * Open a local elevation file. The header is read from the file with the same
+ * name as @path but a .hdr extension. The samples are memory mapped so only
+ * the parts which are used are read from the disk.
+ *
+ * Returns: the new #GritsDemFile, or NULL on error
+ */
+GritsDemFile *grits_dem_file_open(const gchar *path)
+{
+	const gchar *dot = strrchr(path, '.');
+	gchar *base = dot ? g_strndup(path, dot - path) : g_strdup(path);
+	gchar *hdr  = g_strconcat(base, ".hdr", NULL);
+	gchar *text = NULL;
+	g_free(base);
+	if (!g_file_get_contents(hdr, &text, NULL, NULL)) {
+		g_warning("GritsDem: file_open - cannot read %s", hdr);
+		g_free(hdr);
+		return NULL;
+	}
+	g_free(hdr);
+
+	/* Parse the header */
+	gint    nrows = 0, ncols = 0, nbits = 16, nbands = 1;
+	gdouble ulx = 0, uly = 0, xdim = 0, ydim = 0, nodata = G_MININT16;
+	gboolean big = FALSE;
+	gchar **lines = g_strsplit(text, "\n", -1);
+	for (gint i = 0; lines[i]; i++) {
+		gchar **words = g_strsplit_set(g_strstrip(lines[i]), " \t", 2);
+		if (words[0] && words[1]) {
+			gchar       *key   = g_ascii_strup(words[0], -1);
+			const gchar *value = g_strstrip(words[1]);
+			if      (g_str_equal(key, "NROWS"))     nrows  = atoi(value);
+			else if (g_str_equal(key, "NCOLS"))     ncols  = atoi(value);
+			else if (g_str_equal(key, "NBITS"))     nbits  = atoi(value);
+			else if (g_str_equal(key, "NBANDS"))    nbands = atoi(value);
+			else if (g_str_equal(key, "ULXMAP"))    ulx    = g_ascii_strtod(value, NULL);
+			else if (g_str_equal(key, "ULYMAP"))    uly    = g_ascii_strtod(value, NULL);
+			else if (g_str_equal(key, "XDIM"))      xdim   = g_ascii_strtod(value, NULL);
+			else if (g_str_equal(key, "YDIM"))      ydim   = g_ascii_strtod(value, NULL);
+			else if (g_str_equal(key, "NODATA"))    nodata = g_ascii_strtod(value, NULL);
+			else if (g_str_equal(key, "BYTEORDER")) big    = g_ascii_toupper(value[0]) == 'M';
+			g_free(key);
+		}
+		g_strfreev(words);
+	}
+	g_strfreev(lines);
+	g_free(text);
+	if (nrows < 2 || ncols < 2 || nbits != 16 || nbands != 1 ||
+	    xdim <= 0 || ydim <= 0) {
+		g_warning("GritsDem: file_open - unsupported header for %s", path);
+		return NULL;
+	}
+
+	/* Map the samples */
+	GMappedFile *map = g_mapped_file_new(path, FALSE, NULL);
+	if (!map || g_mapped_file_get_length(map) < (gsize)nrows*ncols*sizeof(gint16)) {
+		g_warning("GritsDem: file_open - cannot read %s", path);
+		if (map)
+			g_mapped_file_unref(map);
+		return NULL;
+	}
+
+	GritsDemFile *file = g_new0(GritsDemFile, 1);
+	file->edge.n = uly;
+	file->edge.s = uly - (nrows-1)*ydim;
+	file->edge.e = ulx + (ncols-1)*xdim;
+	file->edge.w = ulx;
+	file->width  = ncols;
+	file->height = nrows;
+	file->xscale = 1/xdim;
+	file->yscale = 1/ydim;
+	file->nodata = nodata;
+	file->big    = big;
+	file->map    = map;
+	file->data   = (const gint16*)g_mapped_file_get_contents(map);
+	g_debug("GritsDem: file_open - %s %dx%d n=%f s=%f e=%f w=%f", path,
+			ncols, nrows, file->edge.n, file->edge.s,
+			file->edge.e, file->edge.w);
+	return file;
+}
+
+/**
+ * grits_dem_file_close:
+ * @file: the #GritsDemFile to close
+ *
+ * Unmap the samples and free the file.
+ */
+void grits_dem_file_close(GritsDemFile *file)
+{
+	g_mapped_file_unref(file->map);
+	g_free(file);
+}
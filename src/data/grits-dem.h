@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_DEM_H__
+#define __GRITS_DEM_H__
+
+#include <glib.h>
+
+#include "grits-util.h"
+
+/**
+ * GRITS_DEM_BLOCK:
+ *
+ * Number of samples along each side of the smallest blocks in the min/max
+ * pyramid of a #GritsDem
+ */
+#define GRITS_DEM_BLOCK 16
+
+/**
+ * GritsDemRange:
+ * @min: the lowest sample in the block
+ * @max: the highest sample in the block
+ *
+ * Elevation range of a block of samples
+ */
+typedef struct _GritsDemRange {
+	gint16 min;
+	gint16 max;
+} GritsDemRange;
+
+/**
+ * GritsDem:
+ * @edge:   the area covered by the samples
+ * @width:  number of samples in each row, not counting the padding
+ * @height: number of rows, not counting the padding
+ * @stride: number of samples between the start of each row
+ * @xscale: number of samples per degree of longitude
+ * @yscale: number of rows per degree of latitude
+ * @data:   the samples, including an extra column to the east and an extra
+ *          row to the south which are copied from the neighboring grids
+ * @levels: number of levels in @ranges
+ * @ranges: the min/max pyramid, level N holds the range of each block of
+ *          %GRITS_DEM_BLOCK << N samples square, row by row
+ *
+ * A grid of elevation samples in meters
+ */
+typedef struct _GritsDem {
+	GritsBounds     edge;
+	gint            width;
+	gint            height;
+	gint            stride;
+	gdouble         xscale;
+	gdouble         yscale;
+	gint16         *data;
+	gint            levels;
+	GritsDemRange **ranges;
+} GritsDem;
+
+/**
+ * GritsDemFile:
+ * @edge:   the area covered by the centers of the samples
+ * @width:  number of samples in each row
+ * @height: number of rows
+ * @xscale: number of samples per degree of longitude
+ * @yscale: number of rows per degree of latitude
+ * @nodata: value of samples which are missing
+ * @big:    %TRUE if the samples are big endian
+ * @map:    the memory mapped file
+ * @data:   the samples, row by row starting from the north-west corner
+ *
+ * A grid of elevation samples stored in a local file
+ */
+typedef struct _GritsDemFile {
+	GritsBounds   edge;
+	gint          width;
+	gint          height;
+	gdouble       xscale;
+	gdouble       yscale;
+	gint16        nodata;
+	gboolean      big;
+	GMappedFile  *map;
+	const gint16 *data;
+} GritsDemFile;
+
+/**
+ * GritsDemFindFunc:
+ * @lat:       the latitude of the point
+ * @lon:       the longitude of the point
+ * @user_data: the user_data argument passed to the function
+ *
+ * Function used to find the most detailed grid containing a point
+ *
+ * Returns: the #GritsDem containing the point, or NULL
+ */
+typedef GritsDem *(*GritsDemFindFunc)(gdouble lat, gdouble lon,
+		gpointer user_data);
+
+GritsDem *grits_dem_new(GritsBounds *edge, gint width, gint height,
+		const gint16 *samples);
+
+void grits_dem_set_padding(GritsDem *dem, GritsDemFindFunc find,
+		gpointer user_data);
+
+gdouble grits_dem_sample(GritsDem *dem, gdouble lat, gdouble lon);
+
+void grits_dem_sample_many(GritsDem *dem, const gdouble *lat, const gdouble *lon,
+		gdouble *elev, gsize count);
+
+gboolean grits_dem_get_range(GritsDem *dem, GritsBounds *bounds,
+		gdouble *min, gdouble *max);
+
+gint grits_dem_fill(GritsDem *dem, GritsDemFile *file);
+
+gboolean grits_dem_file_covers(GritsDemFile *file, GritsBounds *edge);
+
+GBytes *grits_dem_encode(GritsDem *dem);
+
+GritsDem *grits_dem_decode(GritsBounds *edge, gconstpointer data, gsize length);
+
+void grits_dem_free(GritsDem *dem);
+
+GritsDemFile *grits_dem_file_open(const gchar *path);
+
+void grits_dem_file_close(GritsDemFile *file);
+
+#endif
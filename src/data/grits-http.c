@@ -23,6 +23,21 @@
  * the Hyper Text Transfer Protocol. Each #GritsHttp should be associated with
  * a particular server or dataset, all the files downloaded for this dataset
  * will be cached together in $HOME/.cache/grits/
+ *
+ * The validators and expiry time sent by the server for each file are stored
+ * next to it in a .meta file, which is used by %GRITS_REVALIDATE to avoid
+ * downloading files which have not changed.
+ *
+ * Requests from all #GritsHttp objects share a single asynchronous session
+ * which keeps connections to each server open and reuses them, so many
+ * requests can be in flight at once without tying up a thread for each of
+ * them.
+ *
+ * Each #GritsHttp has a #GritsHttpPriority. Requests wait, or are paused part
+ * way through, while requests with a higher priority are running, but only
+ * for a few seconds so that they are never starved completely. Downloads
+ * can also be limited to a number of bytes per second, both in total and for
+ * each #GritsHttp.
  */
 
 #include <config.h>
@@ -31,6 +46,160 @@
 #include <libsoup/soup.h>
 
 #include "grits-http.h"
+#include "grits-pack.h"
+#include "grits-cache.h"
+
+/* Default connection limits for the shared session */
+#define MAX_CONNS          32
+#define MAX_CONNS_PER_HOST 8
+
+/* Requests held back by higher priority requests for longer
+ * than this run anyway, in microseconds */
+#define PRIORITY_AGE (2*G_USEC_PER_SEC)
+
+/* All requests are run on a single async session from a dedicated thread,
+ * connections are kept alive and reused between all the GritsHttps */
+static SoupSession  *_session;
+static GMainContext *_context;
+static gint _max_conns          = MAX_CONNS;
+static gint _max_conns_per_host = MAX_CONNS_PER_HOST;
+static gboolean _use_pack;
+
+/* Downloads which are currently in progress, keyed by cache path, so that
+ * requests for the same file share one transfer and one .part file */
+static GHashTable *_inflight;
+static GMutex      _inflight_lock;
+
+/* Scheduling state, only used from the session thread. Requests which are
+ * held back wait in _deferred before they start or in _paused afterwards */
+static GritsHttpBucket _bucket;
+static gint   _active[GRITS_PRIORITY_COUNT];
+static GList *_deferred;
+static GList *_paused;
+static guint  _timer;
+static gint64 _timer_due;
+
+/* Priority limit for requests made from each thread, plus one */
+static GPrivate _thread_priority;
+
+static gpointer _session_thread(gpointer _loop)
+{
+	GMainLoop *loop = _loop;
+	g_main_context_push_thread_default(_context);
+	g_main_loop_run(loop);
+	return NULL;
+}
+
+static void _init_session(void)
+{
+	static gsize once = 0;
+	if (g_once_init_enter(&once)) {
+		g_debug("GritsHttp: init_session - conns=%d/%d",
+				_max_conns, _max_conns_per_host);
+		_inflight = g_hash_table_new(g_str_hash, g_str_equal);
+		_context  = g_main_context_new();
+		_session = soup_session_async_new_with_options(
+				"async-context", _context, NULL);
+		g_object_set(_session, "user-agent",         PACKAGE_STRING,      NULL);
+		g_object_set(_session, "timeout",            10,                  NULL);
+		g_object_set(_session, "max-conns",          _max_conns,          NULL);
+		g_object_set(_session, "max-conns-per-host", _max_conns_per_host, NULL);
+		GMainLoop *loop = g_main_loop_new(_context, FALSE);
+		g_thread_new("grits-http", _session_thread, loop);
+		g_once_init_leave(&once, 1);
+	}
+}
+
+static gboolean _set_connections_cb(gpointer _)
+{
+	g_object_set(_session, "max-conns",          _max_conns,          NULL);
+	g_object_set(_session, "max-conns-per-host", _max_conns_per_host, NULL);
+	return FALSE;
+}
+
+/**
+ * grits_http_set_connections:
+ * @max:      maximum number of open connections, or 0 for the default
+ * @per_host: maximum number of open connections to a single server,
+ *            or 0 for the default
+ *
+ * Set the connection limits for the session shared by all #GritsHttp objects.
+ */
+void grits_http_set_connections(gint max, gint per_host)
+{
+	_init_session();
+	_max_conns          = max      > 0 ? max      : MAX_CONNS;
+	_max_conns_per_host = per_host > 0 ? per_host : MAX_CONNS_PER_HOST;
+	g_main_context_invoke(_context, _set_connections_cb, NULL);
+}
+
+/* Refill the bucket and take @bytes from it. Returns the number of
+ * milliseconds until the bucket is no longer empty */
+static gint64 _bucket_take(GritsHttpBucket *bucket, gsize bytes)
+{
+	if (bucket->rate <= 0)
+		return 0;
+	gint64 now = g_get_monotonic_time();
+	if (bucket->time)
+		bucket->tokens = MIN(bucket->tokens + (gdouble)bucket->rate *
+				(now - bucket->time) / G_USEC_PER_SEC, bucket->rate);
+	else
+		bucket->tokens = bucket->rate;
+	bucket->time    = now;
+	bucket->tokens -= bytes;
+	if (bucket->tokens >= 0)
+		return 0;
+	return -bucket->tokens * 1000 / bucket->rate + 1;
+}
+
+struct _RateInfo {
+	GritsHttpBucket *bucket;
+	gint64 rate;
+};
+
+static void _schedule(void);
+
+static gboolean _set_rate_cb(gpointer _rate)
+{
+	struct _RateInfo *rate = _rate;
+	rate->bucket->rate = MAX(rate->rate, 0);
+	rate->bucket->time = 0;
+	g_free(rate);
+	_schedule();
+	return FALSE;
+}
+
+static void _set_rate(GritsHttpBucket *bucket, gint64 rate)
+{
+	struct _RateInfo *info = g_new0(struct _RateInfo, 1);
+	info->bucket = bucket;
+	info->rate   = rate;
+	g_main_context_invoke(_context, _set_rate_cb, info);
+}
+
+/**
+ * grits_http_set_bandwidth:
+ * @rate: maximum number of bytes per second, or 0 for no limit
+ *
+ * Limit the combined download rate of all #GritsHttp objects.
+ */
+void grits_http_set_bandwidth(gint64 rate)
+{
+	_init_session();
+	_set_rate(&_bucket, rate);
+}
+
+/**
+ * grits_http_set_pack_cache:
+ * @enable: TRUE to store cached files in packs
+ *
+ * Set whether #GritsHttp objects created after this store the files fetched
+ * with grits_http_fetch_bytes() in a #GritsPack instead of separate files.
+ */
+void grits_http_set_pack_cache(gboolean enable)
+{
+	_use_pack = enable;
+}
 
 gchar *_get_cache_path(GritsHttp *http, const gchar *local)
 {
@@ -50,49 +219,212 @@ gchar *_get_cache_path(GritsHttp *http, const gchar *local)
 GritsHttp *grits_http_new(const gchar *prefix)
 {
 	g_debug("GritsHttp: new - %s", prefix);
+	_init_session();
 	GritsHttp *http = g_new0(GritsHttp, 1);
-	http->soup = soup_session_sync_new();
+	http->soup   = g_object_ref(_session);
 	http->prefix = g_strdup(prefix);
-	g_object_set(http->soup, "user-agent", PACKAGE_STRING, NULL);
-	g_object_set(http->soup, "timeout",    10,             NULL);
+	if (_use_pack) {
+		gchar *dir = _get_cache_path(http, NULL);
+		http->pack = grits_pack_open(dir);
+		g_free(dir);
+	}
+	http->priority = GRITS_PRIORITY_NORMAL;
+	g_mutex_init(&http->lock);
+	g_cond_init(&http->idle);
+	grits_cache_register(http->prefix, http->pack);
 	return http;
 }
 
 /**
- * grits_http_abort:
- * @http: the #GritsHttp to abort
+ * grits_http_set_priority:
+ * @http:     the #GritsHttp to set the priority of
+ * @priority: the priority of requests made after this
  *
- * Cancels any pending requests and prevents new requests.
+ * Set the priority of requests made by @http. Large downloads which are not
+ * needed right away should use %GRITS_PRIORITY_LOW so that they do not slow
+ * down the data which is being viewed.
  */
-void grits_http_abort(GritsHttp *http)
+void grits_http_set_priority(GritsHttp *http, GritsHttpPriority priority)
 {
-	g_debug("GritsHttp: abort - %s", http->prefix);
-	http->aborted = TRUE;
-	soup_session_abort(http->soup);
+	http->priority = CLAMP(priority, 0, GRITS_PRIORITY_COUNT-1);
 }
 
 /**
- * grits_http_free:
- * @http: the #GritsHttp to free
+ * grits_http_set_thread_priority:
+ * @priority: the highest priority for requests made after this
  *
- * Frees resources used by @http and cancels any pending requests.
+ * Limit the priority of requests made from the calling thread, whichever
+ * #GritsHttp they are made with. This is used to fetch data ahead of time at
+ * a lower priority than the data which is being viewed. Use
+ * %GRITS_PRIORITY_HIGH to remove the limit.
  */
-void grits_http_free(GritsHttp *http)
+void grits_http_set_thread_priority(GritsHttpPriority priority)
 {
-	g_debug("GritsHttp: free - %s", http->prefix);
-	g_object_unref(http->soup);
-	g_free(http->prefix);
-	g_free(http);
+	priority = CLAMP(priority, 0, GRITS_PRIORITY_COUNT-1);
+	g_private_set(&_thread_priority, GINT_TO_POINTER(priority+1));
+}
+
+/* Priority of a request made by @http from the calling thread */
+static GritsHttpPriority _get_priority(GritsHttp *http)
+{
+	gint limit = GPOINTER_TO_INT(g_private_get(&_thread_priority));
+	return limit ? MIN(http->priority, limit-1) : http->priority;
+}
+
+/**
+ * grits_http_set_rate:
+ * @http: the #GritsHttp to limit
+ * @rate: maximum number of bytes per second, or 0 for no limit
+ *
+ * Limit the combined download rate of requests made by @http.
+ */
+void grits_http_set_rate(GritsHttp *http, gint64 rate)
+{
+	_set_rate(&http->bucket, rate);
+}
+
+/* Cache metadata, stored in a key file next to the cached file */
+static gchar *_meta_path(const gchar *path)
+{
+	return g_strconcat(path, ".meta", NULL);
+}
+
+static GKeyFile *_meta_load(const gchar *path)
+{
+	gchar    *meta = _meta_path(path);
+	GKeyFile *keys = g_key_file_new();
+	if (!g_key_file_load_from_file(keys, meta, 0, NULL)) {
+		g_key_file_free(keys);
+		keys = NULL;
+	}
+	g_free(meta);
+	return keys;
+}
+
+/* Check whether the cached file can be used without asking the server */
+static gboolean _meta_fresh(const gchar *path)
+{
+	GKeyFile *keys = _meta_load(path);
+	if (!keys)
+		return FALSE;
+	gint64 expires = g_key_file_get_int64(keys, "cache", "expires", NULL);
+	g_key_file_free(keys);
+	return expires > g_get_real_time()/G_USEC_PER_SEC;
+}
+
+/* Get the freshness lifetime of a response, in seconds */
+static gint64 _meta_max_age(SoupMessageHeaders *headers)
+{
+	const gchar *control = soup_message_headers_get_one(headers, "Cache-Control");
+	if (control) {
+		GHashTable *params = soup_header_parse_param_list(control);
+		const gchar *max_age = g_hash_table_lookup(params, "max-age");
+		gboolean no_cache = g_hash_table_lookup_extended(params,
+				"no-cache", NULL, NULL);
+		gint64 age = max_age ? g_ascii_strtoll(max_age, NULL, 10) : -1;
+		soup_header_free_param_list(params);
+		if (no_cache)
+			return 0;
+		if (age >= 0)
+			return age;
+	}
+	const gchar *expires = soup_message_headers_get_one(headers, "Expires");
+	if (expires) {
+		SoupDate *date = soup_date_new_from_string(expires);
+		if (date) {
+			gint64 age = soup_date_to_time_t(date) -
+				g_get_real_time()/G_USEC_PER_SEC;
+			soup_date_free(date);
+			return MAX(age, 0);
+		}
+	}
+	return 0;
+}
+
+/* Save the validators and expiry time from a response. A 304 response
+ * refreshes the expiry time and keeps the validators it does not replace */
+static void _meta_save(const gchar *path, SoupMessage *message)
+{
+	SoupMessageHeaders *headers = message->response_headers;
+	const gchar *etag     = soup_message_headers_get_one(headers, "ETag");
+	const gchar *modified = soup_message_headers_get_one(headers, "Last-Modified");
+	gint64       max_age  = _meta_max_age(headers);
+
+	GKeyFile *keys = NULL;
+	if (message->status_code == SOUP_STATUS_NOT_MODIFIED)
+		keys = _meta_load(path);
+	if (!keys)
+		keys = g_key_file_new();
+	if (etag)
+		g_key_file_set_string(keys, "cache", "etag", etag);
+	if (modified)
+		g_key_file_set_string(keys, "cache", "last_modified", modified);
+	g_key_file_set_int64(keys, "cache", "expires",
+			g_get_real_time()/G_USEC_PER_SEC + max_age);
+
+	gchar *meta = _meta_path(path);
+	gchar *data = g_key_file_to_data(keys, NULL, NULL);
+	if (!g_file_set_contents(meta, data, -1, NULL))
+		g_warning("GritsHttp: meta_save - error writing %s", meta);
+	g_free(data);
+	g_free(meta);
+	g_key_file_free(keys);
+}
+
+/* Make the request conditional on the cached file having changed */
+static void _meta_condition(const gchar *path, SoupMessage *message)
+{
+	GKeyFile *keys = _meta_load(path);
+	if (!keys)
+		return;
+	gchar *etag     = g_key_file_get_string(keys, "cache", "etag", NULL);
+	gchar *modified = g_key_file_get_string(keys, "cache", "last_modified", NULL);
+	if (etag)
+		soup_message_headers_replace(message->request_headers,
+				"If-None-Match", etag);
+	if (modified)
+		soup_message_headers_replace(message->request_headers,
+				"If-Modified-Since", modified);
+	g_free(etag);
+	g_free(modified);
+	g_key_file_free(keys);
+}
+
+static void _meta_remove(const gchar *path)
+{
+	gchar *meta = _meta_path(path);
+	g_remove(meta);
+	g_free(meta);
 }
 
 /* For passing data to the chunck callback */
 struct _CacheInfo {
+	GritsHttp   *http;
+	SoupMessage *message;
+	GritsHttpPriority priority;
+	gboolean     queued;
+	gboolean     deferred;
+	gboolean     paused;
+	gint64       held;  /* When higher priorities first held it back */
+	gboolean     aged;  /* Held back for too long, no longer is */
+	gboolean     revalidate;
 	FILE  *fp;
+	gchar *uri;
+	gchar *local;
 	gchar *path;
+	gchar *part;
 	GritsChunkCallback callback;
 	gpointer user_data;
+	GList *waiters;
+	GAsyncQueue *stream;
+	gboolean     streaming;
+	glong        offset;
 	gulong iBytesWeDownloadedSoFar;	/* Stores the number of bytes we downloaded from the server for the current request so far. */
 };
+struct _CacheWaiter {
+	GritsHttpDoneCallback done;
+	gpointer done_data;
+};
 struct _CacheInfoMain {
 	gchar *path;
 	GritsChunkCallback callback;
@@ -100,6 +432,180 @@ struct _CacheInfoMain {
 	goffset cur, total;
 };
 
+/* Called with the lock held */
+static void _grits_http_release(GritsHttp *http)
+{
+	if (--http->running == 0)
+		g_cond_broadcast(&http->idle);
+}
+
+static void _done_cb(SoupSession *session, SoupMessage *message, gpointer _info);
+
+/* Check whether a request with a higher priority is running */
+static gboolean _blocked(GritsHttpPriority priority)
+{
+	for (gint i = priority+1; i < GRITS_PRIORITY_COUNT; i++)
+		if (_active[i] > 0)
+			return TRUE;
+	return FALSE;
+}
+
+/* Check whether a request is still held back by higher priority requests,
+ * and if so lower @delay to when it has been held back for too long */
+static gboolean _held(struct _CacheInfo *info, gint64 now, gint64 *delay)
+{
+	if (info->aged || !_blocked(info->priority))
+		return FALSE;
+	if (!info->held)
+		info->held = now;
+	gint64 age = now - info->held;
+	if (age >= PRIORITY_AGE) {
+		g_debug("GritsHttp: held - running aged request %s", info->local);
+		info->aged = TRUE;
+		return FALSE;
+	}
+	*delay = MIN(*delay, (PRIORITY_AGE - age) / 1000 + 1);
+	return TRUE;
+}
+
+static gint _compare_priority(gconstpointer _a, gconstpointer _b)
+{
+	const struct _CacheInfo *a = _a, *b = _b;
+	return b->priority - a->priority;
+}
+
+static void _start(struct _CacheInfo *info)
+{
+	info->queued = TRUE;
+	_active[info->priority]++;
+	soup_session_queue_message(_session, info->message, _done_cb, info);
+}
+
+/* Finish a request which was never given to the session */
+static void _cancel(struct _CacheInfo *info)
+{
+	SoupMessage *message = info->message;
+	soup_message_set_status(message, SOUP_STATUS_CANCELLED);
+	_done_cb(_session, message, info);
+	g_object_unref(message);
+}
+
+static gboolean _schedule_cb(gpointer _)
+{
+	_timer = 0;
+	_schedule();
+	return FALSE;
+}
+
+/* Start deferred requests and resume paused ones once they are no longer
+ * held back, highest priority first */
+static void _schedule(void)
+{
+	gint64 now   = g_get_monotonic_time();
+	gint64 delay = G_MAXINT64;
+	for (GList *cur = _deferred, *next; cur; cur = next) {
+		struct _CacheInfo *info = cur->data;
+		next = cur->next;
+		if (_held(info, now, &delay))
+			continue;
+		_deferred = g_list_delete_link(_deferred, cur);
+		info->deferred = FALSE;
+		_start(info);
+	}
+
+	for (GList *cur = _paused, *next; cur; cur = next) {
+		struct _CacheInfo *info = cur->data;
+		next = cur->next;
+		if (_held(info, now, &delay))
+			continue;
+		gint64 wait = MAX(_bucket_take(&_bucket, 0),
+		                  _bucket_take(&info->http->bucket, 0));
+		if (wait > 0) {
+			delay = MIN(delay, wait);
+			continue;
+		}
+		_paused = g_list_delete_link(_paused, cur);
+		info->paused = FALSE;
+		soup_session_unpause_message(_session, info->message);
+	}
+
+	/* Check again once the buckets have refilled or requests have
+	 * been held back for too long */
+	gint64 due = now + delay*1000;
+	if (delay != G_MAXINT64 && (!_timer || due < _timer_due)) {
+		if (_timer)
+			g_source_destroy(g_main_context_find_source_by_id(
+						_context, _timer));
+		GSource *source = g_timeout_source_new(delay);
+		g_source_set_callback(source, _schedule_cb, NULL, NULL);
+		_timer     = g_source_attach(source, _context);
+		_timer_due = due;
+		g_source_unref(source);
+	}
+}
+
+/* Cancel queued messages from the session thread */
+static gboolean _abort_cb(gpointer _http)
+{
+	GritsHttp *http = _http;
+	g_mutex_lock(&http->lock);
+	GList *requests = g_list_copy(http->requests);
+	g_mutex_unlock(&http->lock);
+	for (GList *cur = requests; cur; cur = cur->next) {
+		struct _CacheInfo *info = cur->data;
+		if (info->queued)
+			soup_session_cancel_message(_session, info->message,
+					SOUP_STATUS_CANCELLED);
+		else if (info->deferred)
+			_cancel(info);
+	}
+	g_list_free(requests);
+	g_mutex_lock(&http->lock);
+	_grits_http_release(http);
+	g_mutex_unlock(&http->lock);
+	return FALSE;
+}
+
+/**
+ * grits_http_abort:
+ * @http: the #GritsHttp to abort
+ *
+ * Cancels any pending requests and prevents new requests.
+ */
+void grits_http_abort(GritsHttp *http)
+{
+	g_debug("GritsHttp: abort - %s", http->prefix);
+	g_mutex_lock(&http->lock);
+	http->aborted = TRUE;
+	http->running++;
+	g_mutex_unlock(&http->lock);
+	g_main_context_invoke(_context, _abort_cb, http);
+}
+
+/**
+ * grits_http_free:
+ * @http: the #GritsHttp to free
+ *
+ * Frees resources used by @http and cancels any pending requests.
+ */
+void grits_http_free(GritsHttp *http)
+{
+	g_debug("GritsHttp: free - %s", http->prefix);
+	grits_http_abort(http);
+	g_mutex_lock(&http->lock);
+	while (http->running > 0)
+		g_cond_wait(&http->idle, &http->lock);
+	g_mutex_unlock(&http->lock);
+	g_cond_clear(&http->idle);
+	g_mutex_clear(&http->lock);
+	grits_cache_unregister(http->prefix, http->pack);
+	if (http->pack)
+		grits_pack_close(http->pack);
+	g_object_unref(http->soup);
+	g_free(http->prefix);
+	g_free(http);
+}
+
 /* call the user callback from the main thread,
  * since it's usually UI updates */
 static gboolean _chunk_main_cb(gpointer _infomain)
@@ -143,10 +649,31 @@ static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
 
 	if (!fwrite(chunk->data, chunk->length, 1, info->fp))
 		g_error("GritsHttp: _chunk_cb - Unable to write data");
+
+	/* Pass the data on as well if the whole file is being downloaded */
+	if (info->stream) {
+		if (info->iBytesWeDownloadedSoFar == 0)
+			info->streaming = info->offset == 0 ||
+				message->status_code == SOUP_STATUS_OK;
+		if (info->streaming)
+			g_async_queue_push(info->stream,
+					g_bytes_new(chunk->data, chunk->length));
+	}
 	
 	/* Add on the bytes from this chunk */
 	info->iBytesWeDownloadedSoFar += chunk->length;
 
+	/* Pause the download while it is over the rate limit or while a
+	 * request with a higher priority is running */
+	gint64 wait = MAX(_bucket_take(&_bucket, chunk->length),
+	                  _bucket_take(&info->http->bucket, chunk->length));
+	if (wait > 0 || (!info->aged && _blocked(info->priority))) {
+		soup_session_pause_message(_session, message);
+		info->paused = TRUE;
+		_paused = g_list_prepend(_paused, info);
+		_schedule();
+	}
+
 	if (info->callback) {
 		struct _CacheInfoMain *infomain = g_new0(struct _CacheInfoMain, 1);
 		infomain->path      = info->path;
@@ -161,6 +688,319 @@ static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
 
 }
 
+/* Pass the result of a download to everyone waiting on it */
+static void _cache_info_finish(struct _CacheInfo *info, gchar *path)
+{
+	g_mutex_lock(&_inflight_lock);
+	g_hash_table_remove(_inflight, info->path);
+	GList *waiters = info->waiters;
+	g_mutex_unlock(&_inflight_lock);
+
+	if (!path)
+		g_free(info->path);
+	for (GList *cur = waiters; cur; cur = cur->next) {
+		struct _CacheWaiter *waiter = cur->data;
+		waiter->done(cur->next ? g_strdup(path) : path,
+				waiter->done_data);
+		g_free(waiter);
+	}
+	g_list_free(waiters);
+}
+
+/* Finish a request from the session thread */
+static void _done_cb(SoupSession *session, SoupMessage *message, gpointer _info)
+{
+	struct _CacheInfo *info = _info;
+	GritsHttp *http = info->http;
+	gchar *path = info->path;
+
+	g_debug("message->status_code: %i", message->status_code);
+	if (info->queued)
+		_active[info->priority]--;
+	if (info->deferred)
+		_deferred = g_list_remove(_deferred, info);
+	if (info->paused)
+		_paused = g_list_remove(_paused, info);
+	/* Close file */
+	fclose(info->fp);
+	if (info->path != info->part) {
+		if (SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
+			g_rename(info->part, info->path);
+		else if (info->revalidate)
+			g_remove(info->part);
+		g_free(info->part);
+	}
+
+	/* Finished */
+	guint status = message->status_code;
+	if (status == SOUP_STATUS_CANCELLED) {
+		path = NULL;
+	} else if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		/* Range unsatisfiable, file already complete */
+	} else if (status == SOUP_STATUS_NOT_MODIFIED) {
+		/* Cached file is still current */
+		_meta_save(path, message);
+	} else if (SOUP_STATUS_IS_SUCCESSFUL(status)) {
+		_meta_save(path, message);
+	} else {
+		g_warning("GritsHttp: done_cb - error copying file, status=%d\n"
+				"\tsrc=%s\n"
+				"\tdst=%s",
+				status, info->uri, info->path);
+		path = NULL;
+	}
+	GStatBuf st;
+	if (path && !g_stat(path, &st)) {
+		if (status == SOUP_STATUS_NOT_MODIFIED)
+			grits_cache_hit(http->prefix, info->local, st.st_size);
+		else
+			grits_cache_store(http->prefix, info->local, st.st_size,
+					info->iBytesWeDownloadedSoFar);
+	}
+	_cache_info_finish(info, path);
+
+	g_mutex_lock(&http->lock);
+	http->requests = g_list_remove(http->requests, info);
+	_grits_http_release(http);
+	g_mutex_unlock(&http->lock);
+	if (info->stream)
+		g_async_queue_unref(info->stream);
+	g_free(info->uri);
+	g_free(info->local);
+	g_free(info);
+
+	/* Lower priority requests may be able to run now */
+	_schedule();
+}
+
+/* Queue a message from the session thread */
+static gboolean _queue_cb(gpointer _info)
+{
+	struct _CacheInfo *info = _info;
+	if (info->http->aborted) {
+		_cancel(info);
+	} else if (_blocked(info->priority)) {
+		info->deferred = TRUE;
+		info->held     = g_get_monotonic_time();
+		_deferred = g_list_insert_sorted(_deferred, info, _compare_priority);
+		_schedule();
+	} else {
+		_start(info);
+	}
+	return FALSE;
+}
+
+static void _grits_http_fetch(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data,
+		GritsHttpDoneCallback done, gpointer done_data, GAsyncQueue *stream);
+
+/**
+ * grits_http_fetch_async:
+ * @http:      the #GritsHttp connection to use
+ * @uri:       the URI to fetch
+ * @local:     the local name to give to the file
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ * @done:      callback to call when the file has been fetched
+ * @done_data: user data to pass to @done
+ *
+ * Start fetching a file into the cache without waiting for it. @done is passed
+ * the local path to the complete file, or NULL on error, and is responsible
+ * for freeing it.
+ *
+ * If the file is already being downloaded, @done is called when that download
+ * finishes instead of starting a new one. Only the first requester receives
+ * chunk callbacks.
+ *
+ * If the file does not need to be downloaded @done is called before this
+ * function returns. Otherwise it is called from the thread running the shared
+ * HTTP session and should not block.
+ */
+void grits_http_fetch_async(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data,
+		GritsHttpDoneCallback done, gpointer done_data)
+{
+	_grits_http_fetch(http, uri, local, mode, callback, user_data,
+			done, done_data, NULL);
+}
+
+/* Copies of the downloaded data are pushed onto @stream as it arrives,
+ * if the whole file is being downloaded */
+static void _grits_http_fetch(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data,
+		GritsHttpDoneCallback done, gpointer done_data, GAsyncQueue *stream)
+{
+	g_debug("GritsHttp: fetch_async - %s mode=%d", local, mode);
+	if (http->aborted) {
+		g_debug("GritsHttp: fetch_async - aborted");
+		done(NULL, done_data);
+		return;
+	}
+	gchar *path = _get_cache_path(http, local);
+	struct _CacheWaiter *waiter = g_new0(struct _CacheWaiter, 1);
+	waiter->done      = done;
+	waiter->done_data = done_data;
+
+	/* Wait for the file if someone else is already downloading it */
+	g_mutex_lock(&_inflight_lock);
+	struct _CacheInfo *info = g_hash_table_lookup(_inflight, path);
+	if (info) {
+		g_debug("GritsHttp: fetch_async - Joining download %s", local);
+		info->waiters = g_list_prepend(info->waiters, waiter);
+		g_mutex_unlock(&_inflight_lock);
+		g_free(path);
+		return;
+	}
+
+	/* Unlink the file if we're refreshing it */
+	if (mode == GRITS_REFRESH) {
+		g_remove(path);
+		_meta_remove(path);
+	}
+
+	/* Use the cache if possible */
+	GStatBuf st;
+	gboolean exists = !g_stat(path, &st);
+	if ((mode == GRITS_ONCE && exists) || mode == GRITS_LOCAL ||
+	    (mode == GRITS_REVALIDATE && exists && _meta_fresh(path))) {
+		g_mutex_unlock(&_inflight_lock);
+		g_free(waiter);
+		if (exists)
+			grits_cache_hit(http->prefix, local, st.st_size);
+		done(path, done_data);
+		return;
+	}
+	g_debug("GritsHttp: fetch_async - Caching file %s", local);
+	grits_cache_miss(http->prefix);
+
+	/* Make temp data */
+	info = g_new0(struct _CacheInfo, 1);
+	info->http      = http;
+	info->priority  = _get_priority(http);
+	info->uri       = g_strdup(uri);
+	info->local     = g_strdup(local);
+	info->path      = path;
+	info->part      = path;
+	info->revalidate = mode == GRITS_REVALIDATE;
+	info->callback  = callback;
+	info->user_data = user_data;
+	info->waiters   = g_list_prepend(NULL, waiter);
+	info->stream    = stream ? g_async_queue_ref(stream) : NULL;
+	info->iBytesWeDownloadedSoFar = 0;
+	g_hash_table_insert(_inflight, info->path, info);
+	g_mutex_unlock(&_inflight_lock);
+
+	/* Open the file for writting, revalidated files are always fetched in
+	 * full since the server may send a different version */
+	if (info->revalidate || !exists)
+		info->part = g_strdup_printf("%s.part", path);
+	FILE *fp = info->fp = fopen_p(info->part, info->revalidate ? "wb" : "ab");
+	if (!fp) {
+		g_warning("GritsHttp: fetch_async - error opening %s", path);
+		if (info->part != path)
+			g_free(info->part);
+		_cache_info_finish(info, NULL);
+		if (info->stream)
+			g_async_queue_unref(info->stream);
+		g_free(info->uri);
+		g_free(info->local);
+		g_free(info);
+		return;
+	}
+	fseek(fp, 0, SEEK_END); // "a" is broken on Windows, twice
+	info->offset = ftell(fp);
+
+	/* Download the file */
+	info->message = soup_message_new("GET", uri);
+	if (info->message == NULL)
+		g_error("message is null, cannot parse uri");
+	g_signal_connect(info->message, "got-chunk", G_CALLBACK(_chunk_cb), info);
+	g_debug("ftell(fp): %li, uri: %s, local: %s", ftell(fp), uri, local);
+	if (info->revalidate && exists)
+		_meta_condition(path, info->message);
+	else if (!info->revalidate)
+		soup_message_headers_set_range(info->message->request_headers, ftell(fp), -1);
+	if (mode == GRITS_REFRESH)
+		soup_message_headers_replace(info->message->request_headers,
+				"Cache-Control", "max-age=0");
+
+	g_mutex_lock(&http->lock);
+	http->requests = g_list_prepend(http->requests, info);
+	http->running++;
+	g_mutex_unlock(&http->lock);
+	g_main_context_invoke(_context, _queue_cb, info);
+}
+
+/* For waiting on an async fetch */
+struct _FetchWait {
+	GMutex       lock;
+	GCond        cond;
+	gboolean     done;
+	gchar       *path;
+	GAsyncQueue *stream;
+};
+
+/* Marks the end of the streamed data */
+static gchar _stream_end;
+
+static void _fetch_done_cb(gchar *path, gpointer _wait)
+{
+	/* The waiter can return as soon as the lock is released, so wait must
+	 * not be used after that */
+	struct _FetchWait *wait = _wait;
+	GAsyncQueue *stream = wait->stream;
+	g_mutex_lock(&wait->lock);
+	wait->path = path;
+	wait->done = TRUE;
+	g_cond_signal(&wait->cond);
+	g_mutex_unlock(&wait->lock);
+	if (stream)
+		g_async_queue_push(stream, &_stream_end);
+}
+
+/* Fetch a file and wait for it. While it is downloaded the data is passed to
+ * @stream from the calling thread, @streamed is set if @stream accepted all
+ * the data in the file. */
+static gchar *_grits_http_fetch_sync(GritsHttp *http, const gchar *uri,
+		const gchar *local, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data,
+		GritsStreamCallback stream, gpointer stream_data,
+		gboolean *streamed)
+{
+	struct _FetchWait wait = {};
+	g_mutex_init(&wait.lock);
+	g_cond_init(&wait.cond);
+	if (stream)
+		wait.stream = g_async_queue_new();
+	_grits_http_fetch(http, uri, local, mode, callback, user_data,
+			_fetch_done_cb, &wait, wait.stream);
+
+	gboolean ok = FALSE;
+	if (stream) {
+		gpointer chunk;
+		gboolean failed = FALSE;
+		while ((chunk = g_async_queue_pop(wait.stream)) != &_stream_end) {
+			gsize length;
+			gconstpointer data = g_bytes_get_data(chunk, &length);
+			failed = failed || !stream(data, length, stream_data);
+			ok     = !failed;
+			g_bytes_unref(chunk);
+		}
+		g_async_queue_unref(wait.stream);
+	}
+
+	g_mutex_lock(&wait.lock);
+	while (!wait.done)
+		g_cond_wait(&wait.cond, &wait.lock);
+	g_mutex_unlock(&wait.lock);
+	g_cond_clear(&wait.cond);
+	g_mutex_clear(&wait.lock);
+	if (streamed)
+		*streamed = ok && wait.path;
+	return wait.path;
+}
+
 /**
  * grits_http_fetch:
  * @http:      the #GritsHttp connection to use
@@ -173,88 +1013,189 @@ static void _chunk_cb(SoupMessage *message, SoupBuffer *chunk, gpointer _info)
  * Fetch a file from the cache. Whether the file is actually loaded from the
  * remote server depends on the value of @mode.
  *
+ * This blocks until the file has been fetched, it must not be called from
+ * the done callback passed to grits_http_fetch_async().
+ *
  * Returns: The local path to the complete file
  */
-/* TODO: use .part extentions and continue even when using GRITS_ONCE */
 gchar *grits_http_fetch(GritsHttp *http, const gchar *uri, const char *local,
 		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data)
 {
-	g_debug("GritsHttp: fetch - %s mode=%d", local, mode);
-	if (http->aborted) {
-		g_debug("GritsPluginSat: _load_tile_thread - aborted");
+	return _grits_http_fetch_sync(http, uri, local, mode,
+			callback, user_data, NULL, NULL, NULL);
+}
+
+/**
+ * grits_http_fetch_bytes:
+ * @http:      the #GritsHttp connection to use
+ * @uri:       the URI to fetch
+ * @local:     the local name to give to the file
+ * @mode:      the update type to use when fetching data
+ * @callback:  callback to call when a chunk of data is received
+ * @user_data: user data to pass to the callback
+ *
+ * Fetch a file like grits_http_fetch() but return its contents instead of its
+ * path. The contents are memory mapped from the cache and are not copied.
+ *
+ * If the pack cache is enabled, files fetched with %GRITS_ONCE are moved into
+ * the pack along with their entity tag and later requests are served from it.
+ *
+ * Returns: the contents of the file, or NULL on error
+ */
+GBytes *grits_http_fetch_bytes(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data)
+{
+	return grits_http_fetch_stream(http, uri, local, mode,
+			callback, user_data, NULL, NULL, NULL);
+}
+
+/**
+ * grits_http_fetch_stream:
+ * @http:        the #GritsHttp connection to use
+ * @uri:         the URI to fetch
+ * @local:       the local name to give to the file
+ * @mode:        the update type to use when fetching data
+ * @callback:    callback to call when a chunk of data is received
+ * @user_data:   user data to pass to the callback
+ * @stream:      function to pass the data to while it is downloaded
+ * @stream_data: user data to pass to @stream
+ * @streamed:    location to store whether @stream was given the whole file
+ *
+ * Fetch a file like grits_http_fetch_bytes(), but if the whole file is
+ * downloaded also pass the data to @stream as it arrives. This is called from
+ * the calling thread so that, for instance, an image can be decoded while the
+ * rest of it is still being downloaded.
+ *
+ * @streamed is set to TRUE only if @stream was passed every byte of the
+ * returned file and accepted all of it. Otherwise, such as when the file was
+ * already in the cache, the caller should use the returned data instead.
+ *
+ * Returns: the contents of the file, or NULL on error
+ */
+GBytes *grits_http_fetch_stream(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode, GritsChunkCallback callback, gpointer user_data,
+		GritsStreamCallback stream, gpointer stream_data, gboolean *streamed)
+{
+	if (streamed)
+		*streamed = FALSE;
+
+	/* Only files which never change are packed, others are kept as
+	 * separate files so they can be updated and revalidated */
+	gboolean packed = http->pack && (mode == GRITS_ONCE || mode == GRITS_LOCAL);
+	if (packed) {
+		GBytes *bytes = grits_pack_get(http->pack, local, NULL);
+		if (bytes) {
+			grits_cache_hit(http->prefix, NULL, g_bytes_get_size(bytes));
+			return bytes;
+		}
+	}
+
+	gchar *path = _grits_http_fetch_sync(http, uri, local, mode,
+			callback, user_data, stream, stream_data, streamed);
+	if (!path)
 		return NULL;
+
+	/* Move the file into the pack */
+	if (packed) {
+		GBytes   *bytes = NULL;
+		GKeyFile *keys  = _meta_load(path);
+		gchar    *etag  = keys ?
+			g_key_file_get_string(keys, "cache", "etag", NULL) : NULL;
+		if (grits_pack_put_file(http->pack, local, path, etag))
+			bytes = grits_pack_get(http->pack, local, NULL);
+		_meta_remove(path);
+		grits_cache_remove(http->prefix, local);
+		if (keys)
+			g_key_file_free(keys);
+		g_free(etag);
+		g_free(path);
+		return bytes;
 	}
-	gchar *path = _get_cache_path(http, local);
 
-	/* Unlink the file if we're refreshing it */
-	if (mode == GRITS_REFRESH)
-		g_remove(path);
+	/* Map the file */
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+	g_free(path);
+	if (!file)
+		return NULL;
+	return g_bytes_new_with_free_func(
+			g_mapped_file_get_contents(file),
+			g_mapped_file_get_length(file),
+			(GDestroyNotify)g_mapped_file_unref, file);
+}
 
-	/* Do the cache if necessary */
-	if (!(mode == GRITS_ONCE && g_file_test(path, G_FILE_TEST_EXISTS)) &&
-			mode != GRITS_LOCAL) {
-		g_debug("GritsHttp: fetch - Caching file %s", local);
-
-		/* Open the file for writting */
-		gchar *part = path;
-		if (!g_file_test(path, G_FILE_TEST_EXISTS))
-			part = g_strdup_printf("%s.part", path);
-		FILE *fp = fopen_p(part, "ab");
-		if (!fp) {
-			g_warning("GritsHttp: fetch - error opening %s", path);
-			return NULL;
-		}
-		fseek(fp, 0, SEEK_END); // "a" is broken on Windows, twice
-
-		/* Make temp data */
-		struct _CacheInfo info = {
-			.fp        = fp,
-			.path      = path,
-			.callback  = callback,
-			.user_data = user_data,
-			.iBytesWeDownloadedSoFar = 0,
-		};
-
-		/* Download the file */
-		SoupMessage *message = soup_message_new("GET", uri);
-		if (message == NULL)
-			g_error("message is null, cannot parse uri");
-		g_signal_connect(message, "got-chunk", G_CALLBACK(_chunk_cb), &info);
-		g_debug("ftell(fp): %li, uri: %s, local: %s", ftell(fp), uri, local);
-		//if (ftell(fp) > 0)
-			soup_message_headers_set_range(message->request_headers, ftell(fp), -1);
-		if (mode == GRITS_REFRESH)
-			soup_message_headers_replace(message->request_headers,
-					"Cache-Control", "max-age=0");
-		soup_session_send_message(http->soup, message);
-
-		g_debug("message->status_code: %i", message->status_code);
-		/* Close file */
-		fclose(fp);
-		if (path != part) {
-			if (SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
-				g_rename(part, path);
-			g_free(part);
-		}
+/**
+ * grits_http_has:
+ * @http:  the #GritsHttp connection to use
+ * @local: the local name of the file
+ *
+ * Check whether a file is in the cache, without fetching it.
+ *
+ * Returns: TRUE if the file is cached
+ */
+gboolean grits_http_has(GritsHttp *http, const gchar *local)
+{
+	if (http->pack && grits_pack_has(http->pack, local))
+		return TRUE;
+	gchar *path = _get_cache_path(http, local);
+	gboolean has = g_file_test(path, G_FILE_TEST_EXISTS);
+	g_free(path);
+	return has;
+}
 
-		/* Finished */
-		guint status = message->status_code;
-		g_object_unref(message);
-		if (status == SOUP_STATUS_CANCELLED) {
-			return NULL;
-		} else if (status == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
-			/* Range unsatisfiable, file already complete */
-		} else if (!SOUP_STATUS_IS_SUCCESSFUL(status)) {
-			g_warning("GritsHttp: done_cb - error copying file, status=%d\n"
-					"\tsrc=%s\n"
-					"\tdst=%s",
-					status, uri, path);
-			return NULL;
-		}
+/**
+ * grits_http_store:
+ * @http:   the #GritsHttp connection to use
+ * @local:  the local name to give to the file
+ * @data:   the contents of the file
+ * @length: the length of @data
+ *
+ * Add a file to the cache which was obtained some other way, such as by
+ * splitting up a larger download. The file can then be fetched with
+ * %GRITS_ONCE or %GRITS_LOCAL without downloading it.
+ *
+ * Returns: TRUE if the file was stored
+ */
+gboolean grits_http_store(GritsHttp *http, const gchar *local,
+		gconstpointer data, gsize length)
+{
+	g_debug("GritsHttp: store - %s", local);
+	if (http->pack) {
+		gboolean ok = grits_pack_put(http->pack, local, data, length,
+				NULL, g_get_real_time()/G_USEC_PER_SEC);
+		if (ok)
+			grits_cache_store(http->prefix, NULL, length, 0);
+		return ok;
 	}
+	gchar *path   = _get_cache_path(http, local);
+	gchar *parent = g_path_get_dirname(path);
+	g_mkdir_with_parents(parent, 0755);
+	gboolean ok = g_file_set_contents(path, data, length, NULL);
+	if (ok)
+		grits_cache_store(http->prefix, local, length, 0);
+	else
+		g_warning("GritsHttp: store - error writing %s", path);
+	g_free(parent);
+	g_free(path);
+	return ok;
+}
 
-	/* TODO: free everything.. */
-	return path;
+/**
+ * grits_http_discard:
+ * @http:  the #GritsHttp connection to use
+ * @local: the local name of the file
+ *
+ * Remove a file from the cache, for instance because it could not be read.
+ */
+void grits_http_discard(GritsHttp *http, const gchar *local)
+{
+	g_debug("GritsHttp: discard - %s", local);
+	if (http->pack)
+		grits_pack_remove(http->pack, local);
+	gchar *path = _get_cache_path(http, local);
+	g_remove(path);
+	_meta_remove(path);
+	g_free(path);
+	grits_cache_remove(http->prefix, local);
 }
 
 /**
@@ -22,15 +22,87 @@
 #include <libsoup/soup.h>
 
 #include "grits-data.h"
+#include "grits-pack.h"
+
+/**
+ * GritsHttpDoneCallback:
+ * @path:      local path to the complete file, or NULL on error
+ * @user_data: the user_data argument passed to the function
+ *
+ * Function called when an asynchronous fetch has finished
+ */
+typedef void (*GritsHttpDoneCallback)(gchar *path, gpointer user_data);
+
+/**
+ * GritsStreamCallback:
+ * @data:      the data which was received
+ * @length:    the length of @data
+ * @user_data: the user_data argument passed to the function
+ *
+ * Function called with the data in a file while it is downloaded
+ *
+ * Returns: FALSE to stop receiving data
+ */
+typedef gboolean (*GritsStreamCallback)(gconstpointer data, gsize length,
+		gpointer user_data);
+
+/**
+ * GritsHttpPriority:
+ * @GRITS_PRIORITY_LOW:    Bulk downloads which are not needed right away
+ * @GRITS_PRIORITY_NORMAL: Default priority, for data which is being viewed
+ * @GRITS_PRIORITY_HIGH:   Urgent requests
+ *
+ * Request priorities. Requests are held back or paused while any request with
+ * a higher priority is being downloaded, for a few seconds at most.
+ */
+typedef enum {
+	GRITS_PRIORITY_LOW,
+	GRITS_PRIORITY_NORMAL,
+	GRITS_PRIORITY_HIGH,
+	GRITS_PRIORITY_COUNT,
+} GritsHttpPriority;
+
+/**
+ * GritsHttpBucket:
+ * @rate:   number of bytes per second allowed, or 0 for no limit
+ * @tokens: number of bytes which can currently be downloaded
+ * @time:   time at which @tokens was last updated, in microseconds
+ *
+ * Token bucket used to limit the download rate
+ */
+typedef struct _GritsHttpBucket {
+	gint64  rate;
+	gdouble tokens;
+	gint64  time;
+} GritsHttpBucket;
 
 typedef struct _GritsHttp {
-	SoupSession *soup;
+	SoupSession *soup; /* Shared by all #GritsHttp, use grits_http_abort() */
 	gchar *prefix;
 	gboolean aborted;
+	GritsPack *pack;
+	GMutex lock;
+	GCond  idle;
+	GList *requests;
+	gint   running;
+	GritsHttpPriority priority;
+	GritsHttpBucket   bucket;
 } GritsHttp;
 
+void grits_http_set_connections(gint max, gint per_host);
+
+void grits_http_set_bandwidth(gint64 rate);
+
+void grits_http_set_pack_cache(gboolean enable);
+
 GritsHttp *grits_http_new(const gchar *prefix);
 
+void grits_http_set_priority(GritsHttp *http, GritsHttpPriority priority);
+
+void grits_http_set_thread_priority(GritsHttpPriority priority);
+
+void grits_http_set_rate(GritsHttp *http, gint64 rate);
+
 void grits_http_abort(GritsHttp *http);
 
 void grits_http_free(GritsHttp *http);
@@ -40,6 +112,33 @@ gchar *grits_http_fetch(GritsHttp *http, const gchar *uri, const gchar *local,
 		GritsChunkCallback callback,
 		gpointer user_data);
 
+void grits_http_fetch_async(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode,
+		GritsChunkCallback callback,
+		gpointer user_data,
+		GritsHttpDoneCallback done,
+		gpointer done_data);
+
+GBytes *grits_http_fetch_bytes(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode,
+		GritsChunkCallback callback,
+		gpointer user_data);
+
+GBytes *grits_http_fetch_stream(GritsHttp *http, const gchar *uri, const gchar *local,
+		GritsCacheType mode,
+		GritsChunkCallback callback,
+		gpointer user_data,
+		GritsStreamCallback stream,
+		gpointer stream_data,
+		gboolean *streamed);
+
+gboolean grits_http_has(GritsHttp *http, const gchar *local);
+
+gboolean grits_http_store(GritsHttp *http, const gchar *local,
+		gconstpointer data, gsize length);
+
+void grits_http_discard(GritsHttp *http, const gchar *local);
+
 GList *grits_http_available(GritsHttp *http,
 		gchar *filter, gchar *cache,
 		gchar *extract, gchar *index);
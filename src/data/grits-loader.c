@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-loader
+ * @short_description: Shared background loading
+ *
+ * #GritsLoader runs background loading jobs, such as downloading and decoding
+ * tiles, for several data sources at once. Each job is run in two stages.
+ * The fetch stage runs on a set of I/O threads and is expected to spend most
+ * of its time waiting on the network or disk. The decode stage runs on a
+ * separate set of threads, one per processor by default, and is expected to
+ * be CPU bound.
+ *
+ * The number of I/O threads adapts to the observed fetch latency. More threads
+ * are used when fetches are slow and jobs are waiting, fewer when the decode
+ * threads can not keep up.
+ *
+ * Queues created with grits_loader_queue_new_async() only start their fetches
+ * from the I/O threads and finish them later, so a few threads can keep many
+ * downloads in flight at once.
+ *
+ * Each data source adds jobs to its own #GritsLoaderQueue. Queues are served
+ * round robin so that one busy layer can not starve the others, and jobs
+ * needed for the current view are always run before prefetch jobs. Prefetch
+ * jobs also make their HTTP requests with %GRITS_PRIORITY_LOW.
+ */
+
+#include <config.h>
+#include <glib.h>
+
+#include "grits-loader.h"
+#include "grits-http.h"
+
+/* Default number of I/O threads */
+#define IO_MIN 2
+#define IO_MAX 8
+
+/* Fetches faster than this are not waiting on the network,
+ * adding more threads for them will not help */
+#define IO_SLOW 0.05
+
+/* Maximum number of asynchronous fetches in flight */
+#define IO_PENDING 32
+
+/* For passing jobs between threads */
+struct _GritsLoaderJob {
+	GritsLoaderQueue *queue;
+	gpointer          item;
+	gpointer          data;
+	gboolean          prefetch;
+};
+
+/* Called with the lock held */
+static void _grits_loader_job_done(struct _GritsLoaderJob *job)
+{
+	if (--job->queue->running == 0)
+		g_cond_broadcast(&job->queue->idle);
+	g_free(job);
+}
+
+/* Find the next job, visible items first, then prefetched items.
+ * The queue it came from goes to the back of the line. Asynchronous
+ * queues are skipped while too many of their fetches are in flight.
+ * Called with the lock held. */
+static struct _GritsLoaderJob *_grits_loader_next(GritsLoader *loader)
+{
+	for (int pass = 0; pass < 2; pass++) {
+		for (GList *cur = loader->queues.head; cur; cur = cur->next) {
+			GritsLoaderQueue *queue = cur->data;
+			GQueue *items = pass == 0 ? &queue->visible : &queue->prefetch;
+			if (g_queue_is_empty(items))
+				continue;
+			if (queue->start && loader->io_pending >= IO_PENDING)
+				continue;
+			g_queue_unlink(&loader->queues, cur);
+			g_queue_push_tail_link(&loader->queues, cur);
+			struct _GritsLoaderJob *job = g_new0(struct _GritsLoaderJob, 1);
+			job->queue    = queue;
+			job->item     = g_queue_pop_head(items);
+			job->prefetch = pass == 1;
+			queue->running++;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static guint _grits_loader_waiting(GritsLoader *loader)
+{
+	guint waiting = 0;
+	for (GList *cur = loader->queues.head; cur; cur = cur->next) {
+		GritsLoaderQueue *queue = cur->data;
+		waiting += queue->visible.length + queue->prefetch.length;
+	}
+	return waiting;
+}
+
+static gpointer _grits_loader_io_thread(gpointer _loader);
+
+/* Adjust the number of I/O threads after a fetch completes.
+ * Called with the lock held. */
+static void _grits_loader_adapt(GritsLoader *loader, gdouble elapsed)
+{
+	loader->latency = loader->latency*0.8 + elapsed*0.2;
+
+	guint waiting = _grits_loader_waiting(loader);
+	guint decode  = g_thread_pool_unprocessed(loader->decode);
+	guint cpus    = g_thread_pool_get_max_threads(loader->decode);
+
+	if (decode > cpus*2) {
+		/* Decoding can't keep up, don't fetch faster than that */
+		if (loader->io_limit > loader->io_min)
+			loader->io_limit--;
+	} else if (waiting > 0 && loader->latency > IO_SLOW) {
+		/* Waiting on the network with work to do, add a thread */
+		if (loader->io_limit < loader->io_max)
+			loader->io_limit++;
+	}
+
+	while (g_list_length(loader->threads) < loader->io_limit)
+		loader->threads = g_list_prepend(loader->threads,
+				g_thread_new("grits-loader", _grits_loader_io_thread, loader));
+	g_cond_broadcast(&loader->cond);
+}
+
+static gpointer _grits_loader_io_thread(gpointer _loader)
+{
+	GritsLoader *loader = _loader;
+	g_mutex_lock(&loader->lock);
+	while (!loader->stopping) {
+		struct _GritsLoaderJob *job = NULL;
+		if (loader->io_busy < loader->io_limit)
+			job = _grits_loader_next(loader);
+		if (!job) {
+			g_cond_wait(&loader->cond, &loader->lock);
+			continue;
+		}
+		GritsLoaderQueue *queue = job->queue;
+
+		/* Start an asynchronous fetch, it finishes on its own */
+		if (queue->start) {
+			loader->io_pending++;
+			g_mutex_unlock(&loader->lock);
+			grits_http_set_thread_priority(job->prefetch ?
+					GRITS_PRIORITY_LOW : GRITS_PRIORITY_HIGH);
+			queue->start(job->item, job, queue->user_data);
+			g_mutex_lock(&loader->lock);
+			continue;
+		}
+
+		loader->io_busy++;
+		g_mutex_unlock(&loader->lock);
+
+		/* Fetch */
+		gint64 start = g_get_monotonic_time();
+		grits_http_set_thread_priority(job->prefetch ?
+				GRITS_PRIORITY_LOW : GRITS_PRIORITY_HIGH);
+		job->data = queue->fetch(job->item, queue->user_data);
+		gdouble elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+		/* Hand off to the decode threads */
+		if (job->data && queue->decode) {
+			g_thread_pool_push(loader->decode, job, NULL);
+			job = NULL;
+		}
+
+		g_mutex_lock(&loader->lock);
+		loader->io_busy--;
+		_grits_loader_adapt(loader, elapsed);
+		if (job)
+			_grits_loader_job_done(job);
+	}
+	g_mutex_unlock(&loader->lock);
+	return NULL;
+}
+
+static void _grits_loader_decode_thread(gpointer _job, gpointer _loader)
+{
+	GritsLoader *loader = _loader;
+	struct _GritsLoaderJob *job = _job;
+	job->queue->decode(job->item, job->data, job->queue->user_data);
+	g_mutex_lock(&loader->lock);
+	_grits_loader_job_done(job);
+	g_mutex_unlock(&loader->lock);
+}
+
+/**
+ * grits_loader_new:
+ * @io_min: minimum number of I/O threads, or 0 for the default
+ * @io_max: maximum number of I/O threads, or 0 for the default
+ * @decode: number of decode threads, or 0 for one per processor
+ *
+ * Create a new loader. Most users should share the default loader returned
+ * by grits_loader_get_default() instead.
+ *
+ * Returns: the new #GritsLoader
+ */
+GritsLoader *grits_loader_new(gint io_min, gint io_max, gint decode)
+{
+	g_debug("GritsLoader: new - io=%d-%d decode=%d", io_min, io_max, decode);
+	GritsLoader *loader = g_new0(GritsLoader, 1);
+	g_mutex_init(&loader->lock);
+	g_cond_init(&loader->cond);
+	g_queue_init(&loader->queues);
+	loader->decode = g_thread_pool_new(_grits_loader_decode_thread,
+			loader, 1, FALSE, NULL);
+	grits_loader_set_threads(loader, io_min, io_max, decode);
+	return loader;
+}
+
+/**
+ * grits_loader_get_default:
+ *
+ * Get the loader shared by all the plugins. The default loader is never
+ * freed.
+ *
+ * Returns: the default #GritsLoader
+ */
+GritsLoader *grits_loader_get_default(void)
+{
+	static gsize loader = 0;
+	if (g_once_init_enter(&loader))
+		g_once_init_leave(&loader, (gsize)grits_loader_new(0, 0, 0));
+	return (GritsLoader*)loader;
+}
+
+/**
+ * grits_loader_set_threads:
+ * @loader: the loader to configure
+ * @io_min: minimum number of I/O threads, or 0 for the default
+ * @io_max: maximum number of I/O threads, or 0 for the default
+ * @decode: number of decode threads, or 0 for one per processor
+ *
+ * Change the number of threads used by the loader. The number of I/O threads
+ * varies between @io_min and @io_max depending on the fetch latency.
+ */
+void grits_loader_set_threads(GritsLoader *loader,
+		gint io_min, gint io_max, gint decode)
+{
+	g_mutex_lock(&loader->lock);
+	loader->io_min   = io_min > 0 ? io_min : IO_MIN;
+	loader->io_max   = MAX(io_max > 0 ? io_max : IO_MAX, loader->io_min);
+	loader->io_limit = CLAMP(loader->io_limit, loader->io_min, loader->io_max);
+	while (g_list_length(loader->threads) < loader->io_limit)
+		loader->threads = g_list_prepend(loader->threads,
+				g_thread_new("grits-loader", _grits_loader_io_thread, loader));
+	g_cond_broadcast(&loader->cond);
+	g_mutex_unlock(&loader->lock);
+
+	g_thread_pool_set_max_threads(loader->decode,
+			decode > 0 ? decode : g_get_num_processors(), NULL);
+}
+
+/**
+ * grits_loader_free:
+ * @loader: the loader to free
+ *
+ * Stop all the loaders threads and free it. All queues using the loader must
+ * be freed first.
+ */
+void grits_loader_free(GritsLoader *loader)
+{
+	g_debug("GritsLoader: free");
+	g_mutex_lock(&loader->lock);
+	loader->stopping = TRUE;
+	g_cond_broadcast(&loader->cond);
+	g_mutex_unlock(&loader->lock);
+	for (GList *cur = loader->threads; cur; cur = cur->next)
+		g_thread_join(cur->data);
+	g_list_free(loader->threads);
+	g_thread_pool_free(loader->decode, FALSE, TRUE);
+	g_cond_clear(&loader->cond);
+	g_mutex_clear(&loader->lock);
+	g_free(loader);
+}
+
+/**
+ * grits_loader_queue_new:
+ * @loader:    the loader to run jobs on
+ * @fetch:     function called from the I/O threads for each item
+ * @decode:    function called from the decode threads, or NULL if @fetch
+ *             does all the work
+ * @user_data: user data passed to the functions
+ *
+ * Create a new queue for loading items, usually one queue is used for each
+ * layer of data.
+ *
+ * Returns: the new #GritsLoaderQueue
+ */
+GritsLoaderQueue *grits_loader_queue_new(GritsLoader *loader,
+		GritsLoaderFetchFunc fetch, GritsLoaderDecodeFunc decode,
+		gpointer user_data)
+{
+	GritsLoaderQueue *queue = g_new0(GritsLoaderQueue, 1);
+	queue->loader    = loader;
+	queue->fetch     = fetch;
+	queue->decode    = decode;
+	queue->user_data = user_data;
+	g_queue_init(&queue->visible);
+	g_queue_init(&queue->prefetch);
+	g_cond_init(&queue->idle);
+	g_mutex_lock(&loader->lock);
+	g_queue_push_tail(&loader->queues, queue);
+	g_mutex_unlock(&loader->lock);
+	return queue;
+}
+
+/**
+ * grits_loader_queue_new_async:
+ * @loader:    the loader to run jobs on
+ * @start:     function called from the I/O threads to start fetching an item
+ * @decode:    function called from the decode threads, or NULL if the fetch
+ *             does all the work
+ * @user_data: user data passed to the functions
+ *
+ * Create a new queue for loading items with an asynchronous fetch stage. The
+ * I/O threads only start each fetch, up to a fixed number of fetches are kept
+ * in flight at once, and the decode stage runs once @start's fetch calls
+ * grits_loader_job_finish().
+ *
+ * Returns: the new #GritsLoaderQueue
+ */
+GritsLoaderQueue *grits_loader_queue_new_async(GritsLoader *loader,
+		GritsLoaderStartFunc start, GritsLoaderDecodeFunc decode,
+		gpointer user_data)
+{
+	GritsLoaderQueue *queue = grits_loader_queue_new(loader,
+			NULL, decode, user_data);
+	queue->start = start;
+	return queue;
+}
+
+/**
+ * grits_loader_job_finish:
+ * @job:  the job passed to the #GritsLoaderStartFunc
+ * @data: the data to pass to the decode function, or NULL on error
+ *
+ * Finish the fetch stage of a job started by a #GritsLoaderStartFunc. This can
+ * be called from any thread and does not block.
+ */
+void grits_loader_job_finish(GritsLoaderJob *job, gpointer data)
+{
+	GritsLoader *loader = job->queue->loader;
+	job->data = data;
+	if (job->data && job->queue->decode) {
+		g_thread_pool_push(loader->decode, job, NULL);
+		job = NULL;
+	}
+	g_mutex_lock(&loader->lock);
+	loader->io_pending--;
+	if (job)
+		_grits_loader_job_done(job);
+	g_cond_signal(&loader->cond);
+	g_mutex_unlock(&loader->lock);
+}
+
+/**
+ * grits_loader_push:
+ * @queue:    the queue to add the item to
+ * @item:     the item to load
+ * @prefetch: TRUE if the item is not needed yet
+ *
+ * Add an item to be loaded. Prefetched items are only loaded when there are no
+ * other items waiting to be loaded.
+ */
+void grits_loader_push(GritsLoaderQueue *queue, gpointer item,
+		gboolean prefetch)
+{
+	GritsLoader *loader = queue->loader;
+	g_mutex_lock(&loader->lock);
+	g_queue_push_tail(prefetch ? &queue->prefetch : &queue->visible, item);
+	g_cond_signal(&loader->cond);
+	g_mutex_unlock(&loader->lock);
+}
+
+/**
+ * grits_loader_promote:
+ * @queue: the queue the item was added to
+ * @item:  the item to promote
+ *
+ * Load a prefetched item as soon as visible items are, because it is needed
+ * now. Nothing is done if the item is not waiting in the prefetch queue.
+ */
+void grits_loader_promote(GritsLoaderQueue *queue, gpointer item)
+{
+	GritsLoader *loader = queue->loader;
+	g_mutex_lock(&loader->lock);
+	if (g_queue_remove(&queue->prefetch, item)) {
+		g_queue_push_tail(&queue->visible, item);
+		g_cond_signal(&loader->cond);
+	}
+	g_mutex_unlock(&loader->lock);
+}
+
+/**
+ * grits_loader_unprocessed:
+ * @queue: the queue to check
+ *
+ * Get the number of items in the queue which have not been started.
+ *
+ * Returns: the number of waiting items
+ */
+guint grits_loader_unprocessed(GritsLoaderQueue *queue)
+{
+	GritsLoader *loader = queue->loader;
+	g_mutex_lock(&loader->lock);
+	guint waiting = queue->visible.length + queue->prefetch.length;
+	g_mutex_unlock(&loader->lock);
+	return waiting;
+}
+
+/**
+ * grits_loader_queue_free:
+ * @queue: the queue to free
+ *
+ * Drop all items which have not been started and wait for items which are
+ * currently being fetched or decoded to finish, then free the queue.
+ */
+void grits_loader_queue_free(GritsLoaderQueue *queue)
+{
+	GritsLoader *loader = queue->loader;
+	g_mutex_lock(&loader->lock);
+	g_queue_remove(&loader->queues, queue);
+	g_queue_clear(&queue->visible);
+	g_queue_clear(&queue->prefetch);
+	while (queue->running > 0)
+		g_cond_wait(&queue->idle, &loader->lock);
+	g_mutex_unlock(&loader->lock);
+	g_cond_clear(&queue->idle);
+	g_free(queue);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_LOADER_H__
+#define __GRITS_LOADER_H__
+
+#include <glib.h>
+
+typedef struct _GritsLoaderJob GritsLoaderJob;
+
+/**
+ * GritsLoaderFetchFunc:
+ * @item:      the item to fetch
+ * @user_data: the user_data argument passed to grits_loader_queue_new()
+ *
+ * Fetch the data for an item, e.g. by downloading a file. This is called from
+ * one of the loaders I/O threads.
+ *
+ * Returns: the data to pass to the decode function, or NULL on error
+ */
+typedef gpointer (*GritsLoaderFetchFunc)(gpointer item, gpointer user_data);
+
+/**
+ * GritsLoaderDecodeFunc:
+ * @item:      the item to decode
+ * @data:      the data returned by the fetch function
+ * @user_data: the user_data argument passed to grits_loader_queue_new()
+ *
+ * Decode the data for an item, e.g. by loading an image. This is called from
+ * one of the loaders decode threads and is responsible for freeing @data.
+ */
+typedef void (*GritsLoaderDecodeFunc)(gpointer item, gpointer data,
+		gpointer user_data);
+
+/**
+ * GritsLoaderStartFunc:
+ * @item:      the item to fetch
+ * @job:       the job to pass to grits_loader_job_finish()
+ * @user_data: the user_data argument passed to grits_loader_queue_new_async()
+ *
+ * Start fetching the data for an item without waiting for it, e.g. by using
+ * grits_http_fetch_async(). This is called from one of the loaders I/O threads
+ * and must call grits_loader_job_finish() exactly once, from any thread, when
+ * the data is available or the fetch has failed.
+ */
+typedef void (*GritsLoaderStartFunc)(gpointer item, GritsLoaderJob *job,
+		gpointer user_data);
+
+typedef struct _GritsLoader {
+	GMutex       lock;
+	GCond        cond;
+	GQueue       queues;
+	GThreadPool *decode;
+	GList       *threads;
+	gint         io_min;
+	gint         io_max;
+	gint         io_limit;
+	gint         io_busy;
+	gint         io_pending;
+	gdouble      latency;
+	gboolean     stopping;
+} GritsLoader;
+
+typedef struct _GritsLoaderQueue {
+	GritsLoader          *loader;
+	GritsLoaderFetchFunc  fetch;
+	GritsLoaderStartFunc  start;
+	GritsLoaderDecodeFunc decode;
+	gpointer              user_data;
+	GQueue                visible;
+	GQueue                prefetch;
+	gint                  running;
+	GCond                 idle;
+} GritsLoaderQueue;
+
+GritsLoader *grits_loader_new(gint io_min, gint io_max, gint decode);
+
+GritsLoader *grits_loader_get_default(void);
+
+void grits_loader_set_threads(GritsLoader *loader,
+		gint io_min, gint io_max, gint decode);
+
+void grits_loader_free(GritsLoader *loader);
+
+GritsLoaderQueue *grits_loader_queue_new(GritsLoader *loader,
+		GritsLoaderFetchFunc fetch, GritsLoaderDecodeFunc decode,
+		gpointer user_data);
+
+GritsLoaderQueue *grits_loader_queue_new_async(GritsLoader *loader,
+		GritsLoaderStartFunc start, GritsLoaderDecodeFunc decode,
+		gpointer user_data);
+
+void grits_loader_job_finish(GritsLoaderJob *job, gpointer data);
+
+void grits_loader_push(GritsLoaderQueue *queue, gpointer item,
+		gboolean prefetch);
+
+void grits_loader_promote(GritsLoaderQueue *queue, gpointer item);
+
+guint grits_loader_unprocessed(GritsLoaderQueue *queue);
+
+void grits_loader_queue_free(GritsLoaderQueue *queue);
+
+#endif
@@ -0,0 +1,677 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * SECTION:grits-pack
+ * @short_description: Packed file cache
+ *
+ * #GritsPack stores a large number of small files, such as map tiles, in a
+ * single append-only data file instead of one file per tile. A separate index
+ * file records where each file is stored and is memory mapped when the pack is
+ * opened, so looking up a file does not touch the disk.
+ *
+ * Files read from the pack are returned as #GBytes which point directly into
+ * a memory mapping of the data file, so they can be decoded without copying.
+ *
+ * Replacing or removing a file leaves the old copy in the data file until
+ * the pack is compacted.
+ *
+ * The pack keeps track of when each file was last read while it is open so
+ * that the least recently used files can be evicted.
+ *
+ * Several processes can use the same pack at once, for example grits-seed
+ * and the viewer. Writes and compaction lock the index file, and each process
+ * picks up the files added by the others the next time it takes the lock.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifndef G_OS_WIN32
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+#include "grits-pack.h"
+
+/* Index file header */
+#define PACK_MAGIC   "GRITS PACK 1\n"
+#define PACK_HEADER  16
+
+/* Offset used to mark removed entries */
+#define PACK_REMOVED G_MAXUINT64
+
+/* Compact on open or after evicting when more than this many bytes are
+ * unused, so that removed files are not rewritten out one at a time */
+#define PACK_WASTE   (16*1024*1024)
+
+/* All open packs, so that each directory is only opened once */
+static GHashTable *_packs;
+static GMutex      _packs_lock;
+
+static guint64 _grits_pack_key(const gchar *name)
+{
+	/* FNV-1a */
+	guint64 key = 14695981039346656037ULL;
+	for (const guchar *c = (const guchar*)name; *c; c++)
+		key = (key ^ *c) * 1099511628211ULL;
+	return key;
+}
+
+/* Add an entry to the in memory index. Called with the lock held */
+static void _grits_pack_insert(GritsPack *pack, GritsPackEntry *entry)
+{
+	/* Skip entries whose data was lost */
+	if (entry->offset != PACK_REMOVED &&
+	    entry->offset + entry->name_len + entry->length > pack->size)
+		return;
+	GritsPackEntry *old = g_hash_table_lookup(pack->entries, &entry->key);
+	if (old)
+		pack->live -= old->name_len + old->length;
+	if (entry->offset == PACK_REMOVED) {
+		g_hash_table_remove(pack->entries, &entry->key);
+		g_hash_table_remove(pack->access,  &entry->key);
+	} else {
+		g_hash_table_replace(pack->entries, &entry->key, entry);
+		pack->live += entry->name_len + entry->length;
+	}
+}
+
+/* Map the data file again after it has grown */
+static void _grits_pack_remap(GritsPack *pack)
+{
+	if (pack->data_map)
+		g_mapped_file_unref(pack->data_map);
+	pack->data_map = g_mapped_file_new(pack->data_path, FALSE, NULL);
+}
+
+/* Read the index file, returns FALSE if it is not a valid index.
+ * Called with the lock held */
+static gboolean _grits_pack_load(GritsPack *pack)
+{
+	g_hash_table_remove_all(pack->entries);
+	g_slist_free_full(pack->added, g_free);
+	pack->added = NULL;
+	if (pack->index_map)
+		g_mapped_file_unref(pack->index_map);
+	_grits_pack_remap(pack);
+	pack->index_map = g_mapped_file_new(pack->index_path, FALSE, NULL);
+	pack->size = pack->data_map ? g_mapped_file_get_length(pack->data_map) : 0;
+	pack->live = 0;
+	pack->index_len = PACK_HEADER;
+
+	if (!pack->index_map)
+		return FALSE;
+	gchar *index = g_mapped_file_get_contents(pack->index_map);
+	gsize  len   = g_mapped_file_get_length(pack->index_map);
+	if (len < PACK_HEADER || memcmp(index, PACK_MAGIC, sizeof(PACK_MAGIC)))
+		return FALSE;
+	for (; pack->index_len+sizeof(GritsPackEntry) <= len;
+			pack->index_len += sizeof(GritsPackEntry))
+		_grits_pack_insert(pack, (GritsPackEntry*)(index+pack->index_len));
+	return TRUE;
+}
+
+/* Open the data and index files for appending. Called with the lock held */
+static gboolean _grits_pack_append(GritsPack *pack, const gchar *mode)
+{
+	pack->data  = fopen(pack->data_path,  mode);
+	pack->index = fopen(pack->index_path, mode);
+	if (!pack->data || !pack->index) {
+		g_warning("GritsPack: append - error opening %s", pack->dir);
+		return FALSE;
+	}
+	fseek(pack->data,  0, SEEK_END);
+	fseek(pack->index, 0, SEEK_END);
+	if (ftell(pack->index) == 0) {
+		gchar header[PACK_HEADER] = PACK_MAGIC;
+		fwrite(header, sizeof(header), 1, pack->index);
+		fflush(pack->index);
+	}
+	return TRUE;
+}
+
+/* Lock or unlock the index file against other processes using the pack */
+static void _grits_pack_flock(GritsPack *pack, gboolean lock)
+{
+#ifndef G_OS_WIN32
+	while (flock(fileno(pack->index), lock ? LOCK_EX : LOCK_UN) &&
+			errno == EINTR);
+#endif
+}
+
+/* Check whether another process has compacted the pack, which replaces the
+ * files we have open */
+static gboolean _grits_pack_replaced(GritsPack *pack)
+{
+#ifndef G_OS_WIN32
+	GStatBuf path, file;
+	return g_stat(pack->index_path, &path) ||
+	       fstat(fileno(pack->index), &file) ||
+	       path.st_dev != file.st_dev || path.st_ino != file.st_ino;
+#else
+	return FALSE;
+#endif
+}
+
+/* Lock the pack against other processes and pick up the changes they made
+ * since the last time. Called with the lock held */
+static void _grits_pack_lock(GritsPack *pack)
+{
+	gboolean reopened = FALSE;
+	for (;;) {
+		_grits_pack_flock(pack, TRUE);
+		if (!_grits_pack_replaced(pack))
+			break;
+		fclose(pack->data);
+		fclose(pack->index);
+		_grits_pack_append(pack, "a+b");
+		reopened = TRUE;
+	}
+	if (reopened) {
+		_grits_pack_load(pack);
+		return;
+	}
+
+	/* Read the entries appended by other processes, nothing is partially
+	 * written while the index is locked */
+	GritsPackEntry entry;
+	fseek(pack->data, 0, SEEK_END);
+	pack->size = ftell(pack->data);
+	fseek(pack->index, pack->index_len, SEEK_SET);
+	while (fread(&entry, sizeof(entry), 1, pack->index)) {
+		GritsPackEntry *added = g_memdup(&entry, sizeof(entry));
+		pack->added = g_slist_prepend(pack->added, added);
+		_grits_pack_insert(pack, added);
+		pack->index_len += sizeof(entry);
+	}
+	fseek(pack->index, 0, SEEK_END);
+}
+
+/* Called with the lock held */
+static void _grits_pack_unlock(GritsPack *pack)
+{
+	fflush(pack->data);
+	fflush(pack->index);
+	_grits_pack_flock(pack, FALSE);
+}
+
+/* Called with the lock held and the pack locked, the new files are locked
+ * when it returns */
+static void _grits_pack_compact(GritsPack *pack)
+{
+	g_debug("GritsPack: compact - %s live=%"G_GUINT64_FORMAT
+			" size=%"G_GUINT64_FORMAT, pack->dir, pack->live, pack->size);
+	gchar *data_tmp  = g_strconcat(pack->data_path,  ".new", NULL);
+	gchar *index_tmp = g_strconcat(pack->index_path, ".new", NULL);
+	FILE  *data      = fopen(data_tmp,  "wb");
+	FILE  *index     = fopen(index_tmp, "wb");
+	gboolean ok      = data && index;
+
+	/* Copy the live entries to the new files */
+	gchar header[PACK_HEADER] = PACK_MAGIC;
+	ok = ok && fwrite(header, sizeof(header), 1, index);
+	const gchar *contents = pack->data_map ?
+		g_mapped_file_get_contents(pack->data_map) : NULL;
+	guint64 offset = 0;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, pack->entries);
+	while (ok && g_hash_table_iter_next(&iter, NULL, &value)) {
+		GritsPackEntry entry = *(GritsPackEntry*)value;
+		gsize size = entry.name_len + entry.length;
+		ok = ok && fwrite(contents+entry.offset, size, 1, data);
+		entry.offset = offset;
+		offset += size;
+		ok = ok && fwrite(&entry, sizeof(entry), 1, index);
+	}
+	if (data  && fclose(data))  ok = FALSE;
+	if (index && fclose(index)) ok = FALSE;
+
+	/* Replace the old files */
+	if (ok) {
+		fclose(pack->data);
+		fclose(pack->index);
+		ok = !g_rename(data_tmp,  pack->data_path) &&
+		     !g_rename(index_tmp, pack->index_path);
+		_grits_pack_append(pack, "a+b");
+		_grits_pack_flock(pack, TRUE);
+		_grits_pack_load(pack);
+	}
+	if (!ok) {
+		g_warning("GritsPack: compact - error writing %s", pack->dir);
+		g_remove(data_tmp);
+		g_remove(index_tmp);
+	}
+	g_free(data_tmp);
+	g_free(index_tmp);
+}
+
+/**
+ * grits_pack_open:
+ * @dir: the directory to store the pack in
+ *
+ * Open the pack stored in @dir, creating it if it does not exist. Opening the
+ * same directory more than once returns the same pack.
+ *
+ * Returns: the #GritsPack, or NULL on error
+ */
+GritsPack *grits_pack_open(const gchar *dir)
+{
+	g_mutex_lock(&_packs_lock);
+	if (!_packs)
+		_packs = g_hash_table_new(g_str_hash, g_str_equal);
+	GritsPack *pack = g_hash_table_lookup(_packs, dir);
+	if (pack) {
+		pack->refs++;
+		g_mutex_unlock(&_packs_lock);
+		return pack;
+	}
+
+	g_debug("GritsPack: open - %s", dir);
+	g_mkdir_with_parents(dir, 0755);
+	pack = g_new0(GritsPack, 1);
+	g_mutex_init(&pack->lock);
+	pack->refs       = 1;
+	pack->dir        = g_strdup(dir);
+	pack->data_path  = g_build_filename(dir, "pack.dat", NULL);
+	pack->index_path = g_build_filename(dir, "pack.idx", NULL);
+	pack->entries    = g_hash_table_new(g_int64_hash, g_int64_equal);
+	pack->access     = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			g_free, NULL);
+	if (!_grits_pack_append(pack, "a+b")) {
+		g_mutex_unlock(&_packs_lock);
+		pack->refs = 0;
+		grits_pack_close(pack);
+		return NULL;
+	}
+
+	/* Start over if the index is unreadable */
+	_grits_pack_flock(pack, TRUE);
+	if (!_grits_pack_load(pack)) {
+		g_warning("GritsPack: open - invalid index in %s", dir);
+		fclose(pack->data);
+		fclose(pack->index);
+		_grits_pack_append(pack, "w+b");
+		_grits_pack_flock(pack, TRUE);
+		_grits_pack_load(pack);
+	}
+
+	/* Clean up partial writes and wasted space */
+	gsize len = pack->index_map ?
+		g_mapped_file_get_length(pack->index_map) - PACK_HEADER : 0;
+	if (len % sizeof(GritsPackEntry) || pack->size - pack->live > PACK_WASTE)
+		_grits_pack_compact(pack);
+	_grits_pack_unlock(pack);
+
+	g_hash_table_insert(_packs, pack->dir, pack);
+	g_mutex_unlock(&_packs_lock);
+	return pack;
+}
+
+/**
+ * grits_pack_ref:
+ * @pack: the pack to reference
+ *
+ * Take another reference to an open pack, it must be released with
+ * grits_pack_close().
+ *
+ * Returns: @pack
+ */
+GritsPack *grits_pack_ref(GritsPack *pack)
+{
+	g_mutex_lock(&_packs_lock);
+	pack->refs++;
+	g_mutex_unlock(&_packs_lock);
+	return pack;
+}
+
+/**
+ * grits_pack_close:
+ * @pack: the pack to close
+ *
+ * Release a pack returned by grits_pack_open(). #GBytes returned from the pack
+ * remain valid after it is closed.
+ */
+void grits_pack_close(GritsPack *pack)
+{
+	g_mutex_lock(&_packs_lock);
+	if (--pack->refs > 0) {
+		g_mutex_unlock(&_packs_lock);
+		return;
+	}
+	g_debug("GritsPack: close - %s", pack->dir);
+	if (g_hash_table_lookup(_packs, pack->dir) == pack)
+		g_hash_table_remove(_packs, pack->dir);
+	g_mutex_unlock(&_packs_lock);
+
+	if (pack->data)      fclose(pack->data);
+	if (pack->index)     fclose(pack->index);
+	if (pack->data_map)  g_mapped_file_unref(pack->data_map);
+	if (pack->index_map) g_mapped_file_unref(pack->index_map);
+	g_hash_table_destroy(pack->entries);
+	g_hash_table_destroy(pack->access);
+	g_slist_free_full(pack->added, g_free);
+	g_mutex_clear(&pack->lock);
+	g_free(pack->dir);
+	g_free(pack->data_path);
+	g_free(pack->index_path);
+	g_free(pack);
+}
+
+/**
+ * grits_pack_has:
+ * @pack: the pack to search
+ * @name: the name of the file
+ *
+ * Check whether a file is stored in the pack
+ *
+ * Returns: TRUE if the file is in the pack
+ */
+gboolean grits_pack_has(GritsPack *pack, const gchar *name)
+{
+	guint64 key = _grits_pack_key(name);
+	g_mutex_lock(&pack->lock);
+	gboolean found = g_hash_table_lookup(pack->entries, &key) != NULL;
+	if (!found) {
+		/* Check for files added by other processes */
+		_grits_pack_lock(pack);
+		_grits_pack_unlock(pack);
+		found = g_hash_table_lookup(pack->entries, &key) != NULL;
+	}
+	g_mutex_unlock(&pack->lock);
+	return found;
+}
+
+/* Check whether an entry is within the mapped data. Called with the lock held */
+static gboolean _grits_pack_mapped(GritsPack *pack, GritsPackEntry *entry)
+{
+	return entry && pack->data_map &&
+		g_mapped_file_get_length(pack->data_map) >=
+			entry->offset + entry->name_len + entry->length;
+}
+
+/**
+ * grits_pack_get:
+ * @pack:  the pack to read from
+ * @name:  the name of the file
+ * @entry: location to store the index record for the file, or NULL
+ *
+ * Read a file from the pack. The returned data points into a memory mapping
+ * of the pack and is not copied.
+ *
+ * Returns: the contents of the file, or NULL if it is not in the pack
+ */
+GBytes *grits_pack_get(GritsPack *pack, const gchar *name,
+		GritsPackEntry *entry)
+{
+	guint64 key = _grits_pack_key(name);
+	GBytes *bytes = NULL;
+	g_mutex_lock(&pack->lock);
+	GritsPackEntry *found = g_hash_table_lookup(pack->entries, &key);
+
+	/* Check for files added by other processes, and map any data added
+	 * since the last lookup */
+	if (!_grits_pack_mapped(pack, found)) {
+		_grits_pack_lock(pack);
+		_grits_pack_unlock(pack);
+		found = g_hash_table_lookup(pack->entries, &key);
+		if (found && !_grits_pack_mapped(pack, found))
+			_grits_pack_remap(pack);
+		if (!_grits_pack_mapped(pack, found))
+			goto out;
+	}
+
+	/* Check for hash collisions */
+	const gchar *data = g_mapped_file_get_contents(pack->data_map) + found->offset;
+	if (found->name_len != strlen(name) || memcmp(data, name, found->name_len))
+		goto out;
+
+	bytes = g_bytes_new_with_free_func(data + found->name_len, found->length,
+			(GDestroyNotify)g_mapped_file_unref,
+			g_mapped_file_ref(pack->data_map));
+	g_hash_table_replace(pack->access, g_memdup(&key, sizeof(key)),
+			GUINT_TO_POINTER(++pack->clock));
+	if (entry)
+		*entry = *found;
+out:
+	g_mutex_unlock(&pack->lock);
+	return bytes;
+}
+
+/* Append an entry to the index file. Called with the lock held and the
+ * pack locked */
+static gboolean _grits_pack_add(GritsPack *pack, GritsPackEntry *entry)
+{
+	if (!fwrite(entry, sizeof(GritsPackEntry), 1, pack->index) ||
+	    fflush(pack->index)) {
+		g_warning("GritsPack: add - error writing %s", pack->index_path);
+		g_free(entry);
+		return FALSE;
+	}
+	pack->added = g_slist_prepend(pack->added, entry);
+	pack->index_len += sizeof(GritsPackEntry);
+	_grits_pack_insert(pack, entry);
+	return TRUE;
+}
+
+/**
+ * grits_pack_put:
+ * @pack:   the pack to write to
+ * @name:   the name of the file
+ * @data:   the contents of the file
+ * @length: the length of @data
+ * @etag:   the entity tag of the file, or NULL
+ * @mtime:  the modification time of the file
+ *
+ * Add a file to the pack, replacing any existing file with the same name.
+ *
+ * Returns: TRUE if the file was written
+ */
+gboolean grits_pack_put(GritsPack *pack, const gchar *name,
+		gconstpointer data, gsize length,
+		const gchar *etag, gint64 mtime)
+{
+	GritsPackEntry *entry = g_new0(GritsPackEntry, 1);
+	entry->key      = _grits_pack_key(name);
+	entry->name_len = strlen(name);
+	entry->length   = length;
+	entry->mtime    = mtime;
+	if (etag)
+		g_strlcpy(entry->etag, etag, sizeof(entry->etag));
+
+	/* Other processes may have appended to the data file, so the offset
+	 * is taken from the end of the file while the pack is locked */
+	g_mutex_lock(&pack->lock);
+	_grits_pack_lock(pack);
+	fseek(pack->data, 0, SEEK_END);
+	entry->offset = ftell(pack->data);
+	if (!fwrite(name, entry->name_len, 1, pack->data) ||
+	    (length && !fwrite(data, length, 1, pack->data)) ||
+	    fflush(pack->data)) {
+		g_warning("GritsPack: put - error writing %s", pack->data_path);
+		/* Don't reuse the partially written space */
+		fseek(pack->data, 0, SEEK_END);
+		pack->size = ftell(pack->data);
+		_grits_pack_unlock(pack);
+		g_mutex_unlock(&pack->lock);
+		g_free(entry);
+		return FALSE;
+	}
+	pack->size = entry->offset + entry->name_len + length;
+	gboolean ok = _grits_pack_add(pack, entry);
+	_grits_pack_unlock(pack);
+	g_mutex_unlock(&pack->lock);
+	return ok;
+}
+
+/**
+ * grits_pack_put_file:
+ * @pack: the pack to write to
+ * @name: the name of the file in the pack
+ * @path: the path to the file to add
+ * @etag: the entity tag of the file, or NULL
+ *
+ * Move a file from the disk into the pack. The file on disk is removed once
+ * it has been added.
+ *
+ * Returns: TRUE if the file is in the pack
+ */
+gboolean grits_pack_put_file(GritsPack *pack, const gchar *name,
+		const gchar *path, const gchar *etag)
+{
+	GStatBuf st;
+	GMappedFile *file;
+	if (g_stat(path, &st) || !(file = g_mapped_file_new(path, FALSE, NULL)))
+		return grits_pack_has(pack, name);
+	gboolean ok = grits_pack_put(pack, name,
+			g_mapped_file_get_contents(file),
+			g_mapped_file_get_length(file), etag, st.st_mtime);
+	g_mapped_file_unref(file);
+	if (ok)
+		g_remove(path);
+	return ok;
+}
+
+/**
+ * grits_pack_remove:
+ * @pack: the pack to remove the file from
+ * @name: the name of the file
+ *
+ * Remove a file from the pack.
+ */
+void grits_pack_remove(GritsPack *pack, const gchar *name)
+{
+	GritsPackEntry *entry = g_new0(GritsPackEntry, 1);
+	entry->key    = _grits_pack_key(name);
+	entry->offset = PACK_REMOVED;
+	g_mutex_lock(&pack->lock);
+	_grits_pack_lock(pack);
+	if (g_hash_table_lookup(pack->entries, &entry->key))
+		_grits_pack_add(pack, entry);
+	else
+		g_free(entry);
+	_grits_pack_unlock(pack);
+	g_mutex_unlock(&pack->lock);
+}
+
+/**
+ * grits_pack_compact:
+ * @pack: the pack to compact
+ *
+ * Rewrite the pack without the space used by replaced and removed files.
+ */
+void grits_pack_compact(GritsPack *pack)
+{
+	g_mutex_lock(&pack->lock);
+	_grits_pack_lock(pack);
+	_grits_pack_remap(pack);
+	_grits_pack_compact(pack);
+	_grits_pack_unlock(pack);
+	g_mutex_unlock(&pack->lock);
+}
+
+/**
+ * grits_pack_get_size:
+ * @pack: the pack to check
+ *
+ * Get the size of the data file, including space used by replaced and removed
+ * files.
+ *
+ * Returns: the size in bytes
+ */
+guint64 grits_pack_get_size(GritsPack *pack)
+{
+	g_mutex_lock(&pack->lock);
+	guint64 size = pack->size;
+	g_mutex_unlock(&pack->lock);
+	return size;
+}
+
+/**
+ * grits_pack_get_used:
+ * @pack: the pack to check
+ *
+ * Get the size of the files stored in the pack, not including space used by
+ * replaced and removed files.
+ *
+ * Returns: the size in bytes
+ */
+guint64 grits_pack_get_used(GritsPack *pack)
+{
+	g_mutex_lock(&pack->lock);
+	guint64 live = pack->live;
+	g_mutex_unlock(&pack->lock);
+	return live;
+}
+
+/* Sort entries from least to most recently used */
+static gint _grits_pack_cmp_access(gconstpointer _a, gconstpointer _b,
+		gpointer _pack)
+{
+	const GritsPackEntry *a = _a;
+	const GritsPackEntry *b = _b;
+	GritsPack *pack = _pack;
+	guint at = GPOINTER_TO_UINT(g_hash_table_lookup(pack->access, &a->key));
+	guint bt = GPOINTER_TO_UINT(g_hash_table_lookup(pack->access, &b->key));
+	if (at != bt)
+		return at < bt ? -1 : 1;
+	return a->mtime < b->mtime ? -1 :
+	       a->mtime > b->mtime ?  1 : 0;
+}
+
+/**
+ * grits_pack_evict:
+ * @pack:  the pack to remove files from
+ * @bytes: the number of bytes to free
+ *
+ * Remove the least recently used files from the pack until at least @bytes
+ * have been freed. Files which have not been read since the pack was opened
+ * are removed oldest first. The pack is only compacted once enough space has
+ * been freed, until then grits_pack_get_size() does not shrink.
+ *
+ * Returns: the number of files removed
+ */
+guint grits_pack_evict(GritsPack *pack, guint64 bytes)
+{
+	g_mutex_lock(&pack->lock);
+	_grits_pack_lock(pack);
+	GList *entries = g_hash_table_get_values(pack->entries);
+	entries = g_list_sort_with_data(entries, _grits_pack_cmp_access, pack);
+	guint64 freed = 0;
+	guint   count = 0;
+	for (GList *cur = entries; cur && freed < bytes; cur = cur->next) {
+		GritsPackEntry *entry   = cur->data;
+		GritsPackEntry *removed = g_new0(GritsPackEntry, 1);
+		removed->key    = entry->key;
+		removed->offset = PACK_REMOVED;
+		freed += entry->name_len + entry->length;
+		if (_grits_pack_add(pack, removed))
+			count++;
+	}
+	g_list_free(entries);
+	g_debug("GritsPack: evict - %s removed %u files", pack->dir, count);
+	if (count > 0 && pack->size - pack->live > PACK_WASTE) {
+		_grits_pack_remap(pack);
+		_grits_pack_compact(pack);
+	}
+	_grits_pack_unlock(pack);
+	g_mutex_unlock(&pack->lock);
+	return count;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRITS_PACK_H__
+#define __GRITS_PACK_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+/**
+ * GritsPackEntry:
+ * @key:      hash of the entry name
+ * @offset:   offset of the entry name in the data file, the data follows it
+ * @name_len: length of the entry name
+ * @length:   length of the data
+ * @mtime:    modification time of the data
+ * @etag:     entity tag of the data, or an empty string
+ *
+ * Index record for a single file stored in a #GritsPack. This is also the
+ * on disk format of the index.
+ */
+typedef struct _GritsPackEntry {
+	guint64 key;
+	guint64 offset;
+	guint32 name_len;
+	guint32 length;
+	gint64  mtime;
+	gchar   etag[64];
+} GritsPackEntry;
+
+typedef struct _GritsPack {
+	GMutex       lock;
+	gint         refs;
+	gchar       *dir;
+	gchar       *data_path;
+	gchar       *index_path;
+	FILE        *data;
+	FILE        *index;
+	GMappedFile *data_map;
+	GMappedFile *index_map;
+	GHashTable  *entries;
+	GHashTable  *access;
+	guint        clock;
+	GSList      *added;
+	guint64      size;
+	guint64      live;
+	guint64      index_len;
+} GritsPack;
+
+GritsPack *grits_pack_open(const gchar *dir);
+
+GritsPack *grits_pack_ref(GritsPack *pack);
+
+void grits_pack_close(GritsPack *pack);
+
+gboolean grits_pack_has(GritsPack *pack, const gchar *name);
+
+GBytes *grits_pack_get(GritsPack *pack, const gchar *name,
+		GritsPackEntry *entry);
+
+gboolean grits_pack_put(GritsPack *pack, const gchar *name,
+		gconstpointer data, gsize length,
+		const gchar *etag, gint64 mtime);
+
+gboolean grits_pack_put_file(GritsPack *pack, const gchar *name,
+		const gchar *path, const gchar *etag);
+
+void grits_pack_remove(GritsPack *pack, const gchar *name);
+
+void grits_pack_compact(GritsPack *pack);
+
+guint64 grits_pack_get_size(GritsPack *pack);
+
+guint64 grits_pack_get_used(GritsPack *pack);
+
+guint grits_pack_evict(GritsPack *pack, guint64 bytes);
+
+#endif
@@ -18,59 +18,91 @@
 
 #include <config.h>
 #include <stdio.h>
-#include <math.h>
 #include <glib.h>
 
 #include "grits-tms.h"
 
 static gchar *_make_uri(GritsTms *tms, GritsTile *tile)
 {
-	gint zoom = 0;
-	for (GritsTile *tmp = tile->parent; tmp; tmp = tmp->parent)
-		zoom++;
-	gint breath = pow(2,zoom);
-
-	gdouble lat_top = asinh(tan(deg2rad(tile->edge.n)));
-	gdouble lat_bot = asinh(tan(deg2rad(tile->edge.s)));
-
-	gdouble lat_mid = (lat_top + lat_bot)/2.0;
-	gdouble lon_mid = (tile->edge.e + tile->edge.w)/2.0;
-
-	gdouble lat_pos = 1.0 - (lat_mid + G_PI) / (2.0*G_PI);
-	gdouble lon_pos = (lon_mid + 180.0) / 360.0;
-
-	gint xtile = lon_pos * breath;
-	gint ytile = lat_pos * breath;
-
-	//g_message("tile=%f,%f,%f,%f t=%p p=%p",
-	//		tile->edge.n, tile->edge.s,
-	//		tile->edge.e, tile->edge.w, tile, tile->parent);
-	//g_message("top=%lf->%lf bot=%lf->%lf pos=%lf,%lf tile=%d,%d,%d",
-	//		tile->edge.n, lat_top,
-	//		tile->edge.s, lat_bot,
-	//		lat_pos, lon_pos,
-	//		zoom, xtile, ytile);
-
 	// http://tile.openstreetmap.org/<zoom>/<xtile>/<ytile>.png
-	return g_strdup_printf("%s/%d/%d/%d.%s",
-			tms->uri_prefix, zoom, xtile, ytile, tms->extension);
+	return g_strdup_printf("%s/%u/%u/%u.%s",
+			tms->uri_prefix, tile->level, tile->x, tile->y,
+			tms->extension);
+}
+
+/* Get file path, this also makes sure the tile level/x/y are set */
+static gchar *_make_local(GritsTms *tms, GritsTile *tile)
+{
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%s%s", tilep, tms->extension);
+	g_free(tilep);
+	return local;
 }
 
 gchar *grits_tms_fetch(GritsTms *tms, GritsTile *tile, GritsCacheType mode,
 		GritsChunkCallback callback, gpointer user_data)
 {
-	/* Get file path */
+	gchar *local = _make_local(tms, tile);
 	gchar *uri   = _make_uri(tms, tile);
-	gchar *tilep = grits_tile_get_path(tile);
-	gchar *local = g_strdup_printf("%s%s", tilep, tms->extension);
 	gchar *path  = grits_http_fetch(tms->http, uri, local,
 			mode, callback, user_data);
 	g_free(uri);
-	g_free(tilep);
 	g_free(local);
 	return path;
 }
 
+void grits_tms_fetch_async(GritsTms *tms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data,
+		GritsHttpDoneCallback done, gpointer done_data)
+{
+	gchar *local = _make_local(tms, tile);
+	gchar *uri   = _make_uri(tms, tile);
+	grits_http_fetch_async(tms->http, uri, local,
+			mode, callback, user_data, done, done_data);
+	g_free(uri);
+	g_free(local);
+}
+
+GBytes *grits_tms_fetch_bytes(GritsTms *tms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	gchar  *local = _make_local(tms, tile);
+	gchar  *uri   = _make_uri(tms, tile);
+	GBytes *bytes = grits_http_fetch_bytes(tms->http, uri, local,
+			mode, callback, user_data);
+	g_free(uri);
+	g_free(local);
+	return bytes;
+}
+
+GBytes *grits_tms_fetch_stream(GritsTms *tms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data,
+		GritsStreamCallback stream, gpointer stream_data, gboolean *streamed)
+{
+	gchar  *uri   = _make_uri(tms, tile);
+	gchar  *local = _make_local(tms, tile);
+	GBytes *bytes = grits_http_fetch_stream(tms->http, uri, local,
+			mode, callback, user_data, stream, stream_data, streamed);
+	g_free(uri);
+	g_free(local);
+	return bytes;
+}
+
+gboolean grits_tms_has(GritsTms *tms, GritsTile *tile)
+{
+	gchar   *local = _make_local(tms, tile);
+	gboolean has   = grits_http_has(tms->http, local);
+	g_free(local);
+	return has;
+}
+
+void grits_tms_discard(GritsTms *tms, GritsTile *tile)
+{
+	gchar *local = _make_local(tms, tile);
+	grits_http_discard(tms->http, local);
+	g_free(local);
+}
+
 GritsTms *grits_tms_new(const gchar *uri_prefix,
 		const gchar *prefix, const gchar *extension)
 {
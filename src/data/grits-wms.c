@@ -22,6 +22,10 @@
  * Provides an API for accessing image tiles form a Web Map Service (WMS)
  * server. #GritsWms integrates closely with #GritsTile. The remote server must
  * support the EPSG:4326 cartographic projection.
+ *
+ * To reduce the number of requests, a #GritsWms can fetch a block of
+ * neighboring tiles as a single larger image, called a metatile, which is
+ * split up into the individual tiles in the cache.
  */
 
 /*
@@ -71,7 +75,9 @@
 
 #include <config.h>
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
 #include <locale.h>
 
 #include "grits-wms.h"
@@ -88,7 +94,8 @@ static gchar *g_strdup_printf_safe(char *fmt, ...)
 	return str;
 }
 
-static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
+static gchar *_make_uri(GritsWms *wms, GritsBounds *edge,
+		const gchar *format, gint width, gint height)
 {
 	return g_strdup_printf_safe(
 		"%s?"
@@ -104,13 +111,182 @@ static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
 		"BBOX=%f,%f,%f,%f",
 		wms->uri_prefix,
 		wms->uri_layer,
-		wms->uri_format,
-		wms->width,
-		wms->height,
-		tile->edge.w,
-		tile->edge.s,
-		tile->edge.e,
-		tile->edge.n);
+		format,
+		width,
+		height,
+		edge->w,
+		edge->s,
+		edge->e,
+		edge->n);
+}
+
+static gchar *_make_local(GritsWms *wms, GritsTile *tile)
+{
+	gchar *tilep = grits_tile_get_path(tile);
+	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	g_free(tilep);
+	return local;
+}
+
+/* Split a PNG metatile and store each tile in the cache */
+static gboolean _store_image(GritsWms *wms, const gchar *path, gchar **locals)
+{
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+	if (!pixbuf)
+		return FALSE;
+	if (gdk_pixbuf_get_width(pixbuf)  != wms->width  * wms->meta ||
+	    gdk_pixbuf_get_height(pixbuf) != wms->height * wms->meta) {
+		g_warning("GritsWms: store_image - unexpected size %dx%d",
+				gdk_pixbuf_get_width(pixbuf),
+				gdk_pixbuf_get_height(pixbuf));
+		g_object_unref(pixbuf);
+		return FALSE;
+	}
+	gboolean ok = TRUE;
+	for (gint row = 0; row < wms->meta && ok; row++)
+	for (gint col = 0; col < wms->meta && ok; col++) {
+		const gchar *local = locals[row*wms->meta + col];
+		if (grits_http_has(wms->http, local))
+			continue;
+		GdkPixbuf *tile = gdk_pixbuf_new_subpixbuf(pixbuf,
+				col*wms->width, row*wms->height,
+				wms->width, wms->height);
+		gchar *data = NULL;
+		gsize  length;
+		ok = gdk_pixbuf_save_to_buffer(tile, &data, &length, "png", NULL,
+				"compression", "1", NULL) &&
+		     grits_http_store(wms->http, local, data, length);
+		if (data)
+			g_free(data);
+		g_object_unref(tile);
+	}
+	g_object_unref(pixbuf);
+	return ok;
+}
+
+/* Split a metatile of raw 16 bit samples and store each tile in the cache */
+static gboolean _store_raw(GritsWms *wms, const gchar *path, gchar **locals)
+{
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+	if (!file)
+		return FALSE;
+	const guchar *data   = (guchar*)g_mapped_file_get_contents(file);
+	gsize         row_sz = wms->width * sizeof(guint16);
+	gsize         stride = row_sz * wms->meta;
+	if (g_mapped_file_get_length(file) != stride * wms->height * wms->meta) {
+		g_warning("GritsWms: store_raw - unexpected size %ld",
+				(glong)g_mapped_file_get_length(file));
+		g_mapped_file_unref(file);
+		return FALSE;
+	}
+	gboolean ok   = TRUE;
+	guchar  *tile = g_malloc(row_sz * wms->height);
+	for (gint row = 0; row < wms->meta && ok; row++)
+	for (gint col = 0; col < wms->meta && ok; col++) {
+		const gchar *local = locals[row*wms->meta + col];
+		if (grits_http_has(wms->http, local))
+			continue;
+		for (gint y = 0; y < wms->height; y++)
+			memcpy(&tile[y*row_sz],
+			       &data[(row*wms->height + y)*stride + col*row_sz],
+			       row_sz);
+		ok = grits_http_store(wms->http, local, tile, row_sz * wms->height);
+	}
+	g_free(tile);
+	g_mapped_file_unref(file);
+	return ok;
+}
+
+/* Fill the cache with the block of tiles containing @tile using a single
+ * request. Nothing is done if the tile is already cached, if metatiles are
+ * disabled or failed before, or if the format can not be split without loss,
+ * in which case the tile is just fetched on its own afterwards */
+static void _fetch_meta(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	if (wms->meta <= 1 || mode != GRITS_ONCE)
+		return;
+	g_mutex_lock(&wms->lock);
+	gboolean failed = wms->meta_failed;
+	g_mutex_unlock(&wms->lock);
+	if (failed)
+		return;
+	gboolean raw = g_str_equal(wms->extension, "bil");
+	if (!raw && !g_str_equal(wms->extension, "png"))
+		return;
+
+	/* Find the tile covering the whole block */
+	gint depth = 0;
+	for (gint n = wms->meta; n > 1; n /= 2)
+		depth++;
+	gchar *tilep = grits_tile_get_path(tile);
+	GritsTile *block = tile;
+	for (gint i = 0; i < depth && block; i++)
+		block = block->parent;
+	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	if (!block || grits_http_has(wms->http, local)) {
+		g_free(local);
+		g_free(tilep);
+		return;
+	}
+	g_free(local);
+
+	/* Local names of the tiles in the block, row by row */
+	gsize  part   = strlen(grits_tile_path_table[0][0]);
+	gchar *blockp = g_strndup(tilep, block->level * part);
+	gchar **locals = g_new0(gchar*, wms->meta*wms->meta + 1);
+	for (gint row = 0; row < wms->meta; row++)
+	for (gint col = 0; col < wms->meta; col++) {
+		GString *name = g_string_new(blockp);
+		for (gint shift = depth-1; shift >= 0; shift--)
+			g_string_append(name, grits_tile_path_table
+					[(row >> shift) & 1]
+					[(col >> shift) & 1]);
+		g_string_append(name, wms->extension);
+		locals[row*wms->meta + col] = g_string_free(name, FALSE);
+	}
+
+	/* Download the metatile, requests for other tiles in the block
+	 * share the download and the first one to finish splits it up while
+	 * the others wait for it */
+	gchar *meta  = g_strdup_printf("%smeta%d.%s",
+			blockp, wms->meta, wms->extension);
+	gchar *uri   = _make_uri(wms, &block->edge, wms->uri_format,
+			wms->width * wms->meta, wms->height * wms->meta);
+	gchar *path  = grits_http_fetch(wms->http, uri, meta,
+			GRITS_ONCE, callback, user_data);
+	if (path) {
+		g_mutex_lock(&wms->lock);
+		while (g_hash_table_contains(wms->splitting, meta))
+			g_cond_wait(&wms->split_cond, &wms->lock);
+		gboolean split = g_file_test(path, G_FILE_TEST_EXISTS);
+		if (split)
+			g_hash_table_add(wms->splitting, meta);
+		g_mutex_unlock(&wms->lock);
+		if (split) {
+			gboolean ok = raw ? _store_raw(wms, path, locals)
+			                  : _store_image(wms, path, locals);
+			grits_http_discard(wms->http, meta);
+			g_mutex_lock(&wms->lock);
+			if (!ok) {
+				/* Don't retry metatiles for this layer, the
+				 * tiles are fetched one by one from now on */
+				g_warning("GritsWms: fetch_meta - "
+						"unable to split %s, disabling metatiles",
+						meta);
+				wms->meta_failed = TRUE;
+			}
+			g_hash_table_remove(wms->splitting, meta);
+			g_cond_broadcast(&wms->split_cond);
+			g_mutex_unlock(&wms->lock);
+		}
+	}
+	g_free(path);
+	g_free(uri);
+	g_free(meta);
+	g_strfreev(locals);
+	g_free(blockp);
+	g_free(tilep);
 }
 
 /**
@@ -128,17 +304,59 @@ static gchar *_make_uri(GritsWms *wms, GritsTile *tile)
 gchar *grits_wms_fetch(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
 		GritsChunkCallback callback, gpointer user_data)
 {
-	gchar *uri   = _make_uri(wms, tile);
-	gchar *tilep = grits_tile_get_path(tile);
-	gchar *local = g_strdup_printf("%s%s", tilep, wms->extension);
+	_fetch_meta(wms, tile, mode, callback, user_data);
+	gchar *uri   = _make_uri(wms, &tile->edge, wms->uri_format, wms->width, wms->height);
+	gchar *local = _make_local(wms, tile);
 	gchar *path  = grits_http_fetch(wms->http, uri, local,
 			mode, callback, user_data);
 	g_free(uri);
-	g_free(tilep);
 	g_free(local);
 	return path;
 }
 
+GBytes *grits_wms_fetch_bytes(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data)
+{
+	_fetch_meta(wms, tile, mode, callback, user_data);
+	gchar  *uri   = _make_uri(wms, &tile->edge, wms->uri_format, wms->width, wms->height);
+	gchar  *local = _make_local(wms, tile);
+	GBytes *bytes = grits_http_fetch_bytes(wms->http, uri, local,
+			mode, callback, user_data);
+	g_free(uri);
+	g_free(local);
+	return bytes;
+}
+
+GBytes *grits_wms_fetch_stream(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data,
+		GritsStreamCallback stream, gpointer stream_data, gboolean *streamed)
+{
+	_fetch_meta(wms, tile, mode, callback, user_data);
+	gchar  *uri   = _make_uri(wms, &tile->edge, wms->uri_format, wms->width, wms->height);
+	gchar  *local = _make_local(wms, tile);
+	GBytes *bytes = grits_http_fetch_stream(wms->http, uri, local,
+			mode, callback, user_data, stream, stream_data, streamed);
+	g_free(uri);
+	g_free(local);
+	return bytes;
+}
+
+gboolean grits_wms_store(GritsWms *wms, GritsTile *tile,
+		gconstpointer data, gsize length)
+{
+	gchar   *local = _make_local(wms, tile);
+	gboolean ok    = grits_http_store(wms->http, local, data, length);
+	g_free(local);
+	return ok;
+}
+
+void grits_wms_discard(GritsWms *wms, GritsTile *tile)
+{
+	gchar *local = _make_local(wms, tile);
+	grits_http_discard(wms->http, local);
+	g_free(local);
+}
+
 /**
  * grits_wms_new:
  * @uri_prefix: the base URL for the WMS server
@@ -169,9 +387,40 @@ GritsWms *grits_wms_new(
 	wms->extension  = g_strdup(extension);
 	wms->width      = width;
 	wms->height     = height;
+	wms->meta       = 1;
+	wms->splitting  = g_hash_table_new(g_str_hash, g_str_equal);
+	g_mutex_init(&wms->lock);
+	g_cond_init(&wms->split_cond);
 	return wms;
 }
 
+/**
+ * grits_wms_set_metatile:
+ * @wms:  the #GritsWms to configure
+ * @size: number of tiles across each metatile, 1 to disable metatiles
+ *
+ * Fetch tiles in blocks of @size by @size neighboring tiles. Each block is
+ * requested as a single image and split up into the individual tiles, which
+ * is much faster for most servers than requesting each tile separately.
+ *
+ * The tiles in a block share the same ancestor tile, so @size is rounded down
+ * to a power of two. Metatiles are only used with %GRITS_ONCE, and only for
+ * formats that can be split without loss, PNG and 16 bit BIL images. Other
+ * layers, such as JPEG, keep fetching each tile on its own. If a metatile can
+ * not be split, metatiles are disabled for the layer until the next call to
+ * this function.
+ */
+void grits_wms_set_metatile(GritsWms *wms, gint size)
+{
+	gint meta = 1;
+	while (meta*2 <= size)
+		meta *= 2;
+	g_mutex_lock(&wms->lock);
+	wms->meta        = meta;
+	wms->meta_failed = FALSE;
+	g_mutex_unlock(&wms->lock);
+}
+
 /**
  * grits_wms_free:
  * @wms: the #GritsWms to free
@@ -186,5 +435,8 @@ void grits_wms_free(GritsWms *wms)
 	g_free(wms->uri_layer);
 	g_free(wms->uri_format);
 	g_free(wms->extension);
+	g_hash_table_destroy(wms->splitting);
+	g_mutex_clear(&wms->lock);
+	g_cond_clear(&wms->split_cond);
 	g_free(wms);
 }
@@ -31,6 +31,11 @@ typedef struct _GritsWms {
 	gchar *extension;
 	gint   width;
 	gint   height;
+	gint   meta;
+	gboolean meta_failed;
+	GHashTable *splitting;
+	GMutex lock;
+	GCond  split_cond;
 } GritsWms;
 
 GritsWms *grits_wms_new(
@@ -38,9 +43,23 @@ GritsWms *grits_wms_new(
 	const gchar *uri_format, const gchar *prefix,
 	const gchar *extension, gint width, gint height);
 
+void grits_wms_set_metatile(GritsWms *wms, gint size);
+
 gchar *grits_wms_fetch(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
 		GritsChunkCallback callback, gpointer user_data);
 
+GBytes *grits_wms_fetch_bytes(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data);
+
+GBytes *grits_wms_fetch_stream(GritsWms *wms, GritsTile *tile, GritsCacheType mode,
+		GritsChunkCallback callback, gpointer user_data,
+		GritsStreamCallback stream, gpointer stream_data, gboolean *streamed);
+
+gboolean grits_wms_store(GritsWms *wms, GritsTile *tile,
+		gconstpointer data, gsize length);
+
+void grits_wms_discard(GritsWms *wms, GritsTile *tile);
+
 void grits_wms_free(GritsWms *wms);
 
 #endif
@@ -43,6 +43,9 @@
 
 #define OVERLAY_SLICE 0.01
 
+/* Number of frames for new terrain to move into place */
+#define MORPH_FRAMES  8
+
 /* Tessellation, "finding intersecting triangles" */
 /* http://research.microsoft.com/pubs/70307/tr-2006-81.pdf */
 /* http://www.opengl.org/wiki/Alpha_Blending */
@@ -59,6 +62,26 @@ struct RenderLevel {
 /***********
  * Helpers *
  ***********/
+static gboolean _range_func(gdouble n, gdouble s, gdouble e, gdouble w,
+		gdouble *min, gdouble *max, gpointer _opengl)
+{
+	GritsBounds bounds = {n, s, e, w};
+	return grits_viewer_get_elevation_range(_opengl, &bounds, min, max);
+}
+
+static void _get_perspective(GritsOpenGL *opengl, double elev,
+		double *width, double *height, double *ang, double *near, double *far)
+{
+	GtkAllocation alloc;
+	gtk_widget_get_allocation(GTK_WIDGET(opengl), &alloc);
+	double atmos  = 10000;
+	*width  = alloc.width;
+	*height = alloc.height;
+	*ang    = atan((*height/2)/FOV_DIST)*2;
+	*near   = MAX(elev*0.75 - atmos, 50);  // View 100km of atmosphere
+	*far    = elev + EARTH_R*1.25 + atmos; // a bit past the cenrt of the earth
+}
+
 static void _set_projection(GritsOpenGL *opengl)
 {
 	double lat, lon, elev, rx, ry, rz;
@@ -69,14 +92,8 @@ static void _set_projection(GritsOpenGL *opengl)
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
 
-	GtkAllocation alloc;
-	gtk_widget_get_allocation(GTK_WIDGET(opengl), &alloc);
-	double width  = alloc.width;
-	double height = alloc.height;
-	double ang    = atan((height/2)/FOV_DIST)*2;
-	double atmos  = 10000;
-	double near   = MAX(elev*0.75 - atmos, 50);  // View 100km of atmosphere
-	double far    = elev + EARTH_R*1.25 + atmos; // a bit past the cenrt of the earth
+	double width, height, ang, near, far;
+	_get_perspective(opengl, elev, &width, &height, &ang, &near, &far);
 
 	glViewport(0, 0, width, height);
 	gluPerspective(rad2deg(ang), width/height, near, far);
@@ -388,6 +405,8 @@ static gboolean on_expose(GritsOpenGL *opengl, gpointer data, gpointer _)
 	g_mutex_lock(&opengl->sphere_lock);
 	roam_sphere_update_errors(opengl->sphere);
 	roam_sphere_split_merge(opengl->sphere);
+	if (roam_sphere_update_morph(opengl->sphere, 1.0/MORPH_FRAMES))
+		grits_viewer_queue_draw(GRITS_VIEWER(opengl));
 	g_mutex_unlock(&opengl->sphere_lock);
 #endif
 
@@ -561,20 +580,32 @@ static void grits_opengl_unproject(GritsViewer *_opengl,
 		gdouble *lat, gdouble *lon, gdouble *elev)
 {
 	GritsOpenGL *opengl = GRITS_OPENGL(_opengl);
-	if (!opengl->sphere->view)
+	RoamView    *view   = opengl->sphere->view;
+	if (!view)
 		return;
 	gdouble x, y, z;
 	if (pz < 0) {
-		gfloat tmp = 0;
-		glReadPixels(px, py, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &tmp);
-		pz = tmp;
+		/* Cast a ray through the terrain instead of reading back the depth
+		 * buffer, which has to wait for the GPU to finish drawing */
+		gdouble near[3], far[3], dist;
+		gluUnProject(px, py, 0, view->model, view->proj, view->view,
+				&near[0], &near[1], &near[2]);
+		gluUnProject(px, py, 1, view->model, view->proj, view->view,
+				&far[0], &far[1], &far[2]);
+		gdouble dir[3] = {far[0]-near[0], far[1]-near[1], far[2]-near[2]};
+		g_mutex_lock(&opengl->sphere_lock);
+		gboolean hit = roam_sphere_intersect(opengl->sphere, near, dir, &dist);
+		g_mutex_unlock(&opengl->sphere_lock);
+		if (!hit)
+			dist = 1;
+		x = near[0] + dir[0]*dist;
+		y = near[1] + dir[1]*dist;
+		z = near[2] + dir[2]*dist;
+	} else {
+		pz = (pz-OVERLAY_SLICE) * (1.0/(1-OVERLAY_SLICE));
+		gluUnProject(px, py, pz, view->model, view->proj, view->view,
+				&x, &y, &z);
 	}
-	pz = (pz-OVERLAY_SLICE) * (1.0/(1-OVERLAY_SLICE));
-	gluUnProject(px, py, pz,
-		opengl->sphere->view->model,
-		opengl->sphere->view->proj,
-		opengl->sphere->view->view,
-		&x, &y, &z);
 	xyz2lle(x, y, z, lat, lon, elev);
 	//g_message("GritsOpenGL: unproject - "
 	//		"%4.0lf,%4.0lf,(%5.3lf) -> "
@@ -583,31 +614,230 @@ static void grits_opengl_unproject(GritsViewer *_opengl,
 	//	px, py, pz, x, y, z, *lat, *lon, *elev);
 }
 
+/* Multiply a by a rotation of ang degrees around one of the axes */
+static void _rotate(double a[4][4], double ang, int axis)
+{
+	double c = cos(deg2rad(ang));
+	double s = sin(deg2rad(ang));
+	int i = (axis+1)%3, j = (axis+2)%3;
+	for (int row = 0; row < 4; row++) {
+		double ai = a[row][i], aj = a[row][j];
+		a[row][i] = ai*c + aj*s;
+		a[row][j] = aj*c - ai*s;
+	}
+}
+
+static gboolean grits_opengl_get_frustum(GritsViewer *_opengl,
+		gdouble lat, gdouble lon, gdouble elev,
+		GritsFrustum *frustum)
+{
+	GritsOpenGL *opengl = GRITS_OPENGL(_opengl);
+	double rx, ry, rz;
+	grits_viewer_get_rotation(_opengl, &rx, &ry, &rz);
+
+	double width, height, ang, near, far;
+	_get_perspective(opengl, elev, &width, &height, &ang, &near, &far);
+	if (width <= 1 || height <= 1)
+		return FALSE;
+
+	/* Same as gluPerspective in _set_projection */
+	double f = 1/tan(ang/2);
+	double m[4][4] = {
+		{f*height/width, 0, 0,                         0                        },
+		{0,              f, 0,                         0                        },
+		{0,              0, (far+near)/(near-far),     (2*far*near)/(near-far)  },
+		{0,              0, -1,                        0                        },
+	};
+
+	/* Same as the camera transforms in _set_projection */
+	_rotate(m, rx, 0);
+	_rotate(m, rz, 2);
+	for (int row = 0; row < 4; row++)
+		m[row][3] -= m[row][2] * elev2rad(elev);
+	_rotate(m, lat, 0);
+	_rotate(m, -lon, 1);
+
+	/* Extract clipping planes from the combined matrix */
+	for (int i = 0; i < 6; i++) {
+		double  sign  = i%2 ? -1 : 1;
+		double *plane = frustum->planes[i];
+		for (int col = 0; col < 4; col++)
+			plane[col] = m[3][col] + sign*m[i/2][col];
+		double len = sqrt(plane[0]*plane[0] +
+		                  plane[1]*plane[1] +
+		                  plane[2]*plane[2]);
+		for (int col = 0; col < 4; col++)
+			plane[col] /= len;
+	}
+	return TRUE;
+}
+
+/* New position of a point, calculated without the sphere lock. Points
+ * outside the bounds keep their position and height function */
+struct _Height {
+	gdouble lat, lon;
+	gdouble x, y, z;
+	gboolean       update;
+	RoamHeightFunc height_func;
+	gpointer       height_data;
+};
+
+/* New error of a triangle, calculated without the sphere lock */
+struct _Deviation {
+	RoamPoint *l, *m, *r, *split;
+	gdouble n, s, e, w;
+	gdouble deviation, bound;
+};
+
+static gboolean _in_bounds(GritsBounds *bounds, RoamPoint *point)
+{
+	return bounds->n >= point->lat && point->lat >= bounds->s &&
+	       bounds->e >= point->lon && point->lon >= bounds->w;
+}
+
+/* Check that a point is still where its new position was calculated from */
+static gboolean _at_height(RoamPoint *point, struct _Height *height)
+{
+	return height && height->lat == point->lat && height->lon == point->lon &&
+	       height->x == point->to[0] && height->y == point->to[1] &&
+	       height->z == point->to[2] &&
+	       height->height_func == point->height_func &&
+	       height->height_data == point->height_data;
+}
+
+/* The heights are calculated in three steps so that drawing is not held up
+ * while a new elevation tile is applied:
+ *   1. Find the points and triangles within the bounds, with the sphere lock
+ *      held
+ *   2. Calculate the new heights, and the errors of the triangles from them,
+ *      without the lock
+ *   3. Copy the heights and errors to the mesh and update the normals, with
+ *      the lock held. The mesh may have changed during step 2, so the points
+ *      and triangles are found again and any new ones are calculated in place.
+ */
 static void grits_opengl_set_height_func(GritsViewer *_opengl, GritsBounds *bounds,
 		RoamHeightFunc height_func, gpointer user_data, gboolean update)
 {
 	GritsOpenGL *opengl = GRITS_OPENGL(_opengl);
-	/* TODO: get points? */
+	RoamSphere  *sphere = opengl->sphere;
+	GHashTable  *heights = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	GHashTable  *deviations = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+
+	/* Find points and triangles */
+	g_mutex_lock(&opengl->sphere_lock);
+	GList *triangles = roam_sphere_get_intersect(sphere, TRUE,
+			bounds->n, bounds->s, bounds->e, bounds->w);
+	for (GList *cur = triangles; cur; cur = cur->next) {
+		RoamTriangle *tri = cur->data;
+		RoamPoint *points[] = {tri->p.l, tri->p.m, tri->p.r, tri->split};
+		for (int i = 0; i < G_N_ELEMENTS(points); i++) {
+			if (g_hash_table_contains(heights, points[i]))
+				continue;
+			struct _Height *height = g_new0(struct _Height, 1);
+			height->lat    = points[i]->lat;
+			height->lon    = points[i]->lon;
+			height->update = _in_bounds(bounds, points[i]);
+			if (height->update) {
+				height->height_func = height_func;
+				height->height_data = user_data;
+			} else {
+				height->x = points[i]->to[0];
+				height->y = points[i]->to[1];
+				height->z = points[i]->to[2];
+				height->height_func = points[i]->height_func;
+				height->height_data = points[i]->height_data;
+			}
+			g_hash_table_insert(heights, points[i], height);
+		}
+		struct _Deviation *dev = g_new0(struct _Deviation, 1);
+		dev->l     = tri->p.l;
+		dev->m     = tri->p.m;
+		dev->r     = tri->p.r;
+		dev->split = tri->split;
+		dev->n     = tri->edge.n;
+		dev->s     = tri->edge.s;
+		dev->e     = tri->edge.e;
+		dev->w     = tri->edge.w;
+		g_hash_table_insert(deviations, tri, dev);
+	}
+	g_list_free(triangles);
+	g_mutex_unlock(&opengl->sphere_lock);
+
+	/* Calculate heights */
+	GHashTableIter iter;
+	struct _Height *height;
+	g_hash_table_iter_init(&iter, heights);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&height))
+		if (height->update)
+			lle2xyz(height->lat, height->lon,
+				height_func(height->lat, height->lon, user_data),
+				&height->x, &height->y, &height->z);
+
+	/* Calculate errors */
+	struct _Deviation *dev;
+	g_hash_table_iter_init(&iter, deviations);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&dev)) {
+		struct _Height *l     = g_hash_table_lookup(heights, dev->l);
+		struct _Height *m     = g_hash_table_lookup(heights, dev->m);
+		struct _Height *r     = g_hash_table_lookup(heights, dev->r);
+		struct _Height *split = g_hash_table_lookup(heights, dev->split);
+		roam_triangle_calc_deviation(&l->x, &m->x, &r->x, &split->x,
+				split->height_func, split->height_data,
+				dev->n, dev->s, dev->e, dev->w,
+				sphere, &dev->deviation, &dev->bound);
+	}
+
+	/* Apply heights */
 	g_mutex_lock(&opengl->sphere_lock);
-	GList *triangles = roam_sphere_get_intersect(opengl->sphere, TRUE,
+	triangles = roam_sphere_get_intersect(sphere, TRUE,
 			bounds->n, bounds->s, bounds->e, bounds->w);
 	for (GList *cur = triangles; cur; cur = cur->next) {
 		RoamTriangle *tri = cur->data;
 		RoamPoint *points[] = {tri->p.l, tri->p.m, tri->p.r, tri->split};
 		for (int i = 0; i < G_N_ELEMENTS(points); i++) {
-			if (bounds->n >= points[i]->lat && points[i]->lat >= bounds->s &&
-			    bounds->e >= points[i]->lon && points[i]->lon >= bounds->w) {
-				points[i]->height_func = height_func;
-				points[i]->height_data = user_data;
+			if (!_in_bounds(bounds, points[i]))
+				continue;
+			points[i]->height_func = height_func;
+			points[i]->height_data = user_data;
+			height = g_hash_table_lookup(heights, points[i]);
+			if (height && height->lat == points[i]->lat &&
+			              height->lon == points[i]->lon) {
+				roam_sphere_move_point(sphere, points[i],
+						height->x, height->y, height->z);
+			} else {
 				roam_point_update_height(points[i]);
 			}
 		}
 	}
+
+	/* Apply errors, triangles added to the mesh since they were found, or
+	 * whose points did not end up where they were expected, are updated
+	 * in place */
+	for (GList *cur = triangles; cur; cur = cur->next) {
+		RoamTriangle *tri = cur->data;
+		roam_triangle_update_normal(tri);
+		dev = g_hash_table_lookup(deviations, tri);
+		if (dev && dev->l == tri->p.l && dev->m == tri->p.m &&
+		           dev->r == tri->p.r && dev->split == tri->split &&
+		    _at_height(tri->p.l,  g_hash_table_lookup(heights, tri->p.l)) &&
+		    _at_height(tri->p.m,  g_hash_table_lookup(heights, tri->p.m)) &&
+		    _at_height(tri->p.r,  g_hash_table_lookup(heights, tri->p.r)) &&
+		    _at_height(tri->split, g_hash_table_lookup(heights, tri->split))) {
+			tri->deviation = dev->deviation;
+			tri->bound     = dev->bound;
+		} else {
+			roam_triangle_update_deviation(tri, sphere);
+		}
+	}
 	g_list_free(triangles);
 	g_mutex_unlock(&opengl->sphere_lock);
+
+	g_hash_table_destroy(deviations);
+	g_hash_table_destroy(heights);
 }
 
-static void _grits_opengl_clear_height_func_rec(RoamTriangle *root)
+static void _grits_opengl_clear_height_func_rec(RoamTriangle *root,
+		RoamSphere *sphere)
 {
 	if (!root)
 		return;
@@ -617,15 +847,17 @@ static void _grits_opengl_clear_height_func_rec(RoamTriangle *root)
 		points[i]->height_data = NULL;
 		roam_point_update_height(points[i]);
 	}
-	_grits_opengl_clear_height_func_rec(root->kids[0]);
-	_grits_opengl_clear_height_func_rec(root->kids[1]);
+	roam_triangle_update_deviation(root, sphere);
+	_grits_opengl_clear_height_func_rec(root->kids[0], sphere);
+	_grits_opengl_clear_height_func_rec(root->kids[1], sphere);
 }
 
 static void grits_opengl_clear_height_func(GritsViewer *_opengl)
 {
 	GritsOpenGL *opengl = GRITS_OPENGL(_opengl);
 	for (int i = 0; i < G_N_ELEMENTS(opengl->sphere->roots); i++)
-		_grits_opengl_clear_height_func_rec(opengl->sphere->roots[i]);
+		_grits_opengl_clear_height_func_rec(opengl->sphere->roots[i],
+				opengl->sphere);
 }
 
 static gint _objects_find(gconstpointer a, gconstpointer b)
@@ -709,6 +941,8 @@ static void grits_opengl_init(GritsOpenGL *opengl)
 	g_debug("GritsOpenGL: init");
 	opengl->objects = g_queue_new();
 	opengl->sphere  = roam_sphere_new(opengl);
+	opengl->sphere->range_func = _range_func;
+	opengl->sphere->range_data = opengl;
 	g_mutex_init(&opengl->objects_lock);
 	g_mutex_init(&opengl->sphere_lock);
 	gtk_gl_enable(GTK_WIDGET(opengl));
@@ -750,6 +984,7 @@ static void grits_opengl_class_init(GritsOpenGLClass *klass)
 	viewer_class->center_position   = grits_opengl_center_position;
 	viewer_class->project           = grits_opengl_project;
 	viewer_class->unproject         = grits_opengl_unproject;
+	viewer_class->get_frustum       = grits_opengl_get_frustum;
 	viewer_class->clear_height_func = grits_opengl_clear_height_func;
 	viewer_class->set_height_func   = grits_opengl_set_height_func;
 	viewer_class->add               = grits_opengl_add;
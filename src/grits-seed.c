@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * grits-seed downloads the tiles for an area into the cache ahead of time so
+ * that they can be viewed offline. For example, to fetch satellite images of
+ * Colorado down to level 8:
+ *
+ *   grits-seed --bounds 41,37,-102,-109 --levels 0-8 sat
+ *
+ * Tiles which are already cached are skipped and partial downloads are
+ * resumed, so an interrupted run can simply be started again.
+ *
+ * grits-seed can run while the viewer is open, even with --pack. The pack is
+ * locked while tiles are written to it, and the viewer picks up the new tiles
+ * the next time it looks for them. Locking is not supported on Windows, so
+ * there the viewer should be closed while seeding into the pack.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include "grits.h"
+
+/* Layers which can be fetched, keep in sync with the plugins */
+struct _Layer {
+	const gchar *name;
+	const gchar *uri_prefix;
+	const gchar *uri_layer;  /* NULL for TMS layers */
+	const gchar *uri_format;
+	const gchar *prefix;
+	const gchar *extension;
+	gint         width;
+	gint         height;
+	gint         metatile;
+	GritsProj    proj;
+	gdouble      n, s, e, w;
+};
+
+static const struct _Layer layers[] = {
+	{"sat",  "http://www.nasa.network.com/wms", "bmng200406", "image/jpeg",
+		"bmng/", "jpg", 1024, 512, 1,
+		GRITS_PROJ_LATLON, NORTH, SOUTH, EAST, WEST},
+	{"elev", "http://www.nasa.network.com/elev", "mergedSrtm", "application/bil",
+		"srtm/", "bil", 1024, 512, 2,
+		GRITS_PROJ_LATLON, NORTH, SOUTH, EAST, WEST},
+	{"map",  "http://tile.openstreetmap.org", NULL, NULL,
+		"osmtile/", "png", 256, 256, 1,
+		GRITS_PROJ_MERCATOR, 85.0511, -85.0511, EAST, WEST},
+};
+
+struct _Seed {
+	GritsWms *wms;
+	GritsTms *tms;
+	GMutex    lock;
+	gint      total;
+	gint      done;
+	gint      failed;
+};
+
+/* Options */
+static gchar   *opt_bounds    = NULL;
+static gchar   *opt_levels    = NULL;
+static gint     opt_jobs      = 8;
+static gint     opt_bandwidth = 0;
+static gboolean opt_pack      = FALSE;
+static gboolean opt_list      = FALSE;
+
+static GOptionEntry entries[] = {
+	{"bounds",    'b', 0, G_OPTION_ARG_STRING, &opt_bounds,
+		"Area to fetch, defaults to the whole layer",  "N,S,E,W"},
+	{"levels",    'l', 0, G_OPTION_ARG_STRING, &opt_levels,
+		"Range of tile levels to fetch",               "MIN-MAX"},
+	{"jobs",      'j', 0, G_OPTION_ARG_INT,    &opt_jobs,
+		"Number of tiles to fetch at once",            "N"},
+	{"bandwidth", 'r', 0, G_OPTION_ARG_INT,    &opt_bandwidth,
+		"Limit the download rate",                     "KB/s"},
+	{"pack",      'p', 0, G_OPTION_ARG_NONE,   &opt_pack,
+		"Store tiles in the pack cache",               NULL},
+	{"list",      0,   0, G_OPTION_ARG_NONE,   &opt_list,
+		"List the available layers",                   NULL},
+	{NULL}
+};
+
+static void _add_tile(GritsTile *tile, gpointer _tiles)
+{
+	g_ptr_array_add(_tiles, tile);
+}
+
+/* Fetch a single tile, called from the thread pool */
+static void _seed_tile(gpointer _tile, gpointer _seed)
+{
+	GritsTile    *tile = _tile;
+	struct _Seed *seed = _seed;
+
+	GBytes *bytes = seed->wms ?
+		grits_wms_fetch_bytes(seed->wms, tile, GRITS_ONCE, NULL, NULL) :
+		grits_tms_fetch_bytes(seed->tms, tile, GRITS_ONCE, NULL, NULL);
+
+	g_mutex_lock(&seed->lock);
+	seed->done++;
+	if (!bytes)
+		seed->failed++;
+	g_print("\r%d/%d tiles, %d failed", seed->done, seed->total, seed->failed);
+	fflush(stdout);
+	g_mutex_unlock(&seed->lock);
+
+	if (bytes)
+		g_bytes_unref(bytes);
+}
+
+int main(int argc, char **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new(
+			"LAYER - fetch tiles for offline use");
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_set_description(context,
+			"Tiles are stored in the same cache used by the viewer. Tiles\n"
+			"stored with --pack are only used if the viewer has the\n"
+			"grits/pack_cache option set. The viewer can be running\n"
+			"while tiles are seeded.\n");
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (opt_list) {
+		for (int i = 0; i < G_N_ELEMENTS(layers); i++)
+			g_print("%-5s %s\n", layers[i].name, layers[i].uri_prefix);
+		return 0;
+	}
+
+	/* Parse arguments */
+	const struct _Layer *layer = NULL;
+	for (int i = 0; argc == 2 && i < G_N_ELEMENTS(layers); i++)
+		if (g_str_equal(argv[1], layers[i].name))
+			layer = &layers[i];
+	if (!layer) {
+		g_printerr("A layer is required, see --list\n");
+		return 1;
+	}
+
+	GritsBounds area;
+	grits_bounds_set_bounds(&area, layer->n, layer->s, layer->e, layer->w);
+	if (opt_bounds && sscanf(opt_bounds, "%lf,%lf,%lf,%lf",
+				&area.n, &area.s, &area.e, &area.w) != 4) {
+		g_printerr("Invalid bounds: %s\n", opt_bounds);
+		return 1;
+	}
+
+	guint min_level = 0, max_level = 0;
+	gint  nlevels   = opt_levels ?
+		sscanf(opt_levels, "%u-%u", &min_level, &max_level) : 0;
+	if (nlevels == 1)
+		max_level = min_level;
+	if (nlevels < 1 || min_level > max_level) {
+		g_printerr("A range of levels is required, for example: --levels 0-8\n");
+		return 1;
+	}
+
+	/* Setup downloads */
+	opt_jobs = MAX(opt_jobs, 1);
+	grits_http_set_connections(opt_jobs, opt_jobs);
+	grits_http_set_bandwidth((gint64)1024 * opt_bandwidth);
+	grits_http_set_pack_cache(opt_pack);
+
+	struct _Seed seed = {};
+	g_mutex_init(&seed.lock);
+	if (layer->uri_layer) {
+		seed.wms = grits_wms_new(layer->uri_prefix, layer->uri_layer,
+				layer->uri_format, layer->prefix, layer->extension,
+				layer->width, layer->height);
+		grits_wms_set_metatile(seed.wms, layer->metatile);
+		grits_http_set_priority(seed.wms->http, GRITS_PRIORITY_LOW);
+	} else {
+		seed.tms = grits_tms_new(layer->uri_prefix,
+				layer->prefix, layer->extension);
+		grits_http_set_priority(seed.tms->http, GRITS_PRIORITY_LOW);
+	}
+
+	/* Find tiles */
+	GritsTile *root = grits_tile_new(NULL,
+			layer->n, layer->s, layer->e, layer->w);
+	root->proj = layer->proj;
+	GPtrArray *tiles = g_ptr_array_new();
+	seed.total = grits_tile_enumerate(root, &area, min_level, max_level,
+			_add_tile, tiles);
+	g_print("Fetching %d tiles from %s\n", seed.total, layer->uri_prefix);
+
+	/* Fetch tiles */
+	GThreadPool *pool = g_thread_pool_new(_seed_tile, &seed,
+			opt_jobs, FALSE, NULL);
+	for (int i = 0; i < tiles->len; i++)
+		g_thread_pool_push(pool, g_ptr_array_index(tiles, i), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	GritsCacheStats stats;
+	grits_cache_get_stats(layer->prefix, &stats);
+	g_print("\nDownloaded %.1f MB, %ld tiles were already cached\n",
+			stats.downloaded / 1024.0 / 1024.0, (glong)stats.hits);
+
+	/* Cleanup */
+	gint failed = seed.failed;
+	g_ptr_array_free(tiles, TRUE);
+	grits_tile_free(root, NULL, NULL);
+	if (seed.wms)
+		grits_wms_free(seed.wms);
+	if (seed.tms)
+		grits_tms_free(seed.tms);
+	g_mutex_clear(&seed.lock);
+	g_free(opt_bounds);
+	g_free(opt_levels);
+
+	return failed ? 2 : 0;
+}
@@ -171,6 +171,15 @@ struct _GritsBounds {
 void grits_bounds_set_bounds(GritsBounds *bounds,
 		gdouble n, gdouble s, gdouble e, gdouble w);
 
+/* GritsFrustum */
+typedef struct _GritsFrustum GritsFrustum;
+struct _GritsFrustum {
+	/* Left, right, bottom, top, near, far planes in world
+	 * coordinates as a*x + b*y + c*z + d >= 0 for points
+	 * inside the view, with (a,b,c) normalized. */
+	gdouble planes[6][4];
+};
+
 
 /********
  * Misc *
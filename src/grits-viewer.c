@@ -27,6 +27,7 @@
 
 #include <config.h>
 #include <math.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
 
@@ -34,6 +35,9 @@
 #include "grits-viewer.h"
 
 #include "grits-util.h"
+#include "data/grits-cache.h"
+#include "data/grits-http.h"
+#include "data/grits-loader.h"
 
 
 /* Constants */
@@ -47,6 +51,9 @@ enum {
 };
 static guint signals[NUM_SIGNALS];
 
+/* Camera motion older than this is not used for prediction (seconds) */
+#define MOTION_TIMEOUT 0.5
+
 
 /***********
  * Helpers *
@@ -71,6 +78,38 @@ static void _grits_viewer_fix_rotation(GritsViewer *viewer)
 	while (viewer->rotation[2] >  180) viewer->rotation[2] -= 360;
 }
 
+static void _grits_viewer_update_motion(GritsViewer *viewer)
+{
+	gint64   now  = g_get_monotonic_time();
+	gdouble  dt   = (gdouble)(now - viewer->motion_time) / G_USEC_PER_SEC;
+	gdouble *last = viewer->motion_location;
+	gdouble *cur  = viewer->location;
+
+	if (viewer->motion_time && dt > 0 && dt < MOTION_TIMEOUT &&
+	    last[2] > 0 && cur[2] > 0) {
+		/* Panning is linear in degrees, zooming is exponential */
+		gdouble dlon = cur[1] - last[1];
+		if (dlon >  180) dlon -= 360;
+		if (dlon < -180) dlon += 360;
+		gdouble rate[3] = {
+			(cur[0] - last[0]) / dt,
+			dlon / dt,
+			log(cur[2] / last[2]) / dt,
+		};
+		/* Smooth out jittery input events */
+		for (int i = 0; i < 3; i++)
+			viewer->motion_velocity[i] =
+				(viewer->motion_velocity[i] + rate[i]) / 2;
+	} else {
+		for (int i = 0; i < 3; i++)
+			viewer->motion_velocity[i] = 0;
+	}
+
+	for (int i = 0; i < 3; i++)
+		last[i] = cur[i];
+	viewer->motion_time = now;
+}
+
 static gboolean _grits_viewer_queue_draw_cb(gpointer _viewer)
 {
 	GritsViewer *viewer = _viewer;
@@ -84,6 +123,7 @@ static gboolean _grits_viewer_queue_draw_cb(gpointer _viewer)
 /* Signal helpers */
 static void _grits_viewer_emit_location_changed(GritsViewer *viewer)
 {
+	_grits_viewer_update_motion(viewer);
 	g_signal_emit(viewer, signals[SIG_LOCATION_CHANGED], 0,
 			viewer->location[0],
 			viewer->location[1],
@@ -217,6 +257,19 @@ void grits_viewer_setup(GritsViewer *viewer, GritsPlugins *plugins, GritsPrefs *
 	viewer->plugins = plugins;
 	viewer->prefs   = prefs;
 	viewer->offline = grits_prefs_get_boolean(prefs, "grits/offline", NULL);
+	grits_loader_set_threads(grits_loader_get_default(),
+		grits_prefs_get_integer(prefs, "grits/io_threads_min", NULL),
+		grits_prefs_get_integer(prefs, "grits/io_threads_max", NULL),
+		grits_prefs_get_integer(prefs, "grits/decode_threads", NULL));
+	grits_http_set_connections(
+		grits_prefs_get_integer(prefs, "grits/http_max_conns", NULL),
+		grits_prefs_get_integer(prefs, "grits/http_max_conns_per_host", NULL));
+	grits_http_set_pack_cache(
+		grits_prefs_get_boolean(prefs, "grits/pack_cache", NULL));
+	grits_http_set_bandwidth((gint64)1024 *
+		grits_prefs_get_integer(prefs, "grits/http_bandwidth_kb", NULL));
+	grits_cache_set_quota(NULL, (guint64)1024*1024 *
+		grits_prefs_get_integer(prefs, "grits/cache_quota_mb", NULL));
 }
 
 /**
@@ -331,6 +384,35 @@ void grits_viewer_zoom(GritsViewer *viewer, gdouble scale)
 	_grits_viewer_emit_location_changed(viewer);
 }
 
+/**
+ * grits_viewer_predict_location:
+ * @viewer:  the viewer
+ * @seconds: how far into the future to predict
+ * @lat:     the location to store the predicted latitude
+ * @lon:     the location to store the predicted longitude
+ * @elev:    the location to store the predicted elevation
+ *
+ * Extrapolate the camera location based on how it has been moving recently.
+ * If the camera is not moving the current location is returned. This is
+ * useful for loading data before it is needed.
+ */
+void grits_viewer_predict_location(GritsViewer *viewer, gdouble seconds,
+		gdouble *lat, gdouble *lon, gdouble *elev)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	gdouble *velocity = viewer->motion_velocity;
+	gdouble  idle     = (gdouble)(g_get_monotonic_time() -
+			viewer->motion_time) / G_USEC_PER_SEC;
+	if (idle > MOTION_TIMEOUT)
+		seconds = 0;
+	*lat  = viewer->location[0] + velocity[0]*seconds;
+	*lon  = viewer->location[1] + velocity[1]*seconds;
+	*elev = viewer->location[2] * exp(velocity[2]*seconds);
+	*lat  = CLAMP(*lat, -90, 90);
+	while (*lon < -180) *lon += 360;
+	while (*lon >  180) *lon -= 360;
+}
+
 /**
  * grits_viewer_set_rotation:
  * @viewer: the viewer
@@ -434,6 +516,101 @@ gboolean grits_viewer_get_offline(GritsViewer *viewer)
 	return viewer->offline;
 }
 
+/**
+ * grits_viewer_set_range_func:
+ * @viewer:     the viewer
+ * @range_func: the range function, or NULL to clear it
+ * @user_data:  user data to pass to the range function
+ *
+ * Set the function used to find the range of surface elevations within an
+ * area. This is normally set by the same plugin which sets the height
+ * function.
+ */
+void grits_viewer_set_range_func(GritsViewer *viewer,
+		GritsRangeFunc range_func, gpointer user_data)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	viewer->range_func = range_func;
+	viewer->range_data = user_data;
+}
+
+/**
+ * grits_viewer_get_elevation_range:
+ * @viewer: the viewer
+ * @bounds: the area to check
+ * @min:    location to store the lowest elevation
+ * @max:    location to store the highest elevation
+ *
+ * Find the range of surface elevations within an area. This is useful for
+ * building bounding volumes around the terrain, for culling and picking.
+ * Without a range function the surface is at sea level.
+ *
+ * Returns: %TRUE if the range is known, otherwise @min and @max are set to 0
+ */
+gboolean grits_viewer_get_elevation_range(GritsViewer *viewer,
+		GritsBounds *bounds, gdouble *min, gdouble *max)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	*min = *max = 0;
+	if (!viewer->range_func)
+		return FALSE;
+	return viewer->range_func(bounds, min, max, viewer->range_data);
+}
+
+/**
+ * grits_viewer_set_elevations_func:
+ * @viewer:          the viewer
+ * @elevations_func: the elevations function, or NULL to clear it
+ * @user_data:       user data to pass to the elevations function
+ *
+ * Set the function used to look up the surface elevations of many points at
+ * once. This is normally set by the same plugin which sets the height
+ * function.
+ */
+void grits_viewer_set_elevations_func(GritsViewer *viewer,
+		GritsElevationsFunc elevations_func, gpointer user_data)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	viewer->elevations_func = elevations_func;
+	viewer->elevations_data = user_data;
+}
+
+/**
+ * grits_viewer_get_elevations:
+ * @viewer: the viewer
+ * @lat:    the latitude of each point
+ * @lon:    the longitude of each point
+ * @elev:   location to store the elevation of each point
+ * @count:  the number of points
+ * @wait:   %TRUE to fetch missing elevation data before returning
+ *
+ * Find the surface elevations of many points, such as the ground profile
+ * along a path. Points which are close together should be passed next to
+ * each other so they can be looked up together. Without @wait only the
+ * elevation data which is already loaded is used, which may be less detailed
+ * than what is available. Without an elevations function the surface is at
+ * sea level.
+ *
+ * This function is thread safe. With @wait it blocks until the missing
+ * elevation data has been downloaded and loaded by the background loader, so
+ * it should not be used with @wait from the main thread.
+ *
+ * Returns: %TRUE if elevation data was found for every point, otherwise the
+ * missing points are set to 0
+ */
+gboolean grits_viewer_get_elevations(GritsViewer *viewer,
+		const gdouble *lat, const gdouble *lon, gdouble *elev,
+		gsize count, gboolean wait)
+{
+	g_assert(GRITS_IS_VIEWER(viewer));
+	if (!viewer->elevations_func) {
+		memset(elev, 0, count * sizeof(gdouble));
+		return FALSE;
+	}
+	return viewer->elevations_func(lat, lon, elev, count, wait,
+			viewer->elevations_data);
+}
+
 /**
  * grits_viewer_queue_draw:
  * @viewer: the viewer
@@ -501,8 +678,8 @@ void grits_viewer_project(GritsViewer *viewer,
  * @viewer: the viewer
  * @x:    x coordinate in screen space
  * @y:    y coordinate in screen space
- * @z:    z coordinate in screen space, or -1 to use the value
- *        from the depth buffer at x and y as the z value
+ * @z:    z coordinate in screen space, or -1 to use the point where
+ *        the terrain is drawn at x and y
  * @lat:  the latitude
  * @lon:  the longitude
  * @elev: the elevation
@@ -521,6 +698,30 @@ void grits_viewer_unproject(GritsViewer *viewer,
 	klass->unproject(viewer, px, py, pz, lat, lon, elev);
 }
 
+/**
+ * grits_viewer_get_frustum:
+ * @viewer:  the viewer
+ * @lat:     the latitude of the camera
+ * @lon:     the longitude of the camera
+ * @elev:    the elevation of the camera
+ * @frustum: location to store the view frustum
+ *
+ * Calculate the clipping planes the viewer would use when the camera is at the
+ * given location, using the current rotation and window size. Useful for
+ * skipping objects that will not be drawn.
+ *
+ * Returns: TRUE if @frustum was set, FALSE if the view is not known yet
+ */
+gboolean grits_viewer_get_frustum(GritsViewer *viewer,
+		gdouble lat, gdouble lon, gdouble elev,
+		GritsFrustum *frustum)
+{
+	GritsViewerClass *klass = GRITS_VIEWER_GET_CLASS(viewer);
+	if (!klass->get_frustum)
+		return FALSE;
+	return klass->get_frustum(viewer, lat, lon, elev, frustum);
+}
+
 /**
  * grits_viewer_clear_height_func:
  * @viewer: the viewer
@@ -105,6 +105,38 @@ typedef gdouble (*GritsHeightFunc)(gdouble lat, gdouble lon, gpointer user_data)
 #include "grits-prefs.h"
 #include "objects/grits-object.h"
 
+/**
+ * GritsRangeFunc:
+ * @bounds:    the area to check
+ * @min:       location to store the lowest elevation
+ * @max:       location to store the highest elevation
+ * @user_data: user data passed to the function
+ *
+ * Determine the range of surface elevations within an area. The range may be
+ * larger than the actual range but must contain it.
+ *
+ * Returns: %TRUE if the range is known
+ */
+typedef gboolean (*GritsRangeFunc)(GritsBounds *bounds,
+		gdouble *min, gdouble *max, gpointer user_data);
+
+/**
+ * GritsElevationsFunc:
+ * @lat:       the latitude of each point
+ * @lon:       the longitude of each point
+ * @elev:      location to store the elevation of each point
+ * @count:     the number of points
+ * @wait:      %TRUE to fetch missing elevation data before returning
+ * @user_data: user data passed to the function
+ *
+ * Look up the surface elevations of many points at once. This may be called
+ * from any thread.
+ *
+ * Returns: %TRUE if elevation data was found for every point
+ */
+typedef gboolean (*GritsElevationsFunc)(const gdouble *lat, const gdouble *lon,
+		gdouble *elev, gsize count, gboolean wait, gpointer user_data);
+
 struct _GritsViewer {
 	GtkDrawingArea parent_instance;
 
@@ -120,6 +152,19 @@ struct _GritsViewer {
 	gint    drag_mode;
 	gdouble drag_x, drag_y;
 
+	/* For predicting camera motion */
+	gdouble motion_location[3];
+	gdouble motion_velocity[3];
+	gint64  motion_time;
+
+	/* For elevation ranges */
+	GritsRangeFunc range_func;
+	gpointer       range_data;
+
+	/* For elevation queries */
+	GritsElevationsFunc elevations_func;
+	gpointer            elevations_data;
+
 	/* For queue_draw */
 	guint   draw_source;
 	GMutex  draw_lock;
@@ -138,6 +183,9 @@ struct _GritsViewerClass {
 	void (*unproject)        (GritsViewer *viewer,
 	                          gdouble px, gdouble py,gdouble pz,
 	                          gdouble *lat, gdouble *lon, gdouble *elev);
+	gboolean (*get_frustum)  (GritsViewer *viewer,
+	                          gdouble lat, gdouble lon, gdouble elev,
+	                          GritsFrustum *frustum);
 
 	void (*clear_height_func)(GritsViewer *viewer);
 	void (*set_height_func)  (GritsViewer *viewer, GritsBounds *bounds,
@@ -161,6 +209,8 @@ void grits_viewer_set_location(GritsViewer *viewer, gdouble  lat, gdouble  lon,
 void grits_viewer_get_location(GritsViewer *viewer, gdouble *lat, gdouble *lon, gdouble *elev);
 void grits_viewer_pan(GritsViewer *viewer, gdouble forward, gdouble right, gdouble up);
 void grits_viewer_zoom(GritsViewer *viewer, gdouble  scale);
+void grits_viewer_predict_location(GritsViewer *viewer, gdouble seconds,
+		gdouble *lat, gdouble *lon, gdouble *elev);
 
 void grits_viewer_set_rotation(GritsViewer *viewer, gdouble  x, gdouble  y, gdouble  z);
 void grits_viewer_get_rotation(GritsViewer *viewer, gdouble *x, gdouble *y, gdouble *z);
@@ -171,6 +221,16 @@ void grits_viewer_refresh(GritsViewer *viewer);
 void grits_viewer_set_offline(GritsViewer *viewer, gboolean offline);
 gboolean grits_viewer_get_offline(GritsViewer *viewer);
 
+void grits_viewer_set_range_func(GritsViewer *viewer,
+		GritsRangeFunc range_func, gpointer user_data);
+gboolean grits_viewer_get_elevation_range(GritsViewer *viewer,
+		GritsBounds *bounds, gdouble *min, gdouble *max);
+void grits_viewer_set_elevations_func(GritsViewer *viewer,
+		GritsElevationsFunc elevations_func, gpointer user_data);
+gboolean grits_viewer_get_elevations(GritsViewer *viewer,
+		const gdouble *lat, const gdouble *lon, gdouble *elev,
+		gsize count, gboolean wait);
+
 /* To be implemented by subclasses */
 void grits_viewer_center_position(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev);
@@ -181,6 +241,9 @@ void grits_viewer_project(GritsViewer *viewer,
 void grits_viewer_unproject(GritsViewer *viewer,
 		gdouble px, gdouble py, gdouble pz,
 		gdouble *lat, gdouble *lon, gdouble *elev);
+gboolean grits_viewer_get_frustum(GritsViewer *viewer,
+		gdouble lat, gdouble lon, gdouble elev,
+		GritsFrustum *frustum);
 
 void grits_viewer_clear_height_func(GritsViewer *viewer);
 void grits_viewer_set_height_func(GritsViewer *viewer, GritsBounds *bounds,
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2009-2011 Andy Spencer <andy753421@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fetch tiles from a local server through an asynchronous loader queue.
+ * The server holds every response until all the requests have arrived, so
+ * the test only passes if a single I/O thread keeps them all in flight. */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+
+#include "data/grits-http.h"
+#include "data/grits-loader.h"
+
+#define TILES 16
+
+/* Server state, only used from the server thread */
+static GList *held;
+
+/* Client state */
+static GMutex lock;
+static GCond  cond;
+static gint   loaded;
+static gint   failed;
+
+/**********
+ * Server *
+ **********/
+static void server_cb(SoupServer *server, SoupMessage *msg, const gchar *path,
+		GHashTable *query, SoupClientContext *client, gpointer _)
+{
+	gchar *body = g_strdup_printf("tile %s", path);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "text/plain", SOUP_MEMORY_TAKE,
+			body, strlen(body));
+
+	/* Hold responses until every tile has been requested */
+	soup_server_pause_message(server, msg);
+	held = g_list_prepend(held, msg);
+	if (g_list_length(held) < TILES)
+		return;
+	g_debug("HttpTest: server_cb - releasing %d requests", TILES);
+	for (GList *cur = held; cur; cur = cur->next)
+		soup_server_unpause_message(server, cur->data);
+	g_list_free(held);
+	held = NULL;
+}
+
+static gpointer server_thread(gpointer _loop)
+{
+	g_main_loop_run(_loop);
+	return NULL;
+}
+
+/**********
+ * Client *
+ **********/
+struct _Tile {
+	GritsHttp *http;
+	gchar     *uri;
+	gchar     *local;
+};
+
+static void fetch_done(gchar *path, gpointer _job)
+{
+	grits_loader_job_finish(_job, path);
+}
+
+static void fetch_start(gpointer _tile, GritsLoaderJob *job, gpointer _)
+{
+	struct _Tile *tile = _tile;
+	grits_http_fetch_async(tile->http, tile->uri, tile->local,
+			GRITS_ONCE, NULL, NULL, fetch_done, job);
+}
+
+static void decode(gpointer _tile, gpointer _path, gpointer _)
+{
+	struct _Tile *tile = _tile;
+	gchar *path = _path;
+	gchar *data = NULL;
+	gchar *want = g_strdup_printf("tile /%s", tile->local);
+	gboolean ok = g_file_get_contents(path, &data, NULL, NULL) &&
+		g_str_equal(data, want);
+	if (!ok)
+		g_warning("HttpTest: decode - bad data for %s", tile->local);
+	g_mutex_lock(&lock);
+	loaded++;
+	failed += !ok;
+	g_cond_signal(&cond);
+	g_mutex_unlock(&lock);
+	g_free(want);
+	g_free(data);
+	g_free(path);
+}
+
+/***********
+ * Methods *
+ ***********/
+int main(int argc, char **argv)
+{
+	/* Keep the cache out of the users home */
+	gchar *cache = g_dir_make_tmp("grits-http-test-XXXXXX", NULL);
+	g_setenv("XDG_CACHE_HOME", cache, TRUE);
+
+	/* Start the server */
+	GMainContext *context = g_main_context_new();
+	GMainLoop    *loop    = g_main_loop_new(context, FALSE);
+	SoupServer   *server  = soup_server_new(
+			SOUP_SERVER_PORT,          0,
+			SOUP_SERVER_ASYNC_CONTEXT, context,
+			NULL);
+	soup_server_add_handler(server, NULL, server_cb, NULL, NULL);
+	soup_server_run_async(server);
+	GThread *thread = g_thread_new("http-test", server_thread, loop);
+
+	/* Fetch the tiles with a single I/O thread */
+	grits_http_set_connections(TILES, TILES);
+	GritsHttp        *http   = grits_http_new("test/");
+	GritsLoader      *loader = grits_loader_new(1, 1, 1);
+	GritsLoaderQueue *queue  = grits_loader_queue_new_async(loader,
+			fetch_start, decode, NULL);
+	struct _Tile tiles[TILES];
+	for (gint i = 0; i < TILES; i++) {
+		tiles[i].http  = http;
+		tiles[i].local = g_strdup_printf("%d", i);
+		tiles[i].uri   = g_strdup_printf("http://127.0.0.1:%u/%d",
+				soup_server_get_port(server), i);
+		grits_loader_push(queue, &tiles[i], FALSE);
+	}
+
+	/* Wait for them, the server never answers if they are serialized */
+	gint64 end = g_get_monotonic_time() + 30 * G_TIME_SPAN_SECOND;
+	g_mutex_lock(&lock);
+	while (loaded < TILES)
+		if (!g_cond_wait_until(&cond, &lock, end))
+			break;
+	gint result = loaded == TILES && failed == 0 ? 0 : 1;
+	g_message("HttpTest: loaded %d of %d tiles, %d failed",
+			loaded, TILES, failed);
+	g_mutex_unlock(&lock);
+
+	/* Cleanup */
+	grits_http_free(http);
+	grits_loader_queue_free(queue);
+	grits_loader_free(loader);
+	gchar *dir = g_build_filename(cache, PACKAGE, "test", NULL);
+	for (gint i = 0; i < TILES; i++) {
+		gchar *path = g_build_filename(dir, tiles[i].local, NULL);
+		gchar *meta = g_strconcat(path, ".meta", NULL);
+		g_remove(path);
+		g_remove(meta);
+		g_free(meta);
+		g_free(path);
+		g_free(tiles[i].uri);
+		g_free(tiles[i].local);
+	}
+	g_rmdir(dir);
+	g_free(dir);
+	dir = g_build_filename(cache, PACKAGE, NULL);
+	g_rmdir(dir);
+	g_free(dir);
+	g_rmdir(cache);
+	g_main_loop_quit(loop);
+	g_thread_join(thread);
+	soup_server_quit(server);
+	g_object_unref(server);
+	g_main_loop_unref(loop);
+	g_main_context_unref(context);
+	g_free(cache);
+	return result;
+}
@@ -30,22 +30,190 @@
  * Each #GritsTile has a data filed which must be set by the user in order for
  * the tile to be drawn. When used with GritsOpenGL the data must be an integer
  * representing the OpenGL texture to use when drawing the tile.
+ *
+ * Tiles loaded with grits_tile_load_elevation() store the raw elevation
+ * samples in a single channel texture and are coloured when they are drawn
+ * using the colour ramp set with grits_tile_set_ramp().
  */
 
 #define GL_GLEXT_PROTOTYPES
 #include <config.h>
 #include <math.h>
 #include <string.h>
+#include <GL/glew.h>
 #include "gtkgl.h"
 #include "grits-tile.h"
 
+/* Highest and lowest points on the earth, used to pad visibility tests */
+#define TERRAIN_MAX  9000
+#define TERRAIN_MIN -11000
+
+#define grits_tile_key(level, x, y) \
+	(((guint64)(level) << 58) | ((guint64)(y) << 29) | (guint64)(x))
+
+/* Quadkey to tile lookup table, shared by all tiles in a tree */
+struct _GritsTileIndex {
+	GHashTable *tiles;
+	GMutex      lock;
+	guint       depth;
+	guint       count[GRITS_TILE_MAX_LEVEL+1]; /* Number of tiles at each level */
+	gint        refs;
+
+	/* Per tile resolution limit */
+	GritsTileResFunc res_func;
+	gpointer         res_data;
+};
+
+/* Colour ramp for elevation tiles, the colors are spaced evenly from min to
+ * max and the texture is reloaded from the main thread when they change */
+struct _GritsTileRamp {
+	guchar  *colors;
+	gint     count;
+	gdouble  min;
+	gdouble  max;
+	gdouble  hillshade;
+	guint    tex;
+	gboolean dirty;
+};
+
 static guint  grits_tile_mask = 0;
 
+/* Shader used to colour elevation tiles, 0 if shaders are not available */
+static guint    grits_tile_program = 0;
+static gboolean grits_tile_program_init = FALSE;
+static gboolean grits_tile_shading = FALSE;
+
+static const gchar *grits_tile_vertex_source =
+	"void main() {\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"	gl_TexCoord[1] = gl_MultiTexCoord1;\n"
+	"	gl_Position    = ftransform();\n"
+	"}\n";
+
+/* Heights are stored offset by 32768 to fit in an unsigned texture. The
+ * hillshade uses the slope of the samples with a light from the north-west */
+static const gchar *grits_tile_fragment_source =
+	"uniform sampler2D heights;\n"
+	"uniform sampler2D mask;\n"
+	"uniform sampler1D ramp;\n"
+	"uniform vec2  scale;\n"
+	"uniform vec2  texel;\n"
+	"uniform vec2  spacing;\n"
+	"uniform float hillshade;\n"
+	"float height(vec2 st) {\n"
+	"	return texture2D(heights, st).r * 65535.0 - 32768.0;\n"
+	"}\n"
+	"void main() {\n"
+	"	vec2  st = gl_TexCoord[0].st;\n"
+	"	float h  = height(st);\n"
+	"	float dx = height(st + vec2(texel.x, 0.0)) -\n"
+	"	           height(st - vec2(texel.x, 0.0));\n"
+	"	float dy = height(st - vec2(0.0, texel.y)) -\n"
+	"	           height(st + vec2(0.0, texel.y));\n"
+	"	vec3  n  = normalize(vec3(-dx / spacing.x, -dy / spacing.y, 1.0));\n"
+	"	float l  = max(dot(n, vec3(-0.5, 0.5, 0.7071)), 0.0);\n"
+	"	vec4  c  = texture1D(ramp, h * scale.x + scale.y);\n"
+	"	c.rgb   *= mix(1.0, l, hillshade);\n"
+	"	c.a     *= texture2D(mask, gl_TexCoord[1].st).a;\n"
+	"	gl_FragColor = c;\n"
+	"}\n";
+
 gchar *grits_tile_path_table[2][2] = {
 	{"00.", "01."},
 	{"10.", "11."},
 };
 
+/* Texture coordinates of each child within the parent tile's
+ * texture, keep in sync with tile->children */
+static const GritsBounds grits_tile_quad_table[2][2] = {
+	/*  n    s    e    w */
+	{{0.0, 0.5, 0.5, 0.0}, {0.0, 0.5, 1.0, 0.5}},
+	{{0.5, 1.0, 0.5, 0.0}, {0.5, 1.0, 1.0, 0.5}},
+};
+
+/* Quadkey index */
+static GritsTileIndex *_grits_tile_index_new(void)
+{
+	GritsTileIndex *index = g_new0(GritsTileIndex, 1);
+	index->tiles = g_hash_table_new(g_int64_hash, g_int64_equal);
+	index->refs  = 1;
+	g_mutex_init(&index->lock);
+	return index;
+}
+
+static GritsTileIndex *_grits_tile_index_ref(GritsTileIndex *index)
+{
+	g_atomic_int_inc(&index->refs);
+	return index;
+}
+
+static void _grits_tile_index_unref(GritsTileIndex *index)
+{
+	if (!g_atomic_int_dec_and_test(&index->refs))
+		return;
+	g_hash_table_destroy(index->tiles);
+	g_mutex_clear(&index->lock);
+	g_free(index);
+}
+
+static gboolean _grits_tile_index_has(GritsTile *tile)
+{
+	g_mutex_lock(&tile->index->lock);
+	gboolean has = g_hash_table_lookup(tile->index->tiles, &tile->key) == tile;
+	g_mutex_unlock(&tile->index->lock);
+	return has;
+}
+
+static void _grits_tile_index_add(GritsTile *tile)
+{
+	if (tile->level > GRITS_TILE_MAX_LEVEL)
+		return;
+	GritsTileIndex *index = tile->index;
+	tile->key = grits_tile_key(tile->level, tile->x, tile->y);
+	g_mutex_lock(&index->lock);
+	if (!g_hash_table_lookup(index->tiles, &tile->key))
+		index->count[tile->level]++;
+	g_hash_table_replace(index->tiles, &tile->key, tile);
+	index->depth = MAX(index->depth, tile->level);
+	g_mutex_unlock(&index->lock);
+}
+
+static void _grits_tile_index_remove(GritsTile *tile)
+{
+	GritsTileIndex *index = tile->index;
+	g_mutex_lock(&index->lock);
+	if (g_hash_table_lookup(index->tiles, &tile->key) == tile) {
+		g_hash_table_remove(index->tiles, &tile->key);
+		index->count[tile->level]--;
+		while (index->depth > 0 && index->count[index->depth] == 0)
+			index->depth--;
+	}
+	g_mutex_unlock(&index->lock);
+}
+
+/* Set the location of a tile from its position in the parent */
+static void _grits_tile_set_location(GritsTile *tile, gint row, gint col)
+{
+	GritsTile *parent = tile->parent;
+	tile->level = parent->level + 1;
+	tile->x     = parent->x*2 + col;
+	tile->y     = parent->y*2 + row;
+	_grits_tile_index_add(tile);
+}
+
+/* Locate tiles which were added to their parent by hand */
+static void _grits_tile_locate(GritsTile *tile)
+{
+	GritsTile *parent = tile->parent;
+	if (!parent || _grits_tile_index_has(tile))
+		return;
+	_grits_tile_locate(parent);
+	int row, col;
+	grits_tile_foreach_index(parent, row, col)
+		if (parent->children[row][col] == tile)
+			_grits_tile_set_location(tile, row, col);
+}
+
 /**
  * grits_tile_new:
  * @parent: the parent for the tile, or NULL
@@ -66,11 +234,35 @@ GritsTile *grits_tile_new(GritsTile *parent,
 	tile->atime  = time(NULL);
 	grits_bounds_set_bounds(&tile->coords, 0, 1, 1, 0);
 	grits_bounds_set_bounds(&tile->edge, n, s, e, w);
-	if (parent)
+	if (parent) {
 		tile->proj   = parent->proj;
+		tile->level  = parent->level + 1;
+		tile->index  = _grits_tile_index_ref(parent->index);
+	} else {
+		tile->index  = _grits_tile_index_new();
+		_grits_tile_index_add(tile);
+	}
 	return tile;
 }
 
+/**
+ * grits_tile_set_res_func:
+ * @root:      the root of the tiles
+ * @res_func:  function used to find the resolution limit of a tile, or NULL
+ * @user_data: user data to pass to @res_func
+ *
+ * Set a function which can lower the resolution limit passed to
+ * grits_tile_update() and grits_tile_prefetch() for some tiles. This is
+ * used when more detailed data is only available in some areas, so that
+ * only the tiles covering those areas are split further.
+ */
+void grits_tile_set_res_func(GritsTile *root, GritsTileResFunc res_func,
+		gpointer user_data)
+{
+	root->index->res_func = res_func;
+	root->index->res_data = user_data;
+}
+
 /**
  * grits_tile_get_path:
  * @child: the tile to generate a path for
@@ -84,18 +276,16 @@ GritsTile *grits_tile_new(GritsTile *parent,
  */
 gchar *grits_tile_get_path(GritsTile *child)
 {
-	/* This could be easily cached if necessary */
-	int x, y;
-	GList *parts = NULL;
-	for (GritsTile *parent = child->parent; parent; child = parent, parent = child->parent)
-		grits_tile_foreach_index(child, x, y)
-			if (parent->children[x][y] == child)
-				parts = g_list_prepend(parts, grits_tile_path_table[x][y]);
-	GString *path = g_string_new("");
-	for (GList *cur = parts; cur; cur = cur->next)
-		g_string_append(path, cur->data);
-	g_list_free(parts);
-	return g_string_free(path, FALSE);
+	_grits_tile_locate(child);
+	gsize  part = strlen(grits_tile_path_table[0][0]);
+	gchar *path = g_malloc(child->level*part + 1);
+	gchar *pos  = path;
+	*pos = '\0';
+	for (gint shift = child->level-1; shift >= 0; shift--)
+		pos = g_stpcpy(pos, grits_tile_path_table
+				[(child->y >> shift) & 1]
+				[(child->x >> shift) & 1]);
+	return path;
 }
 
 static gdouble _grits_tile_get_min_dist(GritsPoint *eye, GritsBounds *bounds)
@@ -124,8 +314,9 @@ static gboolean _grits_tile_precise(GritsPoint *eye, GritsBounds *bounds,
 	gdouble lon_dist  = bounds->e - bounds->w;
 	gdouble tile_res  = ll2m(lon_dist, lat_point)/width;
 
-	/* This isn't really right, but it helps with memory since we don't
-	 * (yet?) test if the tile would be drawn */
+	/* This isn't really right, but it helps with memory. Distant tiles
+	 * are seen at a glancing angle so they get a lower resolution.
+	 * Tiles which are not drawn at all are skipped by _grits_tile_visible */
 	gdouble scale = eye->elev / min_dist;
 	view_res /= scale;
 	view_res *= 1.8;
@@ -141,6 +332,72 @@ static gboolean _grits_tile_precise(GritsPoint *eye, GritsBounds *bounds,
 	       tile_res < view_res;
 }
 
+/* Test if all the points are on the outside of a plane */
+/* Resolution limit for a tile, which may be finer than res in some areas */
+static gdouble _grits_tile_res(GritsTile *tile, gdouble res)
+{
+	GritsTileIndex *index = tile->index;
+	if (!index->res_func)
+		return res;
+	return MIN(res, index->res_func(&tile->edge, index->res_data));
+}
+
+static gboolean _grits_tile_outside(gdouble *plane, gdouble (*points)[3],
+		gint count, gdouble margin)
+{
+	for (int i = 0; i < count; i++)
+		if (plane[0]*points[i][0] +
+		    plane[1]*points[i][1] +
+		    plane[2]*points[i][2] + plane[3] > -margin)
+			return FALSE;
+	return TRUE;
+}
+
+static gboolean _grits_tile_visible(GritsPoint *eye, GritsFrustum *frustum,
+		GritsBounds *bounds)
+{
+	gdouble lat_dist = bounds->n - bounds->s;
+	gdouble lon_dist = bounds->e - bounds->w;
+
+	/* Large tiles curve too much to test using a few points */
+	if (lat_dist > 45 || lon_dist > 45)
+		return TRUE;
+
+	/* Sample the tile on a 3x3 grid, the surface between samples
+	 * bulges out by at most half of a cell's diagonal */
+	gdouble points[9][3];
+	for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+		lle2xyz(bounds->n - lat_dist*i/2, bounds->w + lon_dist*j/2, 0,
+			&points[i*3+j][0], &points[i*3+j][1], &points[i*3+j][2]);
+	gdouble diag  = deg2rad(sqrt(lat_dist*lat_dist + lon_dist*lon_dist)/2);
+	gdouble bulge = EARTH_R * (1-cos(diag/2));
+
+	/* Beyond the horizon, mountains can peek over it
+	 * so push it back by the tallest terrain */
+	gdouble pos[3];
+	lle2xyz(eye->lat, eye->lon, eye->elev, &pos[0], &pos[1], &pos[2]);
+	gdouble rad     = lengthd(pos);
+	gdouble horizon = acos(MIN(EARTH_R/rad, 1)) +
+	                  acos(EARTH_R/(EARTH_R+TERRAIN_MAX));
+	if (horizon < G_PI) {
+		gdouble plane[4] = {pos[0]/rad, pos[1]/rad, pos[2]/rad,
+			-EARTH_R*cos(horizon)};
+		if (_grits_tile_outside(plane, points, 9, bulge))
+			return FALSE;
+	}
+
+	/* Outside the view frustum, the terrain
+	 * can move the surface in either direction */
+	if (frustum)
+		for (int i = 0; i < G_N_ELEMENTS(frustum->planes); i++)
+			if (_grits_tile_outside(frustum->planes[i], points, 9,
+						bulge + MAX(TERRAIN_MAX, -TERRAIN_MIN)))
+				return FALSE;
+
+	return TRUE;
+}
+
 static void _grits_tile_split_latlon(GritsTile *tile)
 {
 	//g_debug("GritsTile: split - %p", tile);
@@ -153,9 +410,11 @@ static void _grits_tile_split_latlon(GritsTile *tile)
 
 	int row, col;
 	grits_tile_foreach_index(tile, row, col) {
-		if (!tile->children[row][col])
+		if (!tile->children[row][col]) {
 			tile->children[row][col] =
 				grits_tile_new(tile, 0, 0, 0, 0);
+			_grits_tile_set_location(tile->children[row][col], row, col);
+		}
 		/* Set edges aferwards so that north and south
 		 * get reset for mercator projections */
 		GritsTile *child = tile->children[row][col];
@@ -185,10 +444,26 @@ static void _grits_tile_split_mercator(GritsTile *tile)
 	}
 }
 
+static gboolean _grits_tile_split(GritsTile *tile)
+{
+	int x, y;
+	grits_tile_foreach_index(tile, x, y) {
+		if (tile->children[x][y] == NULL) {
+			switch (tile->proj) {
+			case GRITS_PROJ_LATLON:   _grits_tile_split_latlon(tile);   break;
+			case GRITS_PROJ_MERCATOR: _grits_tile_split_mercator(tile); break;
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 /**
  * grits_tile_update:
  * @root:      the root tile to split
  * @eye:       the point the tile is viewed from, for calculating distances
+ * @frustum:   the view frustum from @eye, or NULL to only cull at the horizon
  * @res:       a maximum resolution in meters per pixel to split tiles to
  * @width:     width in pixels of the image associated with the tile
  * @height:    height in pixels of the image associated with the tile
@@ -200,8 +475,15 @@ static void _grits_tile_split_mercator(GritsTile *tile)
  * is being drawn at on the screen. If the screen resolution is insufficient
  * the tile is recursively subdivided until a sufficient resolution is
  * achieved.
+ *
+ * Tiles queued by grits_tile_prefetch() which become visible are passed to
+ * @load_func again, with the load flag already set and the prefetch flag
+ * cleared, so that they can be moved ahead of other prefetched tiles.
+ *
+ * Tiles which are outside of @frustum or beyond the horizon will not be drawn,
+ * so they are hidden and neither loaded nor split.
  */
-void grits_tile_update(GritsTile *tile, GritsPoint *eye,
+void grits_tile_update(GritsTile *tile, GritsPoint *eye, GritsFrustum *frustum,
 		gdouble res, gint width, gint height,
 		GritsTileLoadFunc load_func, gpointer user_data)
 {
@@ -217,35 +499,181 @@ void grits_tile_update(GritsTile *tile, GritsPoint *eye,
 	 * resolution for this part? */
 	gint xs = G_N_ELEMENTS(tile->children);
 	gint ys = G_N_ELEMENTS(tile->children[0]);
-	if (tile->parent && _grits_tile_precise(eye, &tile->edge,
-				res, width/xs, height/ys)) {
+	if (tile->parent && (_grits_tile_precise(eye, &tile->edge,
+				_grits_tile_res(tile, res), width/xs, height/ys) ||
+	                     !_grits_tile_visible(eye, frustum, &tile->edge))) {
 		GRITS_OBJECT(tile)->hidden = TRUE;
 		return;
 	}
 
-	/* Load the tile */
-	if (!tile->load && !tile->data && !tile->tex && !tile->pixels && !tile->pixbuf)
+	/* Load the tile, or tell the loader a prefetched tile is needed now */
+	if (!tile->load && !tile->data && !tile->tex && !tile->pixels && !tile->pixbuf) {
 		load_func(tile, user_data);
-	tile->atime = time(NULL);
-	tile->load  = TRUE;
+	} else if (tile->load && tile->prefetch) {
+		tile->prefetch = FALSE;
+		load_func(tile, user_data);
+	}
+	tile->atime    = time(NULL);
+	tile->load     = TRUE;
+	tile->prefetch = FALSE;
 	GRITS_OBJECT(tile)->hidden = FALSE;
 
 	/* Split tile if needed */
-	grits_tile_foreach(tile, child) {
-		if (child == NULL) {
-			switch (tile->proj) {
-			case GRITS_PROJ_LATLON:   _grits_tile_split_latlon(tile);   break;
-			case GRITS_PROJ_MERCATOR: _grits_tile_split_mercator(tile); break;
-			}
-		}
-	}
+	_grits_tile_split(tile);
 
 	/* Update recursively */
 	grits_tile_foreach(tile, child)
-		grits_tile_update(child, eye, res, width, height,
+		grits_tile_update(child, eye, frustum, res, width, height,
 				load_func, user_data);
 }
 
+/**
+ * grits_tile_prefetch:
+ * @root:      the root tile to split
+ * @eye:       the point the tiles will be viewed from
+ * @frustum:   the view frustum from @eye, or NULL to only cull at the horizon
+ * @res:       a maximum resolution in meters per pixel to split tiles to
+ * @width:     width in pixels of the image associated with the tile
+ * @height:    height in pixels of the image associated with the tile
+ * @budget:    maximum number of tiles to load
+ * @load_func: function used to load the image when a new tile is created
+ * @user_data: user data to past to the load function
+ *
+ * Load the tiles that grits_tile_update() would need for a view from @eye,
+ * without changing which tiles are currently drawn. This is used to fetch
+ * tiles before the camera gets to them. Coarse tiles are loaded first and
+ * the prefetch flag is set on each tile passed to @load_func so that the
+ * loader can give them a lower priority than visible tiles.
+ *
+ * Returns: the number of tiles passed to @load_func
+ */
+gint grits_tile_prefetch(GritsTile *root, GritsPoint *eye, GritsFrustum *frustum,
+		gdouble res, gint width, gint height, gint budget,
+		GritsTileLoadFunc load_func, gpointer user_data)
+{
+	GritsTile *tile, *child;
+	gint queued = 0;
+
+	/* Breadth first, so we don't spend the budget on one corner */
+	GQueue todo = G_QUEUE_INIT;
+	if (root)
+		g_queue_push_tail(&todo, root);
+	while (queued < budget && (tile = g_queue_pop_head(&todo))) {
+		gint xs = G_N_ELEMENTS(tile->children);
+		gint ys = G_N_ELEMENTS(tile->children[0]);
+		if (tile->parent && (_grits_tile_precise(eye, &tile->edge,
+					_grits_tile_res(tile, res), width/xs, height/ys) ||
+		                     !_grits_tile_visible(eye, frustum, &tile->edge)))
+			continue;
+
+		/* Load the tile */
+		if (!tile->load && !tile->data && !tile->tex && !tile->pixels && !tile->pixbuf) {
+			tile->prefetch = TRUE;
+			load_func(tile, user_data);
+			tile->load     = TRUE;
+			queued++;
+		}
+		tile->atime = time(NULL);
+
+		/* Split tile if needed, new tiles are not drawn until
+		 * grits_tile_update decides they are needed */
+		if (_grits_tile_split(tile))
+			grits_tile_foreach(tile, child)
+				if (!child->load)
+					GRITS_OBJECT(child)->hidden = TRUE;
+
+		grits_tile_foreach(tile, child)
+			g_queue_push_tail(&todo, child);
+	}
+	g_queue_clear(&todo);
+
+	return queued;
+}
+
+/**
+ * grits_tile_prefetch_ahead:
+ * @root:      the root tile to split
+ * @viewer:    the viewer whose camera is followed
+ * @eye:       the current location of the camera
+ * @seconds:   how far ahead to predict the location of the camera
+ * @budget:    maximum number of tiles to load
+ * @res:       a maximum resolution in meters per pixel to split tiles to
+ * @width:     width in pixels of the image associated with the tile
+ * @height:    height in pixels of the image associated with the tile
+ * @load_func: function used to load the image when a new tile is created
+ * @user_data: user data to past to the load function
+ *
+ * Prefetch the tiles for the view from where the camera is predicted to be in
+ * @seconds, using grits_tile_prefetch(). Nothing is loaded if the camera is
+ * not moving or @budget is used up.
+ *
+ * Returns: the number of tiles passed to @load_func
+ */
+gint grits_tile_prefetch_ahead(GritsTile *root, GritsViewer *viewer,
+		GritsPoint *eye, gdouble seconds, gint budget,
+		gdouble res, gint width, gint height,
+		GritsTileLoadFunc load_func, gpointer user_data)
+{
+	if (budget <= 0)
+		return 0;
+	GritsPoint next;
+	grits_viewer_predict_location(viewer, seconds,
+			&next.lat, &next.lon, &next.elev);
+	if (next.lat  == eye->lat &&
+	    next.lon  == eye->lon &&
+	    next.elev == eye->elev)
+		return 0;
+	GritsFrustum frustum;
+	gboolean culled = grits_viewer_get_frustum(viewer,
+			next.lat, next.lon, next.elev, &frustum);
+	return grits_tile_prefetch(root, &next, culled ? &frustum : NULL,
+			res, width, height, budget, load_func, user_data);
+}
+
+/**
+ * grits_tile_enumerate:
+ * @root:      the root tile to split
+ * @bounds:    the area to find tiles in
+ * @min_level: the first level to pass tiles from
+ * @max_level: the last level to split tiles to
+ * @func:      function to call for each tile
+ * @user_data: user data to past to @func
+ *
+ * Split tiles the same way as grits_tile_update() and call @func for each
+ * tile from @min_level to @max_level which overlaps @bounds, regardless of
+ * where they are viewed from. This is used to fetch the data for an area
+ * ahead of time. Tiles are passed breadth first, so coarse tiles come first.
+ *
+ * Returns: the number of tiles passed to @func
+ */
+gint grits_tile_enumerate(GritsTile *root, GritsBounds *bounds,
+		guint min_level, guint max_level,
+		GritsTileLoadFunc func, gpointer user_data)
+{
+	GritsTile *tile, *child;
+	gint found = 0;
+
+	GQueue todo = G_QUEUE_INIT;
+	if (root)
+		g_queue_push_tail(&todo, root);
+	while ((tile = g_queue_pop_head(&todo))) {
+		if (tile->edge.s >= bounds->n || tile->edge.n <= bounds->s ||
+		    tile->edge.w >= bounds->e || tile->edge.e <= bounds->w)
+			continue;
+		if (tile->level >= min_level) {
+			func(tile, user_data);
+			found++;
+		}
+		if (tile->level >= max_level)
+			continue;
+		_grits_tile_split(tile);
+		grits_tile_foreach(tile, child)
+			g_queue_push_tail(&todo, child);
+	}
+
+	return found;
+}
+
 static void _grits_tile_queue_draw(GritsTile *tile)
 {
 	while (!GRITS_OBJECT(tile)->viewer && tile->parent)
@@ -288,6 +716,80 @@ gboolean grits_tile_load_pixels(GritsTile *tile, guchar *pixels,
 	return TRUE;
 }
 
+/**
+ * grits_tile_load_elevation:
+ * @tile:    the tile to load data into
+ * @samples: elevation samples in meters
+ * @width:   number of samples in each row
+ * @height:  number of rows
+ * @stride:  number of samples between the start of each row
+ *
+ * Load tile data from a grid of elevation samples. The samples are uploaded
+ * as a single channel texture and coloured on the GPU using the ramp set with
+ * grits_tile_set_ramp() on the root tile, so changing the ramp does not
+ * require reloading the tiles.
+ *
+ * This function is thread safe and my be called from outside the main thread.
+ *
+ * The samples are copied and can be freed after calling this function.
+ *
+ * Returns: TRUE if the samples were loaded successfully
+ */
+gboolean grits_tile_load_elevation(GritsTile *tile, const gint16 *samples,
+		gint width, gint height, gint stride)
+{
+	g_debug("GritsTile: load_elevation - %p -> %p (%dx%d)",
+			tile, samples, width, height);
+
+	gint16 *copy = g_new(gint16, width*height);
+	for (int r = 0; r < height; r++)
+		memcpy(&copy[r*width], &samples[r*stride], width*sizeof(gint16));
+
+	tile->width     = width;
+	tile->height    = height;
+	tile->alpha     = FALSE;
+	tile->elevation = TRUE;
+	tile->pixels    = (guchar*)copy;
+
+	/* Queue OpenGL texture load/draw */
+	_grits_tile_queue_draw(tile);
+
+	return TRUE;
+}
+
+/**
+ * grits_tile_set_ramp:
+ * @root:      the root of the tiles to colour
+ * @colors:    @count RGBA colors spaced evenly from @min to @max
+ * @count:     number of colors
+ * @min:       elevation of the first color in meters
+ * @max:       elevation of the last color in meters
+ * @hillshade: amount of shading from the slope of the terrain, from 0 to 1
+ *
+ * Set the colour ramp used to draw tiles loaded with
+ * grits_tile_load_elevation(). Elevations outside of @min and @max use the
+ * first or last color. If shaders are not available the elevation tiles are
+ * drawn in greyscale.
+ *
+ * This function must be called from the main thread.
+ */
+void grits_tile_set_ramp(GritsTile *root, const guchar *colors, gint count,
+		gdouble min, gdouble max, gdouble hillshade)
+{
+	g_debug("GritsTile: set_ramp - %p count=%d %g-%g shade=%g",
+			root, count, min, max, hillshade);
+	if (!root->ramp)
+		root->ramp = g_new0(GritsTileRamp, 1);
+	g_free(root->ramp->colors);
+	root->ramp->colors    = g_memdup(colors, count*4);
+	root->ramp->count     = count;
+	root->ramp->min       = min;
+	root->ramp->max       = MAX(max, min+1);
+	root->ramp->hillshade = CLAMP(hillshade, 0, 1);
+	root->ramp->dirty     = TRUE;
+	_grits_tile_queue_draw(root);
+}
+
 /**
  * grits_tile_load_file:
  * @tile: the tile to load data into
@@ -351,35 +853,60 @@ gboolean grits_tile_load_file(GritsTile *tile, const gchar *file)
  * Locate the subtile with the highest resolution which contains the given
  * lat/lon point.
  *
+ * This function is thread safe and my be called from outside the main thread.
+ * No reference is taken on the returned tile, so the caller must keep
+ * grits_tile_gc() from running on the tree for as long as the tile is used.
+ *
  * Returns: the child tile
  */
 GritsTile *grits_tile_find(GritsTile *root, gdouble lat, gdouble lon)
 {
-	gint    rows = G_N_ELEMENTS(root->children);
-	gint    cols = G_N_ELEMENTS(root->children[0]);
-
-	gdouble lat_step = (root->edge.n - root->edge.s) / rows;
-	gdouble lon_step = (root->edge.e - root->edge.w) / cols;
-
-	gdouble lat_offset = root->edge.n - lat;;
-	gdouble lon_offset = lon - root->edge.w;
-
-	gint    row = lat_offset / lat_step;
-	gint    col = lon_offset / lon_step;
-
-	if (lon == 180) col--;
-	if (lat == -90) row--;
-
-	//if (lon == 180 || lon == -180)
-	//	g_message("lat=%f,lon=%f step=%f,%f off=%f,%f row=%d/%d,col=%d/%d",
-	//		lat,lon, lat_step,lon_step, lat_offset,lon_offset, row,rows,col,cols);
-
-	if (row < 0 || row >= rows || col < 0 || col >= cols)
+	GritsTileIndex *index = root->index;
+
+	/* Position of the point within the root tile */
+	gdouble n = root->edge.n;
+	gdouble s = root->edge.s;
+	if (root->proj == GRITS_PROJ_MERCATOR) {
+		n   = asinh(tan(deg2rad(n)));
+		s   = asinh(tan(deg2rad(s)));
+		lat = asinh(tan(deg2rad(lat)));
+	}
+	gdouble row_pos = (n - lat) / (n - s);
+	gdouble col_pos = (lon - root->edge.w) / (root->edge.e - root->edge.w);
+	if (row_pos < 0 || row_pos > 1 || col_pos < 0 || col_pos > 1)
 		return NULL;
-	else if (root->children[row][col] && root->children[row][col]->data)
-		return grits_tile_find(root->children[row][col], lat, lon);
-	else
-		return root;
+
+	/* Children only exist below their parents, so the deepest tile
+	 * containing the point can be found with a binary search over the
+	 * levels. Its data may not be loaded yet, in which case the closest
+	 * ancestor with data is used instead. */
+	GritsTile *tile = root;
+	g_mutex_lock(&index->lock);
+	guint depth = index->depth;
+	if (depth > root->level) {
+		guint levels  = depth - root->level;
+		guint breadth = 1 << levels;
+		guint row = (root->y << levels) + MIN(row_pos*breadth, breadth-1);
+		guint col = (root->x << levels) + MIN(col_pos*breadth, breadth-1);
+		guint lo  = root->level;
+		guint hi  = depth;
+		while (lo < hi) {
+			guint   mid   = (lo + hi + 1) / 2;
+			guint   shift = depth - mid;
+			guint64 key   = grits_tile_key(mid, col >> shift, row >> shift);
+			GritsTile *found = g_hash_table_lookup(index->tiles, &key);
+			if (found) {
+				tile = found;
+				lo   = mid;
+			} else {
+				hi   = mid - 1;
+			}
+		}
+	}
+	while (tile != root && !tile->data)
+		tile = tile->parent;
+	g_mutex_unlock(&index->lock);
+	return tile;
 }
 
 /**
@@ -474,6 +1001,123 @@ static guint _grits_tile_load_mask(void)
 	return tex;
 }
 
+/* Compile one stage of the elevation shader */
+static guint _grits_tile_load_shader(GLenum type, const gchar *source)
+{
+	guint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	gint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		gchar log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		g_warning("GritsTile: load_shader - compile failed: %s", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+/* Load the shader used to colour elevation tiles, 0 if it is not supported */
+static guint _grits_tile_load_program(void)
+{
+	if (!GLEW_VERSION_2_0) {
+		g_debug("GritsTile: load_program - shaders are not supported");
+		return 0;
+	}
+
+	guint vert = _grits_tile_load_shader(GL_VERTEX_SHADER,
+			grits_tile_vertex_source);
+	guint frag = _grits_tile_load_shader(GL_FRAGMENT_SHADER,
+			grits_tile_fragment_source);
+	if (!vert || !frag) {
+		if (vert) glDeleteShader(vert);
+		if (frag) glDeleteShader(frag);
+		return 0;
+	}
+
+	guint program = glCreateProgram();
+	glAttachShader(program, vert);
+	glAttachShader(program, frag);
+	glLinkProgram(program);
+	glDeleteShader(vert);
+	glDeleteShader(frag);
+
+	gint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		gchar log[1024];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		g_warning("GritsTile: load_program - link failed: %s", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/* Start colouring elevation tiles with the ramp */
+static gboolean _grits_tile_begin_ramp(GritsTileRamp *ramp)
+{
+	if (!grits_tile_program_init) {
+		grits_tile_program      = _grits_tile_load_program();
+		grits_tile_program_init = TRUE;
+	}
+	if (!grits_tile_program || !ramp->count)
+		return FALSE;
+
+	/* Reload the ramp texture after it changes */
+	glActiveTexture(GL_TEXTURE2);
+	if (!ramp->tex)
+		glGenTextures(1, &ramp->tex);
+	glBindTexture(GL_TEXTURE_1D, ramp->tex);
+	if (ramp->dirty) {
+		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, ramp->count, 0,
+				GL_RGBA, GL_UNSIGNED_BYTE, ramp->colors);
+		glTexParameterf(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameterf(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		ramp->dirty = FALSE;
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	/* Map min and max to the centers of the first and last colors */
+	gdouble scale  = (ramp->count-1) / (ramp->count * (ramp->max - ramp->min));
+	gdouble offset = 0.5 / ramp->count - ramp->min * scale;
+
+	guint program = grits_tile_program;
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "heights"),   0);
+	glUniform1i(glGetUniformLocation(program, "mask"),      1);
+	glUniform1i(glGetUniformLocation(program, "ramp"),      2);
+	glUniform2f(glGetUniformLocation(program, "scale"),     scale, offset);
+	glUniform1f(glGetUniformLocation(program, "hillshade"), ramp->hillshade);
+	return TRUE;
+}
+
+/* Stop colouring elevation tiles */
+static void _grits_tile_end_ramp(void)
+{
+	glUseProgram(0);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_1D, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/* Set the sample spacing of an elevation tile for the hillshade, the slope
+ * is measured across two samples */
+static void _grits_tile_set_spacing(GritsTile *tile)
+{
+	gdouble lat = (tile->edge.n + tile->edge.s) / 2;
+	gdouble dx  = 2 * ll2m((tile->edge.e - tile->edge.w) / tile->width, lat);
+	gdouble dy  = 2 * (tile->edge.n - tile->edge.s) / tile->height * EARTH_C / 360;
+	guint program = grits_tile_program;
+	glUniform2f(glGetUniformLocation(program, "texel"),
+			1.0 / tile->width, 1.0 / tile->height);
+	glUniform2f(glGetUniformLocation(program, "spacing"), dx, dy);
+}
+
 /* Load the texture from saved pixel data */
 static gboolean _grits_tile_load_tex(GritsTile *tile)
 {
@@ -504,8 +1148,18 @@ static gboolean _grits_tile_load_tex(GritsTile *tile)
 
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, 4, tile->width, tile->height, 0,
-			(tile->alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, pixels);
+	if (tile->elevation) {
+		/* Map signed samples from -1..1 to 0..1, -32768 becomes 0 */
+		glPixelTransferf(GL_RED_SCALE, 0.5);
+		glPixelTransferf(GL_RED_BIAS,  0.5);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE16, tile->width, tile->height, 0,
+				GL_LUMINANCE, GL_SHORT, pixels);
+		glPixelTransferf(GL_RED_SCALE, 1.0);
+		glPixelTransferf(GL_RED_BIAS,  0.0);
+	} else {
+		glTexImage2D(GL_TEXTURE_2D, 0, 4, tile->width, tile->height, 0,
+				(tile->alpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, pixels);
+	}
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -525,32 +1179,40 @@ static gboolean _grits_tile_load_tex(GritsTile *tile)
 
 }
 
-/* Draw a single tile */
-static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *triangles)
+/* Draw a single tile, or the part of it inside edge. The texture coordinates
+ * for edge are given by coords and the mask clips everything outside edge. */
+static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *triangles,
+		GritsBounds *edge, GritsBounds *coords)
 {
 	if (!tile || !tile->tex)
 		return;
 	if (!triangles)
 		g_warning("GritsOpenGL: _draw_tiles - No triangles to draw: edges=%f,%f,%f,%f",
-			tile->edge.n, tile->edge.s, tile->edge.e, tile->edge.w);
+			edge->n, edge->s, edge->e, edge->w);
 
 	//g_message("drawing %4d triangles for tile edges=%7.2f,%7.2f,%7.2f,%7.2f",
-	//		g_list_length(triangles), tile->edge.n, tile->edge.s, tile->edge.e, tile->edge.w);
+	//		g_list_length(triangles), edge->n, edge->s, edge->e, edge->w);
 	tile->atime = time(NULL);
 
-	gdouble n = tile->edge.n;
-	gdouble s = tile->edge.s;
-	gdouble e = tile->edge.e;
-	gdouble w = tile->edge.w;
+	gdouble n = edge->n;
+	gdouble s = edge->s;
+	gdouble e = edge->e;
+	gdouble w = edge->w;
 
 	gdouble londist = e - w;
 	gdouble latdist = n - s;
 
-	gdouble xscale = tile->coords.e - tile->coords.w;
-	gdouble yscale = tile->coords.s - tile->coords.n;
+	gdouble xscale = coords->e - coords->w;
+	gdouble yscale = coords->s - coords->n;
 
 	glPolygonOffset(0, -tile->zindex);
 
+	if (tile->elevation && grits_tile_shading)
+		_grits_tile_set_spacing(tile);
+
+	glBindTexture(GL_TEXTURE_2D, tile->tex);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glBegin(GL_TRIANGLES);
 	for (GList *cur = triangles; cur; cur = cur->next) {
 		RoamTriangle *tri = cur->data;
 
@@ -563,45 +1225,76 @@ static void grits_tile_draw_one(GritsTile *tile, GritsOpenGL *opengl, GList *tri
 			if (lon[2] > 90) lon[2] -= 360;
 		}
 
+		/* Mask coordinates, 0-1 across edge */
 		gdouble xy[3][2] = {
 			{(lon[0]-w)/londist, 1-(lat[0]-s)/latdist},
 			{(lon[1]-w)/londist, 1-(lat[1]-s)/latdist},
 			{(lon[2]-w)/londist, 1-(lat[2]-s)/latdist},
 		};
 
-		//if ((lat[0] == 90 && (xy[0][0] < 0 || xy[0][0] > 1)) ||
-		//    (lat[1] == 90 && (xy[1][0] < 0 || xy[1][0] > 1)) ||
-		//    (lat[2] == 90 && (xy[2][0] < 0 || xy[2][0] > 1)))
-		//	g_message("w,e=%4.f,%4.f   "
-		//	          "lat,lon,x,y="
-		//	          "%4.1f,%4.0f,%4.2f,%4.2f   "
-		//	          "%4.1f,%4.0f,%4.2f,%4.2f   "
-		//	          "%4.1f,%4.0f,%4.2f,%4.2f   ",
-		//		w,e,
-		//		lat[0], lon[0], xy[0][0], xy[0][1],
-		//		lat[1], lon[1], xy[1][0], xy[1][1],
-		//		lat[2], lon[2], xy[2][0], xy[2][1]);
-
 		/* Fix poles */
 		if (lat[0] == 90 || lat[0] == -90) xy[0][0] = 0.5;
 		if (lat[1] == 90 || lat[1] == -90) xy[1][0] = 0.5;
 		if (lat[2] == 90 || lat[2] == -90) xy[2][0] = 0.5;
 
 		/* Scale to tile coords */
+		gdouble st[3][2];
 		for (int i = 0; i < 3; i++) {
-			xy[i][0] = tile->coords.w + xy[i][0]*xscale;
-			xy[i][1] = tile->coords.n + xy[i][1]*yscale;
+			st[i][0] = coords->w + xy[i][0]*xscale;
+			st[i][1] = coords->n + xy[i][1]*yscale;
 		}
 
 		/* Draw triangle */
-		glBindTexture(GL_TEXTURE_2D, tile->tex);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-		glBegin(GL_TRIANGLES);
-		glNormal3dv(tri->p.r->norm); glMultiTexCoord2dv(GL_TEXTURE0, xy[0]); glMultiTexCoord2dv(GL_TEXTURE1, xy[0]); glVertex3dv((double*)tri->p.r);
-		glNormal3dv(tri->p.m->norm); glMultiTexCoord2dv(GL_TEXTURE0, xy[1]); glMultiTexCoord2dv(GL_TEXTURE1, xy[1]); glVertex3dv((double*)tri->p.m);
-		glNormal3dv(tri->p.l->norm); glMultiTexCoord2dv(GL_TEXTURE0, xy[2]); glMultiTexCoord2dv(GL_TEXTURE1, xy[2]); glVertex3dv((double*)tri->p.l);
-		glEnd();
+		glNormal3dv(tri->p.r->norm); glMultiTexCoord2dv(GL_TEXTURE0, st[0]); glMultiTexCoord2dv(GL_TEXTURE1, xy[0]); glVertex3dv((double*)tri->p.r);
+		glNormal3dv(tri->p.m->norm); glMultiTexCoord2dv(GL_TEXTURE0, st[1]); glMultiTexCoord2dv(GL_TEXTURE1, xy[1]); glVertex3dv((double*)tri->p.m);
+		glNormal3dv(tri->p.l->norm); glMultiTexCoord2dv(GL_TEXTURE0, st[2]); glMultiTexCoord2dv(GL_TEXTURE1, xy[2]); glVertex3dv((double*)tri->p.l);
 	}
+	glEnd();
+}
+
+/* Draw the part of a tile that is covered by a child */
+static void grits_tile_draw_quad(GritsTile *tile, GritsOpenGL *opengl,
+		gint row, gint col)
+{
+	/* Area covered by the child, matching _grits_tile_split */
+	GritsBounds edge;
+	if (tile->children[row][col]) {
+		edge = tile->children[row][col]->edge;
+	} else {
+		gdouble n = tile->edge.n;
+		gdouble s = tile->edge.s;
+		if (tile->proj == GRITS_PROJ_MERCATOR) {
+			n = asinh(tan(deg2rad(n)));
+			s = asinh(tan(deg2rad(s)));
+		}
+		gdouble lat_step = (n - s) / G_N_ELEMENTS(tile->children);
+		gdouble lon_step = (tile->edge.e - tile->edge.w) /
+		                   G_N_ELEMENTS(tile->children[0]);
+		edge.n = n - lat_step*(row+0);
+		edge.s = n - lat_step*(row+1);
+		edge.e = tile->edge.w + lon_step*(col+1);
+		edge.w = tile->edge.w + lon_step*(col+0);
+		if (tile->proj == GRITS_PROJ_MERCATOR) {
+			edge.n = rad2deg(atan(sinh(edge.n)));
+			edge.s = rad2deg(atan(sinh(edge.s)));
+		}
+	}
+
+	/* Part of the tile's texture used by the child */
+	const GritsBounds *quad = &grits_tile_quad_table[row][col];
+	gdouble xscale = tile->coords.e - tile->coords.w;
+	gdouble yscale = tile->coords.s - tile->coords.n;
+	GritsBounds coords = {
+		.n = tile->coords.n + quad->n*yscale,
+		.s = tile->coords.n + quad->s*yscale,
+		.e = tile->coords.w + quad->e*xscale,
+		.w = tile->coords.w + quad->w*xscale,
+	};
+
+	GList *triangles = roam_sphere_get_intersect(opengl->sphere, FALSE,
+			edge.n, edge.s, edge.e, edge.w);
+	grits_tile_draw_one(tile, opengl, triangles, &edge, &coords);
+	g_list_free(triangles);
 }
 
 /* Draw the tile */
@@ -615,20 +1308,26 @@ static gboolean grits_tile_draw_rec(GritsTile *tile, GritsOpenGL *opengl)
 	if (!_grits_tile_load_tex(tile))
 		return FALSE;
 
-	GritsTile *child = NULL;
-
 	/* Draw child tiles */
-	gboolean draw_parent = FALSE;
-	grits_tile_foreach(tile, child)
-		if (!grits_tile_draw_rec(child, opengl))
-			draw_parent = TRUE;
+	int row, col;
+	gint drawn = 0, total = 0;
+	gboolean missing[G_N_ELEMENTS(tile->children)][G_N_ELEMENTS(tile->children[0])];
+	grits_tile_foreach_index(tile, row, col) {
+		missing[row][col] = !grits_tile_draw_rec(tile->children[row][col], opengl);
+		drawn += !missing[row][col];
+		total += 1;
+	}
 
-	/* Draw parent tile underneath using depth test */
-	if (draw_parent) {
+	/* Draw the parent tile only where children are missing */
+	if (drawn == 0) {
 		GList *triangles = roam_sphere_get_intersect(opengl->sphere, FALSE,
 				tile->edge.n, tile->edge.s, tile->edge.e, tile->edge.w);
-		grits_tile_draw_one(tile, opengl, triangles);
+		grits_tile_draw_one(tile, opengl, triangles, &tile->edge, &tile->coords);
 		g_list_free(triangles);
+	} else if (drawn < total) {
+		grits_tile_foreach_index(tile, row, col)
+			if (missing[row][col])
+				grits_tile_draw_quad(tile, opengl, row, col);
 	}
 
 	return TRUE;
@@ -661,9 +1360,17 @@ static void grits_tile_draw(GritsObject *tile, GritsOpenGL *opengl)
 		glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, material_emission);
 	}
 
+	/* Colour elevation tiles, without shaders they are drawn in greyscale */
+	GritsTileRamp *ramp = GRITS_TILE(tile)->ramp;
+	grits_tile_shading = ramp && _grits_tile_begin_ramp(ramp);
+
 	/* Draw all tiles */
 	grits_tile_draw_rec(GRITS_TILE(tile), opengl);
 
+	if (grits_tile_shading)
+		_grits_tile_end_ramp();
+	grits_tile_shading = FALSE;
+
 	/* Disable texture mask */
 	glActiveTexture(GL_TEXTURE1);
 	glDisable(GL_TEXTURE_2D);
@@ -677,9 +1384,25 @@ static void grits_tile_init(GritsTile *tile)
 {
 }
 
+static void grits_tile_finalize(GObject *_tile)
+{
+	GritsTile *tile = GRITS_TILE(_tile);
+	_grits_tile_index_remove(tile);
+	_grits_tile_index_unref(tile->index);
+	if (tile->ramp) {
+		if (tile->ramp->tex)
+			glDeleteTextures(1, &tile->ramp->tex);
+		g_free(tile->ramp->colors);
+		g_free(tile->ramp);
+	}
+	G_OBJECT_CLASS(grits_tile_parent_class)->finalize(_tile);
+}
+
 static void grits_tile_class_init(GritsTileClass *klass)
 {
 	g_debug("GritsTile: class_init");
-	GritsObjectClass *object_class = GRITS_OBJECT_CLASS(klass);
-	object_class->draw = grits_tile_draw;
+	GObjectClass     *gobject_class = G_OBJECT_CLASS(klass);
+	GritsObjectClass *object_class  = GRITS_OBJECT_CLASS(klass);
+	gobject_class->finalize = grits_tile_finalize;
+	object_class->draw      = grits_tile_draw;
 }
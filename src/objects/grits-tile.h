@@ -29,8 +29,14 @@
 #define GRITS_IS_TILE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE   ((klass), GRITS_TYPE_TILE))
 #define GRITS_TILE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),   GRITS_TYPE_TILE, GritsTileClass))
 
+/* Deepest level which tiles can be found at, limited by the number of bits
+ * available in the tile keys */
+#define GRITS_TILE_MAX_LEVEL 29
+
 typedef struct _GritsTile      GritsTile;
 typedef struct _GritsTileClass GritsTileClass;
+typedef struct _GritsTileIndex GritsTileIndex;
+typedef struct _GritsTileRamp  GritsTileRamp;
 
 struct _GritsTile {
 	GritsObject  parent_instance;
@@ -38,6 +44,7 @@ struct _GritsTile {
 	/* Pointer to the tile data */
 	gpointer data;
 	gboolean load;
+	gboolean prefetch; /* Loaded ahead of time, low priority */
 
 	/* Drawing order */
 	gint zindex;
@@ -52,6 +59,13 @@ struct _GritsTile {
 	GritsTile *parent;
 	GritsTile *children[2][2];
 
+	/* Location in the tree, x and y count tiles from the
+	 * north-west corner of the root at the given level */
+	guint           level;
+	guint           x, y;
+	guint64         key;
+	GritsTileIndex *index;
+
 	/* Last access time (for garbage collection) */
 	time_t atime;
 
@@ -65,6 +79,10 @@ struct _GritsTile {
 	gint       width;
 	gint       height;
 	gint       alpha;
+	gboolean   elevation; /* pixels holds 16 bit elevation samples */
+
+	/* Colour ramp for elevation tiles, only used on the root tile */
+	GritsTileRamp *ramp;
 };
 
 struct _GritsTileClass {
@@ -78,6 +96,9 @@ struct _GritsTileClass {
  *
  * Used to load the image data associated with a tile. For GritsOpenGL, this
  * function should store the OpenGL texture number in the tiles data field.
+ *
+ * If the load flag of @tile is already set the tile was prefetched and is now
+ * needed for the view, so its load should no longer be held back.
  */
 typedef void (*GritsTileLoadFunc)(GritsTile *tile, gpointer user_data);
 
@@ -90,6 +111,17 @@ typedef void (*GritsTileLoadFunc)(GritsTile *tile, gpointer user_data);
  */
 typedef void (*GritsTileFreeFunc)(GritsTile *tile, gpointer user_data);
 
+/**
+ * GritsTileResFunc:
+ * @edge:      the area covered by the tile
+ * @user_data: data passed to the function
+ *
+ * Used to find the most detailed resolution available within an area
+ *
+ * Returns: the resolution in meters per pixel
+ */
+typedef gdouble (*GritsTileResFunc)(GritsBounds *edge, gpointer user_data);
+
 /* Forech functions */
 /**
  * grits_tile_foreach:
@@ -124,19 +156,47 @@ GType grits_tile_get_type(void);
 GritsTile *grits_tile_new(GritsTile *parent,
 	gdouble n, gdouble s, gdouble e, gdouble w);
 
+/* Limit the resolution of some tiles further */
+void grits_tile_set_res_func(GritsTile *root, GritsTileResFunc res_func,
+		gpointer user_data);
+
 /* Return a string representation of the tile's path */
 gchar *grits_tile_get_path(GritsTile *child);
 
 /* Update a root tile */
-/* Based on eye distance */
-void grits_tile_update(GritsTile *root, GritsPoint *eye,
+/* Based on eye distance and visibility */
+void grits_tile_update(GritsTile *root, GritsPoint *eye, GritsFrustum *frustum,
 		gdouble res, gint width, gint height,
 		GritsTileLoadFunc load_func, gpointer user_data);
 
+/* Load tiles which will be needed soon */
+gint grits_tile_prefetch(GritsTile *root, GritsPoint *eye, GritsFrustum *frustum,
+		gdouble res, gint width, gint height, gint budget,
+		GritsTileLoadFunc load_func, gpointer user_data);
+
+/* Load tiles along the path the camera is moving */
+gint grits_tile_prefetch_ahead(GritsTile *root, GritsViewer *viewer,
+		GritsPoint *eye, gdouble seconds, gint budget,
+		gdouble res, gint width, gint height,
+		GritsTileLoadFunc load_func, gpointer user_data);
+
+/* Find the tiles covering an area */
+gint grits_tile_enumerate(GritsTile *root, GritsBounds *bounds,
+		guint min_level, guint max_level,
+		GritsTileLoadFunc func, gpointer user_data);
+
 /* Load tile data from pixel buffer */
 gboolean grits_tile_load_pixels(GritsTile *tile, guchar *pixels,
 		gint width, gint height, gint channels);
 
+/* Load tile data from elevation samples */
+gboolean grits_tile_load_elevation(GritsTile *tile, const gint16 *samples,
+		gint width, gint height, gint stride);
+
+/* Set the colour ramp used to draw elevation tiles */
+void grits_tile_set_ramp(GritsTile *root, const guchar *colors, gint count,
+		gdouble min, gdouble max, gdouble hillshade);
+
 /* Load tile data from a GdkPixbuf */
 gboolean grits_tile_load_pixbuf(GritsTile *tile, GdkPixbuf *pixbuf);
 
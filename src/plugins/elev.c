@@ -21,12 +21,17 @@
  *
  * #GritsPluginElev provides access to ground elevation. It does this in two ways:
  * First, it provides a height function used by the viewer when drawing the
- * world. Second, it can load the elevation data into an image and draw a
- * greyscale elevation overlay on the planets surface.
+ * world. Second, it can load the elevation data into a texture and draw a
+ * coloured and hillshaded elevation overlay on the planets surface.
+ *
+ * Elevation data is downloaded for the whole world. Local elevation files,
+ * which are usually more detailed, can be added with
+ * grits_plugin_elev_add_file() or the elev/files preference and are merged
+ * into the downloaded data wherever they have samples.
  */
 
+#include <math.h>
 #include <time.h>
-#include <glib/gstdio.h>
 
 #include <grits.h>
 
@@ -40,139 +45,365 @@
 #define MAX_RESOLUTION 50
 #define TILE_WIDTH     1024
 #define TILE_HEIGHT    512
-#define TILE_CHANNELS  4
+#define METATILE       2
 #define TILE_SIZE      (TILE_WIDTH*TILE_HEIGHT*sizeof(guint16))
 
+/* Colour ramp for elevation textures, spaced evenly from RAMP_MIN to
+ * RAMP_MAX meters */
+#define RAMP_MIN      -500
+#define RAMP_MAX       5500
+
+static const guchar elev_ramp[][4] = {
+	{0x20, 0x40, 0x90, 0xff}, /* -500 */
+	{0x40, 0x80, 0x40, 0xff}, /*    0 */
+	{0x70, 0xa0, 0x50, 0xff}, /*  500 */
+	{0xb0, 0xc0, 0x70, 0xff}, /* 1000 */
+	{0xd0, 0xc0, 0x80, 0xff}, /* 1500 */
+	{0xc0, 0xa0, 0x70, 0xff}, /* 2000 */
+	{0xa0, 0x80, 0x60, 0xff}, /* 2500 */
+	{0x90, 0x70, 0x60, 0xff}, /* 3000 */
+	{0xa0, 0x90, 0x88, 0xff}, /* 3500 */
+	{0xc0, 0xb8, 0xb0, 0xff}, /* 4000 */
+	{0xe0, 0xe0, 0xe0, 0xff}, /* 4500 */
+	{0xf0, 0xf0, 0xf0, 0xff}, /* 5000 */
+	{0xff, 0xff, 0xff, 0xff}, /* 5500 */
+};
+
+/* Prefetch constants */
+#define PREFETCH_TIME  0.5
+#define PREFETCH_QUEUE 4
+
+/* The height and range functions are called from the loader threads as well
+ * as the main thread, the tiles lock keeps the grids from being freed by
+ * grits_tile_gc while they are used */
 static gdouble _height_func(gdouble lat, gdouble lon, gpointer _elev)
 {
 	GritsPluginElev *elev = _elev;
 	if (!elev) return 0;
 
+	g_rw_lock_reader_lock(&elev->tiles_lock);
 	GritsTile *tile = grits_tile_find(elev->tiles, lat, lon);
-	if (!tile) return 0;
+	gdouble height = tile && tile->data ?
+		grits_dem_sample(tile->data, lat, lon) : 0;
+	g_rw_lock_reader_unlock(&elev->tiles_lock);
 
-	guint16 *bil = tile->data;
-	if (!bil)  return 0;
+	return height;
+}
 
-	gint w = TILE_WIDTH;
-	gint h = TILE_HEIGHT;
+/* Called with the tiles lock held */
+static GritsDem *_find_dem(gdouble lat, gdouble lon, gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	GritsTile *tile = grits_tile_find(elev->tiles, lat, lon);
+	return tile ? tile->data : NULL;
+}
 
-	gdouble ymin  = tile->edge.s;
-	gdouble ymax  = tile->edge.n;
-	gdouble xmin  = tile->edge.w;
-	gdouble xmax  = tile->edge.e;
+/* Find the range of an area from the most detailed tiles which cover it,
+ * called with the tiles lock held */
+static gboolean _tile_range(GritsTile *tile, GritsBounds *bounds,
+		gdouble *min, gdouble *max)
+{
+	if (!tile || bounds->n < tile->edge.s || bounds->s > tile->edge.n ||
+	             bounds->e < tile->edge.w || bounds->w > tile->edge.e)
+		return TRUE;
+
+	gboolean covered = TRUE;
+	gdouble  cmin = G_MAXDOUBLE, cmax = -G_MAXDOUBLE;
+	for (int r = 0; r < 2; r++)
+	for (int c = 0; c < 2; c++)
+		if (!tile->children[r][c] || !_tile_range(tile->children[r][c],
+					bounds, &cmin, &cmax))
+			covered = FALSE;
+	if (!covered && (!tile->data || !grits_dem_get_range(tile->data,
+					bounds, &cmin, &cmax)))
+		return FALSE;
+
+	*min = MIN(*min, cmin);
+	*max = MAX(*max, cmax);
+	return TRUE;
+}
 
-	gdouble xdist = xmax - xmin;
-	gdouble ydist = ymax - ymin;
+static gboolean _range_func(GritsBounds *bounds, gdouble *min, gdouble *max,
+		gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	gdouble rmin = G_MAXDOUBLE, rmax = -G_MAXDOUBLE;
+	g_rw_lock_reader_lock(&elev->tiles_lock);
+	gboolean found = _tile_range(elev->tiles, bounds, &rmin, &rmax);
+	g_rw_lock_reader_unlock(&elev->tiles_lock);
+	if (!found || rmin > rmax)
+		return FALSE;
+	*min = rmin;
+	*max = rmax;
+	return TRUE;
+}
 
-	gdouble x =    (lon-xmin)/xdist  * w;
-	gdouble y = (1-(lat-ymin)/ydist) * h;
+/* Fill in the padding of a new grid and of the neighbors to the west and
+ * north whose padding comes from it. This is called with the tiles lock held
+ * for writing. The areas of the neighbors whose heights changed are stored in
+ * changed and the number of them is returned. */
+static gint _set_padding(GritsPluginElev *elev, GritsDem *dem,
+		GritsBounds changed[3])
+{
+	gdouble dx  = 0.5 / dem->xscale;
+	gdouble dy  = 0.5 / dem->yscale;
+	gdouble lat = (dem->edge.n + dem->edge.s) / 2;
+	gdouble lon = (dem->edge.e + dem->edge.w) / 2;
+	grits_dem_set_padding(dem, _find_dem, elev);
+
+	GritsDem *west   = _find_dem(lat, dem->edge.w - dx, elev);
+	GritsDem *north  = _find_dem(dem->edge.n + dy, lon, elev);
+	GritsDem *corner = _find_dem(dem->edge.n + dy, dem->edge.w - dx, elev);
+	gint found = 0;
+	if (west && fabs(west->edge.e - dem->edge.w) < dx) {
+		grits_dem_set_padding(west, _find_dem, elev);
+		grits_bounds_set_bounds(&changed[found++],
+				west->edge.n, west->edge.s,
+				west->edge.e, west->edge.e - 1/west->xscale);
+	}
+	if (north && fabs(north->edge.s - dem->edge.n) < dy) {
+		grits_dem_set_padding(north, _find_dem, elev);
+		grits_bounds_set_bounds(&changed[found++],
+				north->edge.s + 1/north->yscale, north->edge.s,
+				north->edge.e, north->edge.w);
+	}
+	if (corner && corner != west && corner != north &&
+	    fabs(corner->edge.e - dem->edge.w) < dx &&
+	    fabs(corner->edge.s - dem->edge.n) < dy) {
+		grits_dem_set_padding(corner, _find_dem, elev);
+		grits_bounds_set_bounds(&changed[found++],
+				corner->edge.s + 1/corner->yscale, corner->edge.s,
+				corner->edge.e, corner->edge.e - 1/corner->xscale);
+	}
+	return found;
+}
+
+/* Local elevation files */
+struct _ElevFile {
+	GritsDemFile *file;
+	gint          priority;
+};
+
+static gint _file_compare(gconstpointer _a, gconstpointer _b)
+{
+	const struct _ElevFile *a = _a, *b = _b;
+	return a->priority - b->priority;
+}
+
+static void _file_free(gpointer _file)
+{
+	struct _ElevFile *file = _file;
+	grits_dem_file_close(file->file);
+	g_free(file);
+}
 
-	gdouble x_rem = x - (int)x;
-	gdouble y_rem = y - (int)y;
-	guint x_flr = (int)x;
-	guint y_flr = (int)y;
+/* Check if any local file overlaps an area */
+static gboolean _check_files(GritsPluginElev *elev, GritsBounds *edge)
+{
+	gboolean overlap = FALSE;
+	g_mutex_lock(&elev->files_lock);
+	for (GList *cur = elev->files; cur && !overlap; cur = cur->next) {
+		GritsBounds *fedge = &((struct _ElevFile*)cur->data)->file->edge;
+		overlap = !(fedge->n < edge->s || fedge->s > edge->n ||
+		            fedge->e < edge->w || fedge->w > edge->e);
+	}
+	g_mutex_unlock(&elev->files_lock);
+	return overlap;
+}
+
+/* Merge the local files into a grid, files with a higher priority are
+ * merged last so that they replace the others */
+static void _fill_files(GritsPluginElev *elev, GritsDem *dem)
+{
+	g_mutex_lock(&elev->files_lock);
+	for (GList *cur = elev->files; cur; cur = cur->next) {
+		struct _ElevFile *file = cur->data;
+		gint count = grits_dem_fill(dem, file->file);
+		if (count)
+			g_debug("GritsPluginElev: _fill_files - %d samples from %p",
+					count, file);
+	}
+	g_mutex_unlock(&elev->files_lock);
+}
 
-	//if (lon == 180 || lon == -180)
-	//	g_message("lon=%f w=%d min=%f max=%f dist=%f x=%f rem=%f flr=%d",
-	//	           lon,   w,  xmin,  xmax,  xdist,   x, x_rem, x_flr);
+/* Check if a local file has samples for all of an area, so that it does not
+ * need to be downloaded. Only the file extents and the samples under the area
+ * are checked, areas covered by several files together are still downloaded */
+static gboolean _files_complete(GritsPluginElev *elev, GritsBounds *edge)
+{
+	gboolean complete = FALSE;
+	g_mutex_lock(&elev->files_lock);
+	for (GList *cur = elev->files; cur && !complete; cur = cur->next)
+		complete = grits_dem_file_covers(
+				((struct _ElevFile*)cur->data)->file, edge);
+	g_mutex_unlock(&elev->files_lock);
+	return complete;
+}
 
-	/* TODO: Fix interpolation at edges:
-	 *   - Pad these at the edges instead of wrapping/truncating
-	 *   - Figure out which pixels to index (is 0,0 edge, center, etc) */
-	gint16 px00 = bil[MIN((y_flr  ),h-1)*w + MIN((x_flr  ),w-1)];
-	gint16 px10 = bil[MIN((y_flr  ),h-1)*w + MIN((x_flr+1),w-1)];
-	gint16 px01 = bil[MIN((y_flr+1),h-1)*w + MIN((x_flr  ),w-1)];
-	gint16 px11 = bil[MIN((y_flr+1),h-1)*w + MIN((x_flr+1),w-1)];
+/* Local files may be more detailed than the downloaded tiles, so the tiles
+ * which overlap them can be split further */
+static gdouble _tile_resolution(GritsBounds *edge, gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	gdouble res = MAX_RESOLUTION;
+	g_mutex_lock(&elev->files_lock);
+	for (GList *cur = elev->files; cur; cur = cur->next) {
+		GritsDemFile *file = ((struct _ElevFile*)cur->data)->file;
+		if (file->edge.n < edge->s || file->edge.s > edge->n ||
+		    file->edge.e < edge->w || file->edge.w > edge->e)
+			continue;
+		gdouble lat = (MIN(file->edge.n, edge->n) +
+		               MAX(file->edge.s, edge->s)) / 2;
+		res = MIN(res, ll2m(1/file->xscale, lat));
+	}
+	g_mutex_unlock(&elev->files_lock);
+	return res;
+}
 
-	return px00 * (1-x_rem) * (1-y_rem) +
-	       px10 * (  x_rem) * (1-y_rem) +
-	       px01 * (1-x_rem) * (  y_rem) +
-	       px11 * (  x_rem) * (  y_rem);
+/* Most detailed resolution available at a point */
+static gdouble _get_resolution(GritsPluginElev *elev, gdouble lat, gdouble lon)
+{
+	gdouble res = MAX_RESOLUTION;
+	g_mutex_lock(&elev->files_lock);
+	for (GList *cur = elev->files; cur; cur = cur->next) {
+		GritsDemFile *file = ((struct _ElevFile*)cur->data)->file;
+		if (file->edge.n >= lat && lat >= file->edge.s &&
+		    file->edge.e >= lon && lon >= file->edge.w)
+			res = MIN(res, ll2m(1/file->xscale, lat));
+	}
+	g_mutex_unlock(&elev->files_lock);
+	return res;
 }
 
 /**********************
  * Loader and Freeers *
  **********************/
 
-static guint16 *_load_bil(gchar *path)
+/* Copy the BIL data into a padded grid, tiles which have been compacted are
+ * decoded instead. The height function only ever samples the grid, so the
+ * fetched data is released as soon as the grid has been made. */
+static GritsDem *_load_bil(GritsTile *tile, GBytes *bytes)
 {
 	gsize len;
-	gchar *data = NULL;
-	g_file_get_contents(path, &data, &len, NULL);
-	g_debug("GritsPluginElev: load_bil %p", data);
-	if (len != TILE_SIZE) {
+	gconstpointer data = g_bytes_get_data(bytes, &len);
+	if (len == TILE_SIZE)
+		return grits_dem_new(&tile->edge, TILE_WIDTH, TILE_HEIGHT, data);
+
+	GritsDem *dem = grits_dem_decode(&tile->edge, data, len);
+	if (!dem || dem->width != TILE_WIDTH || dem->height != TILE_HEIGHT) {
 		g_warning("GritsPluginElev: _load_bil - unexpected tile size %ld, != %ld",
 				(glong)len, (glong)TILE_SIZE);
-		g_free(data);
+		if (dem)
+			grits_dem_free(dem);
 		return NULL;
 	}
-	return (guint16*)data;
+	return dem;
 }
 
-static guchar *_load_pixels(guint16 *bil)
+/* Replace a raw BIL tile in the cache with the compact format */
+static void _compact_bil(GritsPluginElev *elev, GritsTile *tile, GritsDem *dem)
 {
-	g_assert(TILE_CHANNELS == 4);
+	GBytes *compact = grits_dem_encode(dem);
+	if (!compact)
+		return;
+	gsize len;
+	gconstpointer data = g_bytes_get_data(compact, &len);
+	grits_wms_store(elev->wms, tile, data, len);
+	g_bytes_unref(compact);
+}
 
-	guchar (*pixels)[TILE_WIDTH][TILE_CHANNELS]
-		= g_malloc0(TILE_HEIGHT * TILE_WIDTH * TILE_CHANNELS);
+static void _free_bil(GritsTile *tile, gpointer _elev)
+{
+	if (tile->data)
+		grits_dem_free(tile->data);
+	tile->data = NULL;
+}
 
-	for (int r = 0; r < TILE_HEIGHT; r++) {
-		for (int c = 0; c < TILE_WIDTH; c++) {
-			gint16 value = bil[r*TILE_WIDTH + c];
-			guchar color = (float)value/8848 * 255;
-			//guchar color = (float)(MAX(value,0))/8848 * 255;
-			pixels[r][c][0] = color;
-			pixels[r][c][1] = color;
-			pixels[r][c][2] = color;
-			pixels[r][c][3] = 0xff;
-		}
+static gpointer _fetch_tile_thread(gpointer _tile, gpointer _elev)
+{
+	GritsTile       *tile = _tile;
+	GritsPluginElev *elev = _elev;
+
+	g_debug("GritsPluginElev: _fetch_tile_thread %p - tile=%p",
+			g_thread_self(), tile);
+	if (elev->aborted) {
+		g_debug("GritsPluginElev: _fetch_tile_thread - aborted");
+		return NULL;
 	}
 
-	g_debug("GritsPluginElev: load_pixels %p", pixels);
-	return (guchar*)pixels;
+	/* Download tile, NULL on cancel/error. Tiles which the local files have
+	 * every sample for are not downloaded, otherwise the downloaded tile is
+	 * used for the samples which the files are missing. */
+	gboolean overlap = _check_files(elev, &tile->edge);
+	GBytes *bytes = overlap && _files_complete(elev, &tile->edge) ? NULL :
+		grits_wms_fetch_bytes(elev->wms, tile, GRITS_ONCE, NULL, NULL);
+
+	/* Use the local files alone when there is no downloaded data */
+	if (!bytes && overlap)
+		bytes = g_bytes_new(NULL, 0);
+	return bytes;
 }
 
-static void _load_tile_thread(gpointer _tile, gpointer _elev)
+static void _load_tile_thread(gpointer _tile, gpointer _bytes, gpointer _elev)
 {
-	GritsTile       *tile = _tile;
-	GritsPluginElev *elev = _elev;
+	GritsTile       *tile  = _tile;
+	GBytes          *bytes = _bytes;
+	GritsPluginElev *elev  = _elev;
 
 	g_debug("GritsPluginElev: _load_tile_thread start %p - tile=%p",
 			g_thread_self(), tile);
 	if (elev->aborted) {
 		g_debug("GritsPluginElev: _load_tile_thread - aborted");
+		g_bytes_unref(bytes);
 		return;
 	}
 
-	/* Download tile */
-	gchar *path = grits_wms_fetch(elev->wms, tile, GRITS_ONCE, NULL, NULL);
-	if (!path)
-		return;
-
 	/* Load bil */
-	guint16 *bil = _load_bil(path);
-	g_free(path);
-	if (!bil)
+	GritsDem *dem = g_bytes_get_size(bytes) == 0 ?
+		grits_dem_new(&tile->edge, TILE_WIDTH, TILE_HEIGHT, NULL) :
+		_load_bil(tile, bytes);
+	gboolean  raw = g_bytes_get_size(bytes) == TILE_SIZE;
+	g_bytes_unref(bytes);
+	if (!dem)
 		return;
+	if (raw && elev->compact)
+		_compact_bil(elev, tile, dem);
+
+	/* Merge local files */
+	_fill_files(elev, dem);
 
-	/* Set hight function (TODO: from main thread?) */
+	/* Set height function, the new heights are calculated in this thread and
+	 * only copied into the mesh with the sphere lock held */
 	if (LOAD_BIL) {
-		tile->data = bil;
+		/* The tile may also have been loaded by a query */
+		GritsBounds changed[3];
+		gint        nchanged = 0;
+		g_rw_lock_writer_lock(&elev->tiles_lock);
+		gboolean loaded = tile->data != NULL;
+		if (!loaded) {
+			tile->data = dem;
+			nchanged = _set_padding(elev, dem, changed);
+		}
+		g_rw_lock_writer_unlock(&elev->tiles_lock);
+		if (loaded) {
+			grits_dem_free(dem);
+			return;
+		}
 		grits_viewer_set_height_func(elev->viewer, &tile->edge,
 				_height_func, elev, TRUE);
+		for (gint i = 0; i < nchanged; i++)
+			grits_viewer_set_height_func(elev->viewer, &changed[i],
+					_height_func, elev, TRUE);
 	}
 
-	/* Load pixels for grayscale height textures */
-	if (LOAD_TEX) {
-		guchar *pixels = _load_pixels(bil);
-		grits_tile_load_pixels(tile, pixels,
-			TILE_WIDTH, TILE_HEIGHT, TILE_CHANNELS==4);
-	}
+	/* Load samples for elevation textures, these are coloured on the GPU */
+	if (LOAD_TEX)
+		grits_tile_load_elevation(tile, dem->data,
+			dem->width, dem->height, dem->stride);
 
 	/* Free bill if we're not interested in a hight function */
 	if (!LOAD_BIL)
-		g_free(bil);
+		grits_dem_free(dem);
 
 	/* Load the GL texture from the main thread */
 	g_debug("GritsPluginElev: _load_tile_thread end %p", g_thread_self());
@@ -182,7 +413,153 @@ static void _load_tile_func(GritsTile *tile, gpointer _elev)
 {
 	g_debug("GritsPluginElev: _load_tile_func - tile=%p", tile);
 	GritsPluginElev *elev = _elev;
-	g_thread_pool_push(elev->threads, tile, NULL);
+	if (tile->load)
+		grits_loader_promote(elev->queue, tile);
+	else
+		grits_loader_push(elev->queue, tile, tile->prefetch);
+}
+
+/* Level of the most detailed tiles loaded for a point */
+static guint _get_level(GritsPluginElev *elev, gdouble lat, gdouble lon)
+{
+	gdouble res   = _get_resolution(elev, lat, lon);
+	guint   level = 0;
+	while (level < GRITS_TILE_MAX_LEVEL &&
+	       (ll2m(360.0 / (TILE_WIDTH << level), lat) > res ||
+	        180.0 / (TILE_HEIGHT << level) * EARTH_C / 360 > res))
+		level++;
+	return level;
+}
+
+/* Tiles loaded for a query, each tile is only tried once for each query so
+ * that failed downloads are not repeated. Pending is the number of tiles
+ * which have not been loaded yet, guarded by the wait lock. */
+struct _Query {
+	GritsPluginElev *elev;
+	GHashTable      *tried;
+	GritsTile       *last;
+	gint             pending;
+};
+
+struct _QueryTile {
+	GritsTile     *tile;
+	struct _Query *query;
+};
+
+static void _query_done(struct _QueryTile *job)
+{
+	GritsPluginElev *elev = job->query->elev;
+	g_mutex_lock(&elev->wait_lock);
+	job->query->pending--;
+	g_cond_broadcast(&elev->wait_cond);
+	g_mutex_unlock(&elev->wait_lock);
+	g_free(job);
+}
+
+static gpointer _fetch_query_thread(gpointer _job, gpointer _elev)
+{
+	struct _QueryTile *job = _job;
+	GBytes *bytes = _fetch_tile_thread(job->tile, _elev);
+	if (!bytes)
+		_query_done(job);
+	return bytes;
+}
+
+static void _load_query_thread(gpointer _job, gpointer _bytes, gpointer _elev)
+{
+	struct _QueryTile *job = _job;
+	_load_tile_thread(job->tile, _bytes, _elev);
+	_query_done(job);
+}
+
+/* Queue a tile for a query, called with the tiles lock held for writing */
+static void _queue_query_tile(GritsTile *tile, gpointer _query)
+{
+	struct _Query   *query = _query;
+	GritsPluginElev *elev  = query->elev;
+	query->last = tile;
+	if (tile->data || g_hash_table_contains(query->tried, tile))
+		return;
+	g_debug("GritsPluginElev: _queue_query_tile - tile=%p", tile);
+	g_hash_table_add(query->tried, tile);
+	tile->load  = TRUE;
+	tile->atime = time(NULL);
+
+	struct _QueryTile *job = g_new0(struct _QueryTile, 1);
+	job->tile  = tile;
+	job->query = query;
+	g_mutex_lock(&elev->wait_lock);
+	query->pending++;
+	g_mutex_unlock(&elev->wait_lock);
+	grits_loader_push(elev->query_queue, job, FALSE);
+}
+
+/* Load the most detailed tiles for the points through the loader and wait
+ * for them. Points inside the last tile which was queued are skipped. */
+static void _load_query_tiles(GritsPluginElev *elev,
+		const gdouble *lat, const gdouble *lon, gsize count)
+{
+	struct _Query query = {elev, g_hash_table_new(NULL, NULL)};
+
+	g_rw_lock_writer_lock(&elev->tiles_lock);
+	GritsTile *last = NULL;
+	for (gsize i = 0; i < count; i++) {
+		if (last && lat[i] <= last->edge.n && lat[i] >= last->edge.s &&
+		            lon[i] <= last->edge.e && lon[i] >= last->edge.w)
+			continue;
+		guint level = _get_level(elev, lat[i], lon[i]);
+		GritsBounds point = {lat[i] + 1e-9, lat[i] - 1e-9,
+		                     lon[i] + 1e-9, lon[i] - 1e-9};
+		query.last = NULL;
+		grits_tile_enumerate(elev->tiles, &point, level, level,
+				_queue_query_tile, &query);
+		last = query.last;
+	}
+	g_rw_lock_writer_unlock(&elev->tiles_lock);
+
+	g_mutex_lock(&elev->wait_lock);
+	while (query.pending > 0 && !elev->aborted)
+		g_cond_wait(&elev->wait_cond, &elev->wait_lock);
+	g_mutex_unlock(&elev->wait_lock);
+	g_hash_table_destroy(query.tried);
+}
+
+/* Sample runs of points which fall in the same tile together. A following
+ * point uses the same grid if it is inside a tile with no children, otherwise
+ * the tile is looked up again. */
+static gboolean _elevations_func(const gdouble *lat, const gdouble *lon,
+		gdouble *elev_out, gsize count, gboolean wait, gpointer _elev)
+{
+	GritsPluginElev *elev = _elev;
+	if (wait)
+		_load_query_tiles(elev, lat, lon, count);
+
+	gboolean found = TRUE;
+	gsize    start = 0;
+	while (start < count) {
+		g_rw_lock_reader_lock(&elev->tiles_lock);
+		GritsTile *tile = grits_tile_find(elev->tiles, lat[start], lon[start]);
+		if (!tile || !tile->data) {
+			g_rw_lock_reader_unlock(&elev->tiles_lock);
+			elev_out[start++] = 0;
+			found = FALSE;
+			continue;
+		}
+
+		gsize end = start + 1;
+		if (!tile->children[0][0] && !tile->children[0][1] &&
+		    !tile->children[1][0] && !tile->children[1][1])
+			while (end < count &&
+			       lat[end] <= tile->edge.n && lat[end] >= tile->edge.s &&
+			       lon[end] <= tile->edge.e && lon[end] >= tile->edge.w)
+				end++;
+		grits_dem_sample_many(tile->data, &lat[start], &lon[start],
+				&elev_out[start], end - start);
+		g_rw_lock_reader_unlock(&elev->tiles_lock);
+		start = end;
+	}
+
+	return found;
 }
 
 /*************
@@ -192,10 +569,29 @@ static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elevation, GritsPluginElev *elev)
 {
 	GritsPoint eye = {lat, lon, elevation};
-	grits_tile_update(elev->tiles, &eye,
+	GritsFrustum frustum;
+	gboolean culled = grits_viewer_get_frustum(viewer, lat, lon, elevation, &frustum);
+
+	/* Queries from other threads can also split the tiles */
+	g_rw_lock_writer_lock(&elev->tiles_lock);
+	grits_tile_update(elev->tiles, &eye, culled ? &frustum : NULL,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile_func, elev);
-	grits_tile_gc(elev->tiles, time(NULL)-10, NULL, elev);
+
+	/* Fetch tiles along the path the camera is moving */
+	grits_tile_prefetch_ahead(elev->tiles, viewer, &eye, PREFETCH_TIME,
+			PREFETCH_QUEUE - grits_loader_unprocessed(elev->queue),
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _load_tile_func, elev);
+	grits_tile_gc(elev->tiles, time(NULL)-10, _free_bil, elev);
+	g_rw_lock_writer_unlock(&elev->tiles_lock);
+}
+
+static void _on_rotation_changed(GritsViewer *viewer,
+		gdouble x, gdouble y, gdouble z, GritsPluginElev *elev)
+{
+	gdouble lat, lon, elevation;
+	grits_viewer_get_location(viewer, &lat, &lon, &elevation);
+	_on_location_changed(viewer, lat, lon, elevation, elev);
 }
 
 /***********
@@ -214,6 +610,17 @@ GritsPluginElev *grits_plugin_elev_new(GritsViewer *viewer)
 	g_debug("GritsPluginElev: new");
 	GritsPluginElev *elev = g_object_new(GRITS_TYPE_PLUGIN_ELEV, NULL);
 	elev->viewer = g_object_ref(viewer);
+	elev->compact = grits_prefs_get_boolean(viewer->prefs,
+			"grits/compact_elev", NULL);
+
+	/* Local files, separated by semicolons, later files take priority */
+	gchar *files = grits_prefs_get_string(viewer->prefs, "elev/files", NULL);
+	gchar **paths = files ? g_strsplit(files, ";", -1) : NULL;
+	for (gint i = 0; paths && paths[i]; i++)
+		if (*g_strstrip(paths[i]))
+			grits_plugin_elev_add_file(elev, paths[i], i);
+	g_strfreev(paths);
+	g_free(files);
 
 	/* Load initial tiles */
 	gdouble lat, lon, elevation;
@@ -223,15 +630,58 @@ GritsPluginElev *grits_plugin_elev_new(GritsViewer *viewer)
 	/* Connect signals */
 	elev->sigid = g_signal_connect(elev->viewer, "location-changed",
 			G_CALLBACK(_on_location_changed), elev);
+	elev->rot_sigid = g_signal_connect(elev->viewer, "rotation-changed",
+			G_CALLBACK(_on_rotation_changed), elev);
+
+	if (LOAD_BIL) {
+		grits_viewer_set_range_func(viewer, _range_func, elev);
+		grits_viewer_set_elevations_func(viewer, _elevations_func, elev);
+	}
 
 	/* Add renderers */
-	if (LOAD_TEX)
+	if (LOAD_TEX) {
+		gdouble hillshade = grits_prefs_get_double(viewer->prefs,
+				"elev/hillshade", NULL);
+		grits_tile_set_ramp(elev->tiles, elev_ramp[0],
+				G_N_ELEMENTS(elev_ramp), RAMP_MIN, RAMP_MAX, hillshade);
 		grits_viewer_add(viewer, GRITS_OBJECT(elev->tiles), GRITS_LEVEL_WORLD, FALSE);
+	}
 
 	return elev;
 }
 
 
+/**
+ * grits_plugin_elev_add_file:
+ * @elev:     the #GritsPluginElev
+ * @path:     the path to a BIL file, with a .hdr file next to it
+ * @priority: the priority of the file, files with a higher priority replace
+ *            the data from other files where they overlap
+ *
+ * Add a local elevation file. The file is used instead of the downloaded data
+ * wherever it has samples, tiles which it covers completely are not
+ * downloaded at all. Only tiles which are loaded after the file is added will
+ * use it.
+ *
+ * Returns: %TRUE if the file was added
+ */
+gboolean grits_plugin_elev_add_file(GritsPluginElev *elev, const gchar *path,
+		gint priority)
+{
+	g_debug("GritsPluginElev: add_file - %s", path);
+	GritsDemFile *dem = grits_dem_file_open(path);
+	if (!dem)
+		return FALSE;
+	struct _ElevFile *file = g_new0(struct _ElevFile, 1);
+	file->file     = dem;
+	file->priority = priority;
+	g_mutex_lock(&elev->files_lock);
+	elev->files = g_list_insert_sorted(elev->files, file, _file_compare);
+	g_mutex_unlock(&elev->files_lock);
+	return TRUE;
+}
+
+
 /****************
  * GObject code *
  ****************/
@@ -250,11 +700,20 @@ static void grits_plugin_elev_init(GritsPluginElev *elev)
 {
 	g_debug("GritsPluginElev: init");
 	/* Set defaults */
-	elev->threads = g_thread_pool_new(_load_tile_thread, elev, 1, FALSE, NULL);
+	elev->queue = grits_loader_queue_new(grits_loader_get_default(),
+			_fetch_tile_thread, _load_tile_thread, elev);
+	elev->query_queue = grits_loader_queue_new(grits_loader_get_default(),
+			_fetch_query_thread, _load_query_thread, elev);
 	elev->tiles = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
+	grits_tile_set_res_func(elev->tiles, _tile_resolution, elev);
 	elev->wms   = grits_wms_new(
 		"http://www.nasa.network.com/elev", "mergedSrtm", "application/bil",
 		"srtm/", "bil", TILE_WIDTH, TILE_HEIGHT);
+	grits_wms_set_metatile(elev->wms, METATILE);
+	g_mutex_init(&elev->files_lock);
+	g_rw_lock_init(&elev->tiles_lock);
+	g_mutex_init(&elev->wait_lock);
+	g_cond_init(&elev->wait_cond);
 	g_object_ref(elev->tiles);
 }
 static void grits_plugin_elev_dispose(GObject *gobject)
@@ -266,11 +725,21 @@ static void grits_plugin_elev_dispose(GObject *gobject)
 	if (elev->viewer) {
 		GritsViewer *viewer = elev->viewer;
 		g_signal_handler_disconnect(viewer, elev->sigid);
+		g_signal_handler_disconnect(viewer, elev->rot_sigid);
 		grits_http_abort(elev->wms->http);
-		g_thread_pool_free(elev->threads, TRUE, TRUE);
+		grits_loader_queue_free(elev->queue);
+		grits_loader_queue_free(elev->query_queue);
 		elev->viewer = NULL;
-		if (LOAD_BIL)
+
+		/* Wake up queries whose tiles were dropped */
+		g_mutex_lock(&elev->wait_lock);
+		g_cond_broadcast(&elev->wait_cond);
+		g_mutex_unlock(&elev->wait_lock);
+		if (LOAD_BIL) {
+			grits_viewer_set_range_func(viewer, NULL, NULL);
+			grits_viewer_set_elevations_func(viewer, NULL, NULL);
 			grits_viewer_clear_height_func(viewer);
+		}
 		if (LOAD_TEX)
 			grits_object_destroy_pointer(&elev->tiles);
 		g_object_unref(viewer);
@@ -283,7 +752,12 @@ static void grits_plugin_elev_finalize(GObject *gobject)
 	GritsPluginElev *elev = GRITS_PLUGIN_ELEV(gobject);
 	/* Free data */
 	grits_wms_free(elev->wms);
-	grits_tile_free(elev->tiles, NULL, elev);
+	grits_tile_free(elev->tiles, _free_bil, elev);
+	g_list_free_full(elev->files, _file_free);
+	g_mutex_clear(&elev->files_lock);
+	g_rw_lock_clear(&elev->tiles_lock);
+	g_mutex_clear(&elev->wait_lock);
+	g_cond_clear(&elev->wait_cond);
 	G_OBJECT_CLASS(grits_plugin_elev_parent_class)->finalize(gobject);
 
 }
@@ -37,9 +37,17 @@ struct _GritsPluginElev {
 	GritsViewer *viewer;
 	GritsTile   *tiles;
 	GritsWms    *wms;
-	GThreadPool *threads;
+	GritsLoaderQueue *queue;
+	GritsLoaderQueue *query_queue;
 	gulong       sigid;
+	gulong       rot_sigid;
 	gboolean     aborted;
+	gboolean     compact;
+	GList       *files;
+	GMutex       files_lock;
+	GRWLock      tiles_lock;
+	GMutex       wait_lock;
+	GCond        wait_cond;
 };
 
 struct _GritsPluginElevClass {
@@ -51,4 +59,7 @@ GType grits_plugin_elev_get_type();
 /* Methods */
 GritsPluginElev *grits_plugin_elev_new(GritsViewer *viewer);
 
+gboolean grits_plugin_elev_add_file(GritsPluginElev *elev, const gchar *path,
+		gint priority);
+
 #endif
@@ -24,7 +24,6 @@
  */
 
 #include <time.h>
-#include <glib/gstdio.h>
 
 #include <grits.h>
 
@@ -33,6 +32,8 @@
 #define MAX_RESOLUTION 1
 #define TILE_WIDTH     256
 #define TILE_HEIGHT    256
+#define PREFETCH_TIME  0.5
+#define PREFETCH_QUEUE 16
 
 //#define MAX_RESOLUTION 100
 //#define TILE_WIDTH     1024
@@ -46,7 +47,37 @@ static const guchar colormap[][2][4] = {
 	{{0xff, 0xe1, 0x80}, {0xff, 0xe1, 0x80, 0x60}}, // Cities
 };
 
-static void _load_tile_thread(gpointer _tile, gpointer _map)
+/* The decode stage loads tiles from the cache, so only success is passed on */
+static void _fetch_tile_done(gchar *path, gpointer _job)
+{
+	grits_loader_job_finish(_job, path ? GINT_TO_POINTER(TRUE) : NULL);
+	g_free(path);
+}
+
+static void _fetch_tile_start(gpointer _tile, GritsLoaderJob *job, gpointer _map)
+{
+	GritsTile      *tile = _tile;
+	GritsPluginMap *map  = _map;
+
+	g_debug("GritsPluginMap: _fetch_tile_start - tile=%p", tile);
+	if (map->aborted) {
+		g_debug("GritsPluginMap: _fetch_tile_start - aborted");
+		grits_loader_job_finish(job, NULL);
+		return;
+	}
+
+	/* Packed tiles don't have a file for the async fetch to find */
+	if (grits_tms_has(map->tms, tile)) {
+		grits_loader_job_finish(job, GINT_TO_POINTER(TRUE));
+		return;
+	}
+
+	/* Download tile without holding up the I/O thread */
+	grits_tms_fetch_async(map->tms, tile, GRITS_ONCE, NULL, NULL,
+			_fetch_tile_done, job);
+}
+
+static void _load_tile_thread(gpointer _tile, gpointer _ok, gpointer _map)
 {
 	GritsTile      *tile = _tile;
 	GritsPluginMap *map  = _map;
@@ -58,20 +89,23 @@ static void _load_tile_thread(gpointer _tile, gpointer _map)
 		return;
 	}
 
-	/* Download tile */
-	gchar *path = grits_tms_fetch(map->tms, tile, GRITS_ONCE, NULL, NULL);
-	//gchar *path = grits_wms_fetch(map->wms, tile, GRITS_ONCE, NULL, NULL);
-	if (!path) return; // Canceled/error
-
-	/* Load pixbuf */
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+	/* Load pixbuf from the cache, this also moves it into the pack */
+	GdkPixbuf *pixbuf = NULL;
+	GBytes    *bytes  = grits_tms_fetch_bytes(map->tms, tile, GRITS_LOCAL,
+			NULL, NULL);
+	if (bytes) {
+		gsize length;
+		gconstpointer data = g_bytes_get_data(bytes, &length);
+		GInputStream *stream = g_memory_input_stream_new_from_data(data, length, NULL);
+		pixbuf = gdk_pixbuf_new_from_stream(stream, NULL, NULL);
+		g_object_unref(stream);
+		g_bytes_unref(bytes);
+	}
 	if (!pixbuf) {
-		g_warning("GritsPluginMap: _load_tile_thread - Error loading pixbuf %s", path);
-		g_remove(path);
-		g_free(path);
+		g_warning("GritsPluginMap: _load_tile_thread - Error loading pixbuf");
+		grits_tms_discard(map->tms, tile);
 		return;
 	}
-	g_free(path);
 
 #ifdef MAP_MAP_COLORS
 	/* Map texture colors, if needed */
@@ -102,7 +136,10 @@ static void _load_tile_func(GritsTile *tile, gpointer _map)
 {
 	g_debug("GritsPluginMap: _load_tile_func - tile=%p", tile);
 	GritsPluginMap *map = _map;
-	g_thread_pool_push(map->threads, tile, NULL);
+	if (tile->load)
+		grits_loader_promote(map->queue, tile);
+	else
+		grits_loader_push(map->queue, tile, tile->prefetch);
 }
 
 /*************
@@ -112,12 +149,27 @@ static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev, GritsPluginMap *map)
 {
 	GritsPoint eye = {lat, lon, elev};
-	grits_tile_update(map->tiles, &eye,
+	GritsFrustum frustum;
+	gboolean culled = grits_viewer_get_frustum(viewer, lat, lon, elev, &frustum);
+	grits_tile_update(map->tiles, &eye, culled ? &frustum : NULL,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile_func, map);
+
+	/* Fetch tiles along the path the camera is moving */
+	grits_tile_prefetch_ahead(map->tiles, viewer, &eye, PREFETCH_TIME,
+			PREFETCH_QUEUE - grits_loader_unprocessed(map->queue),
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _load_tile_func, map);
 	grits_tile_gc(map->tiles, time(NULL)-10, NULL, map);
 }
 
+static void _on_rotation_changed(GritsViewer *viewer,
+		gdouble x, gdouble y, gdouble z, GritsPluginMap *map)
+{
+	gdouble lat, lon, elev;
+	grits_viewer_get_location(viewer, &lat, &lon, &elev);
+	_on_location_changed(viewer, lat, lon, elev, map);
+}
+
 /***********
  * Methods *
  ***********/
@@ -143,6 +195,8 @@ GritsPluginMap *grits_plugin_map_new(GritsViewer *viewer)
 	/* Connect signals */
 	map->sigid = g_signal_connect(map->viewer, "location-changed",
 			G_CALLBACK(_on_location_changed), map);
+	map->rot_sigid = g_signal_connect(map->viewer, "rotation-changed",
+			G_CALLBACK(_on_rotation_changed), map);
 
 	/* Add renderers */
 	grits_viewer_add(viewer, GRITS_OBJECT(map->tiles), GRITS_LEVEL_WORLD, FALSE);
@@ -169,7 +223,8 @@ static void grits_plugin_map_init(GritsPluginMap *map)
 {
 	g_debug("GritsPluginMap: init");
 	/* Set defaults */
-	map->threads = g_thread_pool_new(_load_tile_thread, map, 1, FALSE, NULL);
+	map->queue = grits_loader_queue_new_async(grits_loader_get_default(),
+			_fetch_tile_start, _load_tile_thread, map);
 	map->tiles = grits_tile_new(NULL, 85.0511, -85.0511, EAST, WEST);
 	map->tms   = grits_tms_new("http://tile.openstreetmap.org",
 		"osmtile/", "png");
@@ -190,9 +245,10 @@ static void grits_plugin_map_dispose(GObject *gobject)
 	if (map->viewer) {
 		GritsViewer *viewer = map->viewer;
 		g_signal_handler_disconnect(viewer, map->sigid);
+		g_signal_handler_disconnect(viewer, map->rot_sigid);
 		grits_http_abort(map->tms->http);
 		//grits_http_abort(map->wms->http);
-		g_thread_pool_free(map->threads, TRUE, TRUE);
+		grits_loader_queue_free(map->queue);
 		map->viewer = NULL;
 		grits_object_destroy_pointer(&map->tiles);
 		g_object_unref(viewer);
@@ -38,8 +38,9 @@ struct _GritsPluginMap {
 	GritsTile   *tiles;
 	GritsTms    *tms;
 	GritsWms    *wms;
-	GThreadPool *threads;
+	GritsLoaderQueue *queue;
 	gulong       sigid;
+	gulong       rot_sigid;
 	gboolean     aborted;
 };
 
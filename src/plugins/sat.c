@@ -25,7 +25,6 @@
 
 #include <time.h>
 #include <string.h>
-#include <glib/gstdio.h>
 
 #include <grits.h>
 
@@ -34,32 +33,97 @@
 #define MAX_RESOLUTION 500
 #define TILE_WIDTH     1024
 #define TILE_HEIGHT    512
+#define PREFETCH_TIME  0.5
+#define PREFETCH_QUEUE 8
 
-static void _load_tile_thread(gpointer _tile, gpointer _sat)
+struct _TileData {
+	GBytes          *bytes;
+	GdkPixbufLoader *loader;
+	gboolean         failed;
+};
+
+static gboolean _decode_chunk(gconstpointer data, gsize length, gpointer _data)
+{
+	struct _TileData *tdata = _data;
+	tdata->failed = !gdk_pixbuf_loader_write(tdata->loader, data, length, NULL);
+	return !tdata->failed;
+}
+
+static void _tile_data_free(struct _TileData *tdata)
+{
+	if (tdata->loader)
+		g_object_unref(tdata->loader);
+	g_bytes_unref(tdata->bytes);
+	g_free(tdata);
+}
+
+static gpointer _fetch_tile_thread(gpointer _tile, gpointer _sat)
 {
 	GritsTile      *tile = _tile;
 	GritsPluginSat *sat  = _sat;
 
+	g_debug("GritsPluginSat: _fetch_tile_thread %p - tile=%p",
+			g_thread_self(), tile);
+	if (sat->aborted) {
+		g_debug("GritsPluginSat: _fetch_tile_thread - aborted");
+		return NULL;
+	}
+
+	/* Download tile, NULL on cancel/error. The image is decoded while it
+	 * is downloaded, otherwise it is decoded from the cache later on */
+	struct _TileData *tdata = g_new0(struct _TileData, 1);
+	gboolean streamed = FALSE;
+	tdata->loader = gdk_pixbuf_loader_new();
+	tdata->bytes  = grits_wms_fetch_stream(sat->wms, tile, GRITS_ONCE, NULL, NULL,
+			_decode_chunk, tdata, &streamed);
+	/* A failed write has already closed the loader */
+	if (!tdata->failed && !gdk_pixbuf_loader_close(tdata->loader, NULL))
+		streamed = FALSE;
+	if (!streamed || tdata->failed) {
+		g_object_unref(tdata->loader);
+		tdata->loader = NULL;
+	}
+	if (!tdata->bytes) {
+		_tile_data_free(tdata);
+		return NULL;
+	}
+	return tdata;
+}
+
+static void _load_tile_thread(gpointer _tile, gpointer _tdata, gpointer _sat)
+{
+	GritsTile        *tile  = _tile;
+	struct _TileData *tdata = _tdata;
+	GritsPluginSat   *sat   = _sat;
+
 	g_debug("GritsPluginSat: _load_tile_thread start %p - tile=%p",
 			g_thread_self(), tile);
 	if (sat->aborted) {
 		g_debug("GritsPluginSat: _load_tile_thread - aborted");
+		_tile_data_free(tdata);
 		return;
 	}
 
-	/* Download tile */
-	gchar *path = grits_wms_fetch(sat->wms, tile, GRITS_ONCE, NULL, NULL);
-	if (!path) return; // Canceled/error
-
-	/* Load pixbuf */
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+	/* Load pixbuf, unless it was already decoded during the download */
+	GdkPixbuf *pixbuf = NULL;
+	if (tdata->loader) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf(tdata->loader);
+		if (pixbuf)
+			g_object_ref(pixbuf);
+	}
+	if (!pixbuf) {
+		gsize length;
+		gconstpointer data = g_bytes_get_data(tdata->bytes, &length);
+		GInputStream *stream = g_memory_input_stream_new_from_data(data, length, NULL);
+		pixbuf = gdk_pixbuf_new_from_stream(stream, NULL, NULL);
+		g_object_unref(stream);
+	}
+	_tile_data_free(tdata);
 	if (!pixbuf) {
-		g_warning("GritsPluginSat: _load_tile_thread - Error loading pixbuf %s", path);
-		g_remove(path);
-		g_free(path);
+		g_warning("GritsPluginSat: _load_tile_thread - Error loading pixbuf");
+		grits_wms_discard(sat->wms, tile);
 		return;
 	}
-	g_free(path);
 
 	/* Draw a border */
 #ifdef DRAW_TILE_BORDER
@@ -87,7 +151,10 @@ static void _load_tile_func(GritsTile *tile, gpointer _sat)
 {
 	g_debug("GritsPluginSat: __load_tile_func - tile=%p", tile);
 	GritsPluginSat *sat = _sat;
-	g_thread_pool_push(sat->threads, tile, NULL);
+	if (tile->load)
+		grits_loader_promote(sat->queue, tile);
+	else
+		grits_loader_push(sat->queue, tile, tile->prefetch);
 }
 
 /*************
@@ -97,12 +164,27 @@ static void _on_location_changed(GritsViewer *viewer,
 		gdouble lat, gdouble lon, gdouble elev, GritsPluginSat *sat)
 {
 	GritsPoint eye = {lat, lon, elev};
-	grits_tile_update(sat->tiles, &eye,
+	GritsFrustum frustum;
+	gboolean culled = grits_viewer_get_frustum(viewer, lat, lon, elev, &frustum);
+	grits_tile_update(sat->tiles, &eye, culled ? &frustum : NULL,
 			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH,
 			_load_tile_func, sat);
+
+	/* Fetch tiles along the path the camera is moving */
+	grits_tile_prefetch_ahead(sat->tiles, viewer, &eye, PREFETCH_TIME,
+			PREFETCH_QUEUE - grits_loader_unprocessed(sat->queue),
+			MAX_RESOLUTION, TILE_WIDTH, TILE_WIDTH, _load_tile_func, sat);
 	grits_tile_gc(sat->tiles, time(NULL)-10, NULL, sat);
 }
 
+static void _on_rotation_changed(GritsViewer *viewer,
+		gdouble x, gdouble y, gdouble z, GritsPluginSat *sat)
+{
+	gdouble lat, lon, elev;
+	grits_viewer_get_location(viewer, &lat, &lon, &elev);
+	_on_location_changed(viewer, lat, lon, elev, sat);
+}
+
 /***********
  * Methods *
  ***********/
@@ -128,6 +210,8 @@ GritsPluginSat *grits_plugin_sat_new(GritsViewer *viewer)
 	/* Connect signals */
 	sat->sigid = g_signal_connect(sat->viewer, "location-changed",
 			G_CALLBACK(_on_location_changed), sat);
+	sat->rot_sigid = g_signal_connect(sat->viewer, "rotation-changed",
+			G_CALLBACK(_on_rotation_changed), sat);
 
 	/* Add renderers */
 	grits_viewer_add(viewer, GRITS_OBJECT(sat->tiles), GRITS_LEVEL_WORLD, FALSE);
@@ -154,7 +238,8 @@ static void grits_plugin_sat_init(GritsPluginSat *sat)
 {
 	g_debug("GritsPluginSat: init");
 	/* Set defaults */
-	sat->threads = g_thread_pool_new(_load_tile_thread, sat, 1, FALSE, NULL);
+	sat->queue = grits_loader_queue_new(grits_loader_get_default(),
+			_fetch_tile_thread, _load_tile_thread, sat);
 	sat->tiles = grits_tile_new(NULL, NORTH, SOUTH, EAST, WEST);
 	sat->wms   = grits_wms_new(
 		"http://www.nasa.network.com/wms", "bmng200406", "image/jpeg",
@@ -170,8 +255,9 @@ static void grits_plugin_sat_dispose(GObject *gobject)
 	if (sat->viewer) {
 		GritsViewer *viewer = sat->viewer;
 		g_signal_handler_disconnect(viewer, sat->sigid);
+		g_signal_handler_disconnect(viewer, sat->rot_sigid);
 		grits_http_abort(sat->wms->http);
-		g_thread_pool_free(sat->threads, TRUE, TRUE);
+		grits_loader_queue_free(sat->queue);
 		sat->viewer = NULL;
 		grits_object_destroy_pointer(&sat->tiles);
 		g_object_unref(viewer);
@@ -37,8 +37,9 @@ struct _GritsPluginSat {
 	GritsViewer *viewer;
 	GritsTile   *tiles;
 	GritsWms    *wms;
-	GThreadPool *threads;
+	GritsLoaderQueue *queue;
 	gulong       sigid;
+	gulong       rot_sigid;
 	gboolean     aborted;
 };
 
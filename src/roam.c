@@ -80,6 +80,10 @@ RoamPoint *roam_point_new(gdouble lat, gdouble lon, gdouble elev)
 	point->elev = elev;
 	/* For get_intersect */
 	lle2xyz(lat, lon, elev, &point->x, &point->y, &point->z);
+	point->to[0] = point->x;
+	point->to[1] = point->y;
+	point->to[2] = point->z;
+	point->morph = 1;
 	return point;
 }
 
@@ -132,7 +136,10 @@ void roam_point_update_height(RoamPoint *point)
 		gdouble elev = point->height_func(
 				point->lat, point->lon, point->height_data);
 		lle2xyz(point->lat, point->lon, elev,
-				&point->x, &point->y, &point->z);
+				&point->to[0], &point->to[1], &point->to[2]);
+		point->x = point->to[0];
+		point->y = point->to[1];
+		point->z = point->to[2];
 	}
 }
 
@@ -205,9 +212,7 @@ RoamTriangle *roam_triangle_new(RoamPoint *l, RoamPoint *m, RoamPoint *r,
 	//		triangle->split->lat, l->lat);
 
 	/* Update normal */
-	crossd3((gdouble*)triangle->p.l,
-	        (gdouble*)triangle->p.m,
-	        (gdouble*)triangle->p.r, triangle->norm);
+	crossd3(l->to, m->to, r->to, triangle->norm);
 	normd(triangle->norm);
 
 	/* Store bounding box, for get_intersect */
@@ -272,6 +277,7 @@ void roam_triangle_add(RoamTriangle *triangle,
 	roam_point_add_triangle(triangle->p.m, triangle);
 	roam_point_add_triangle(triangle->p.r, triangle);
 
+	roam_triangle_update_deviation(triangle, sphere);
 	if (sphere->view)
 		roam_triangle_update_errors(triangle, sphere);
 
@@ -333,6 +339,125 @@ static gboolean roam_triangle_backface(RoamTriangle *triangle, RoamSphere *spher
 	return size < 0;
 }
 
+/**
+ * roam_triangle_update_normal:
+ * @triangle: the triangle
+ *
+ * Recalculate the surface normal of a triangle after the heights of its points
+ * change. If the triangle is part of the mesh the vertex normals of its points
+ * are updated as well.
+ */
+void roam_triangle_update_normal(RoamTriangle *triangle)
+{
+	gboolean leaf = !triangle->kids[0];
+	if (leaf) {
+		roam_point_remove_triangle(triangle->p.l, triangle);
+		roam_point_remove_triangle(triangle->p.m, triangle);
+		roam_point_remove_triangle(triangle->p.r, triangle);
+	}
+	crossd3(triangle->p.l->to, triangle->p.m->to, triangle->p.r->to,
+			triangle->norm);
+	normd(triangle->norm);
+	if (leaf) {
+		roam_point_add_triangle(triangle->p.l, triangle);
+		roam_point_add_triangle(triangle->p.m, triangle);
+		roam_point_add_triangle(triangle->p.r, triangle);
+	}
+}
+
+/* Distance from a point on the triangle, given by its barycentric
+ * coordinates, to the terrain above or below it */
+static gdouble _roam_triangle_residual(
+		const gdouble *l, const gdouble *m, const gdouble *r,
+		RoamHeightFunc height_func, gpointer height_data,
+		gdouble a, gdouble b, gdouble c)
+{
+	gdouble plane[3], surface[3], lat, lon, elev;
+	for (int i = 0; i < 3; i++)
+		plane[i] = a*l[i] + b*m[i] + c*r[i];
+	xyz2lle(plane[0], plane[1], plane[2], &lat, &lon, &elev);
+	elev = height_func(lat, lon, height_data);
+	lle2xyz(lat, lon, elev, &surface[0], &surface[1], &surface[2]);
+	return distd(plane, surface);
+}
+
+/**
+ * roam_triangle_calc_deviation:
+ * @l:           position of the left vertex
+ * @m:           position of the middle vertex
+ * @r:           position of the right vertex
+ * @split:       position of the split point
+ * @height_func: height function of the split point, or %NULL
+ * @height_data: user data for @height_func
+ * @n:           the northern edge of the triangle
+ * @s:           the southern edge of the triangle
+ * @e:           the eastern edge of the triangle
+ * @w:           the western edge of the triangle
+ * @sphere:      the sphere to use when finding the terrain under the triangle
+ * @deviation:   location to store the geometric error
+ * @bound:       location to store the upper bound of the error of the children
+ *
+ * Calculate the geometric error of a triangle with the given points, see
+ * roam_triangle_update_deviation(). Only the range function of @sphere is
+ * used, so this can be called without holding the lock on the mesh.
+ */
+void roam_triangle_calc_deviation(
+		const gdouble *l, const gdouble *m, const gdouble *r,
+		const gdouble *split, RoamHeightFunc height_func, gpointer height_data,
+		gdouble n, gdouble s, gdouble e, gdouble w,
+		RoamSphere *sphere, gdouble *deviation, gdouble *bound)
+{
+	gdouble mid[3] = {(l[0] + r[0])/2,
+	                  (l[1] + r[1])/2,
+	                  (l[2] + r[2])/2};
+	gdouble residual = distd(mid, (gdouble*)split);
+	*deviation = residual;
+	*bound     = residual;
+
+	gdouble min, max;
+	if (!sphere->range_func || !sphere->range_func(n, s, e, w,
+			&min, &max, sphere->range_data))
+		return;
+	*bound = residual + max - min;
+
+	/* Flat terrain can not be further from the triangle than the split */
+	if (!height_func || max - min <= residual)
+		return;
+
+	static const gdouble samples[][3] = {
+		{0.50, 0.50, 0.00}, /* Split of the left child */
+		{0.00, 0.50, 0.50}, /* Split of the right child */
+		{1/3., 1/3., 1/3.}, /* Center */
+	};
+	for (int i = 0; i < G_N_ELEMENTS(samples); i++)
+		*deviation = MAX(*deviation,
+			_roam_triangle_residual(l, m, r, height_func, height_data,
+				samples[i][0], samples[i][1], samples[i][2]));
+	*deviation = MIN(*deviation, *bound);
+}
+
+/**
+ * roam_triangle_update_deviation:
+ * @triangle: the triangle
+ * @sphere:   the sphere to use when finding the terrain under the triangle
+ *
+ * Update the geometric error of a triangle. This is how far the terrain is
+ * from the plane of the triangle, measured at the split point and, where the
+ * terrain is rough enough to hide a larger error, at the centers of the
+ * children and the center of the triangle. The elevation range under the
+ * triangle bounds the error. Called when the heights of the points change.
+ */
+void roam_triangle_update_deviation(RoamTriangle *triangle, RoamSphere *sphere)
+{
+	roam_triangle_calc_deviation(
+		triangle->p.l->to, triangle->p.m->to, triangle->p.r->to,
+		triangle->split->to,
+		triangle->split->height_func, triangle->split->height_data,
+		triangle->edge.n, triangle->edge.s,
+		triangle->edge.e, triangle->edge.w,
+		sphere, &triangle->deviation, &triangle->bound);
+}
+
 /**
  * roam_triangle_update_errors:
  * @triangle: the triangle
@@ -361,7 +486,13 @@ void roam_triangle_update_errors(RoamTriangle *triangle, RoamSphere *sphere)
 		gdouble pxdist = (l->px + r->px)/2 - split->px;
 		gdouble pydist = (l->py + r->py)/2 - split->py;
 
-		triangle->error = sqrt(pxdist*pxdist + pydist*pydist);
+		/* Geometric error, scaled to pixels using the l-r edge */
+		gdouble lrpx = r->px - l->px;
+		gdouble lrpy = r->py - l->py;
+		gdouble lrm  = distd((gdouble*)l, (gdouble*)r);
+		gdouble pdev = triangle->deviation * sqrt(lrpx*lrpx + lrpy*lrpy) / lrm;
+
+		triangle->error = MAX(sqrt(pxdist*pxdist + pydist*pydist), pdev);
 
 		/* Multiply by size of triangle */
 		double size = -( l->px * (m->py - r->py) +
@@ -379,6 +510,29 @@ void roam_triangle_update_errors(RoamTriangle *triangle, RoamSphere *sphere)
 	}
 }
 
+/* Start moving a point from @from to its position on the surface */
+static void _roam_sphere_morph(RoamSphere *sphere, RoamPoint *point,
+		gdouble *from)
+{
+	for (int i = 0; i < 3; i++)
+		point->from[i] = from[i];
+	point->x     = from[0];
+	point->y     = from[1];
+	point->z     = from[2];
+	point->morph = 0;
+	g_hash_table_add(sphere->morphing, point);
+}
+
+/* Stop moving a point which is no longer part of the mesh */
+static void _roam_sphere_unmorph(RoamSphere *sphere, RoamPoint *point)
+{
+	point->x     = point->to[0];
+	point->y     = point->to[1];
+	point->z     = point->to[2];
+	point->morph = 1;
+	g_hash_table_remove(sphere->morphing, point);
+}
+
 /**
  * roam_triangle_split:
  * @triangle: the triangle
@@ -403,8 +557,14 @@ void roam_triangle_split(RoamTriangle *triangle, RoamSphere *sphere)
 
 	RoamDiamond *dia = roam_diamond_new(s, b);
 
-	/* Add new triangles */
+	/* Grow the new point out of the edge it splits */
 	RoamPoint *mid = triangle->split;
+	gdouble edge[3] = {(s->p.l->x + s->p.r->x)/2,
+	                   (s->p.l->y + s->p.r->y)/2,
+	                   (s->p.l->z + s->p.r->z)/2};
+	_roam_sphere_morph(sphere, mid, edge);
+
+	/* Add new triangles */
 	RoamTriangle *sl = s->kids[0] = roam_triangle_new(s->p.m, mid, s->p.l, dia); // Self Left
 	RoamTriangle *sr = s->kids[1] = roam_triangle_new(s->p.r, mid, s->p.m, dia); // Self Right
 	RoamTriangle *bl = b->kids[0] = roam_triangle_new(b->p.m, mid, b->p.l, dia); // Base Left
@@ -589,6 +749,7 @@ void roam_diamond_merge(RoamDiamond *diamond, RoamSphere *sphere)
 
 	/* Remove and free diamond and child triangles */
 	roam_diamond_remove(diamond, sphere);
+	_roam_sphere_unmorph(sphere, sl->p.m);
 	g_assert(sl->p.m == sr->p.m &&
 	         sr->p.m == bl->p.m &&
 	         bl->p.m == br->p.m);
@@ -632,6 +793,7 @@ RoamSphere *roam_sphere_new()
 	sphere->triangles   = g_pqueue_new((GCompareDataFunc)tri_cmp, NULL);
 	sphere->diamonds    = g_pqueue_new((GCompareDataFunc)dia_cmp, NULL);
 	sphere->view        = g_new0(RoamView, 1);
+	sphere->morphing    = g_hash_table_new(NULL, NULL);
 
 	RoamPoint *vertexes[] = {
 		roam_point_new( 90,   0,  0), // 0 (North)
@@ -796,6 +958,60 @@ gint roam_sphere_split_merge(RoamSphere *sphere)
 	return iters;
 }
 
+/**
+ * roam_sphere_move_point:
+ * @sphere: the sphere
+ * @point:  the point
+ * @x:      the new x coordinate
+ * @y:      the new y coordinate
+ * @z:      the new z coordinate
+ *
+ * Change the position of a point on the surface, for instance when new terrain
+ * is loaded. Points which are part of the mesh move there smoothly over the
+ * next few calls to roam_sphere_update_morph(), other points move right away.
+ */
+void roam_sphere_move_point(RoamSphere *sphere, RoamPoint *point,
+		gdouble x, gdouble y, gdouble z)
+{
+	if (point->to[0] == x && point->to[1] == y && point->to[2] == z)
+		return;
+	gdouble from[3] = {point->x, point->y, point->z};
+	point->to[0] = x;
+	point->to[1] = y;
+	point->to[2] = z;
+	if (point->tris)
+		_roam_sphere_morph(sphere, point, from);
+	else
+		_roam_sphere_unmorph(sphere, point);
+}
+
+/**
+ * roam_sphere_update_morph:
+ * @sphere: the sphere
+ * @step:   the fraction of a whole morph to advance by
+ *
+ * Move points which were split or changed height toward their positions on
+ * the surface. Should be called once for each frame.
+ *
+ * Returns: %TRUE if some points are still moving
+ */
+gboolean roam_sphere_update_morph(RoamSphere *sphere, gdouble step)
+{
+	GHashTableIter iter;
+	RoamPoint *point;
+	g_hash_table_iter_init(&iter, sphere->morphing);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&point, NULL)) {
+		point->morph = MIN(point->morph + step, 1);
+		gdouble t = point->morph * point->morph * (3 - 2*point->morph);
+		point->x = point->from[0] + (point->to[0] - point->from[0]) * t;
+		point->y = point->from[1] + (point->to[1] - point->from[1]) * t;
+		point->z = point->from[2] + (point->to[2] - point->from[2]) * t;
+		if (point->morph >= 1)
+			g_hash_table_iter_remove(&iter);
+	}
+	return g_hash_table_size(sphere->morphing) > 0;
+}
+
 /**
  * roam_sphere_draw:
  * @sphere: the sphere
@@ -900,6 +1116,100 @@ GList *roam_sphere_get_intersect(RoamSphere *sphere, gboolean all,
 	return list;
 }
 
+/* Ray-triangle intersection (Moller-Trumbore), returns the distance along
+ * dir to the hit or -1 if the ray misses */
+static gdouble _roam_triangle_intersect(RoamTriangle *triangle,
+		const gdouble *start, const gdouble *dir)
+{
+	gdouble *a = (gdouble*)triangle->p.l;
+	gdouble *b = (gdouble*)triangle->p.m;
+	gdouble *c = (gdouble*)triangle->p.r;
+	gdouble ab[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+	gdouble ac[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+	gdouble as[3] = {start[0]-a[0], start[1]-a[1], start[2]-a[2]};
+	gdouble p[3], q[3];
+	crossd((gdouble*)dir, ac, p);
+	gdouble det = ab[0]*p[0] + ab[1]*p[1] + ab[2]*p[2];
+	if (fabs(det) < 1e-12)
+		return -1;
+	gdouble u = (as[0]*p[0] + as[1]*p[1] + as[2]*p[2]) / det;
+	if (u < 0 || u > 1)
+		return -1;
+	crossd(as, ab, q);
+	gdouble v = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2]) / det;
+	if (v < 0 || u + v > 1)
+		return -1;
+	return (ac[0]*q[0] + ac[1]*q[1] + ac[2]*q[2]) / det;
+}
+
+/* Check if a ray passes within radius of center */
+static gboolean _roam_ray_near(const gdouble *start, const gdouble *dir,
+		gdouble *center, gdouble radius)
+{
+	gdouble sc[3] = {center[0]-start[0], center[1]-start[1], center[2]-start[2]};
+	gdouble dd = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+	gdouble t  = (sc[0]*dir[0] + sc[1]*dir[1] + sc[2]*dir[2]) / dd;
+	t = MAX(t, 0);
+	gdouble near[3] = {start[0] + dir[0]*t - center[0],
+	                   start[1] + dir[1]*t - center[1],
+	                   start[2] + dir[2]*t - center[2]};
+	return lengthd(near) <= radius;
+}
+
+static gdouble _roam_sphere_intersect_rec(RoamTriangle *triangle,
+		const gdouble *start, const gdouble *dir)
+{
+	if (!triangle->kids[0] || !triangle->kids[1])
+		return _roam_triangle_intersect(triangle, start, dir);
+
+	/* The children stay close to the parent triangle, they move away from it
+	 * by at most the curvature of the sphere and the relief of the terrain
+	 * which are both included in the bound */
+	gdouble *l = (gdouble*)triangle->p.l;
+	gdouble *m = (gdouble*)triangle->p.m;
+	gdouble *r = (gdouble*)triangle->p.r;
+	gdouble center[3] = {(l[0]+m[0]+r[0])/3,
+	                     (l[1]+m[1]+r[1])/3,
+	                     (l[2]+m[2]+r[2])/3};
+	gdouble radius = MAX(distd(center, l), MAX(distd(center, m),
+	                 distd(center, r))) + 2*triangle->bound;
+	if (!_roam_ray_near(start, dir, center, radius))
+		return -1;
+
+	gdouble t0 = _roam_sphere_intersect_rec(triangle->kids[0], start, dir);
+	gdouble t1 = _roam_sphere_intersect_rec(triangle->kids[1], start, dir);
+	if (t0 < 0) return t1;
+	if (t1 < 0) return t0;
+	return MIN(t0, t1);
+}
+
+/**
+ * roam_sphere_intersect:
+ * @sphere: the sphere
+ * @start:  the start of the ray in model coordinates
+ * @dir:    the direction of the ray
+ * @dist:   the distance to the intersection, as a multiple of @dir
+ *
+ * Find the closest point where a ray hits the surface of the sphere as it is
+ * currently drawn. Only the triangles near the ray are tested.
+ *
+ * Returns: TRUE if the ray hits the surface in front of @start
+ */
+gboolean roam_sphere_intersect(RoamSphere *sphere,
+		const gdouble *start, const gdouble *dir, gdouble *dist)
+{
+	gdouble best = -1;
+	for (int i = 0; i < G_N_ELEMENTS(sphere->roots); i++) {
+		gdouble t = _roam_sphere_intersect_rec(sphere->roots[i], start, dir);
+		if (t >= 0 && (best < 0 || t < best))
+			best = t;
+	}
+	if (best < 0)
+		return FALSE;
+	*dist = best;
+	return TRUE;
+}
+
 static void roam_sphere_free_tri(RoamTriangle *triangle)
 {
 	if (--triangle->p.l->tris == 0) g_free(triangle->p.l);
@@ -921,6 +1231,7 @@ void roam_sphere_free(RoamSphere *sphere)
 	while (sphere->polys > 8)
 		roam_sphere_merge_one(sphere);
 	/* TODO: free points */
+	g_hash_table_destroy(sphere->morphing);
 	g_pqueue_foreach(sphere->triangles, (GFunc)roam_sphere_free_tri, NULL);
 	g_pqueue_free(sphere->triangles);
 	g_pqueue_free(sphere->diamonds);
@@ -38,6 +38,23 @@ typedef struct _RoamSphere   RoamSphere;
  */
 typedef gdouble (*RoamHeightFunc)(gdouble lat, gdouble lon, gpointer user_data);
 
+/**
+ * RoamRangeFunc:
+ * @n:         the northern edge of the area
+ * @s:         the southern edge of the area
+ * @e:         the eastern edge of the area
+ * @w:         the western edge of the area
+ * @min:       location to store the lowest elevation
+ * @max:       location to store the highest elevation
+ * @user_data: user data passed to the function
+ *
+ * See #GritsRangeFunc
+ *
+ * Returns: %TRUE if the range is known
+ */
+typedef gboolean (*RoamRangeFunc)(gdouble n, gdouble s, gdouble e, gdouble w,
+		gdouble *min, gdouble *max, gpointer user_data);
+
 /* Misc */
 /**
  * RoamView:
@@ -68,7 +85,7 @@ struct _RoamView {
  */
 struct _RoamPoint {
 	/*< private >*/
-	gdouble  x, y, z;    /* Model coordinates */
+	gdouble  x, y, z;    /* Model coordinates, as drawn */
 	gdouble  px, py, pz; /* Projected coordinates */
 	gint     pversion;   /* Version of cached projection */
 
@@ -81,6 +98,11 @@ struct _RoamPoint {
 	/* For terrain */
 	RoamHeightFunc height_func;
 	gpointer       height_data;
+
+	/* For geomorphing */
+	gdouble  to[3];      /* Model coordinates on the surface */
+	gdouble  from[3];    /* Model coordinates the morph started at */
+	gdouble  morph;      /* Morph progress, 1 when finished */
 };
 RoamPoint *roam_point_new(double lat, double lon, double elev);
 void roam_point_add_triangle(RoamPoint *point, RoamTriangle *triangle);
@@ -115,6 +137,8 @@ struct _RoamTriangle {
 	RoamDiamond *parent;   /* Parent diamond */
 	RoamTriangle *kids[2]; /* Higher-res triangles */
 	double norm[3];        /* Surface normal */
+	double deviation;      /* Geometric error in meters */
+	double bound;          /* Upper bound of the error of the children */
 	double error;          /* Screen space error */
 	GPQueueHandle handle;
 
@@ -128,6 +152,13 @@ void roam_triangle_add(RoamTriangle *triangle,
 		RoamTriangle *left, RoamTriangle *base, RoamTriangle *right,
 		RoamSphere *sphere);
 void roam_triangle_remove(RoamTriangle *triangle, RoamSphere *sphere);
+void roam_triangle_update_normal(RoamTriangle *triangle);
+void roam_triangle_calc_deviation(
+		const gdouble *l, const gdouble *m, const gdouble *r,
+		const gdouble *split, RoamHeightFunc height_func, gpointer height_data,
+		gdouble n, gdouble s, gdouble e, gdouble w,
+		RoamSphere *sphere, gdouble *deviation, gdouble *bound);
+void roam_triangle_update_deviation(RoamTriangle *triangle, RoamSphere *sphere);
 void roam_triangle_update_errors(RoamTriangle *triangle, RoamSphere *sphere);
 void roam_triangle_split(RoamTriangle *triangle, RoamSphere *sphere);
 void roam_triangle_draw(RoamTriangle *triangle);
@@ -180,6 +211,13 @@ struct _RoamSphere {
 
 	/* For get_intersect */
 	RoamTriangle *roots[8]; /* Original 8 triangles */
+
+	/* For terrain */
+	RoamRangeFunc range_func;
+	gpointer      range_data;
+
+	/* For geomorphing */
+	GHashTable *morphing;   /* Points which are moving */
 };
 RoamSphere *roam_sphere_new();
 void roam_sphere_update_view(RoamSphere *sphere);
@@ -187,10 +225,15 @@ void roam_sphere_update_errors(RoamSphere *sphere);
 void roam_sphere_split_one(RoamSphere *sphere);
 void roam_sphere_merge_one(RoamSphere *sphere);
 gint roam_sphere_split_merge(RoamSphere *sphere);
+void roam_sphere_move_point(RoamSphere *sphere, RoamPoint *point,
+		gdouble x, gdouble y, gdouble z);
+gboolean roam_sphere_update_morph(RoamSphere *sphere, gdouble step);
 void roam_sphere_draw(RoamSphere *sphere);
 void roam_sphere_draw_normals(RoamSphere *sphere);
 GList *roam_sphere_get_intersect(RoamSphere *sphere, gboolean all,
 		gdouble n, gdouble s, gdouble e, gdouble w);
+gboolean roam_sphere_intersect(RoamSphere *sphere,
+		const gdouble *start, const gdouble *dir, gdouble *dist);
 void roam_sphere_free(RoamSphere *sphere);
 
 #endif